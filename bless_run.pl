@@ -7,7 +7,8 @@ use lib qw(/usr/mports/Tools/lib);
 use Magus;
 use Getopt::Std;
 use File::Path;
-use File::Copy qw(move);
+use File::Copy qw(move copy);
+use Digest::SHA;
 use YAML qw(LoadFile);
 
 
@@ -24,8 +25,8 @@ bless_run.pl -- Promote A Run
 =head1 DESCRIPTION
 
 A run in magus can be blessed into a index that is used by the mport package
-system.  This index contains a list of availible packages, a list of
-aliases, and a list of mirrors.  The index is an L<sqlite3> database file that
+system.  This index contains a list of availible packages, their depends, a
+list of aliases, and a list of mirrors.  The index is an L<sqlite3> database file that
 is compressed with L<bzip2>.
 
 This script will create the index file and copy the bundle files into the 
@@ -33,6 +34,11 @@ given ftp root.  The ftp root is organized as such:
 
   $FTPROOT/$run->arch/$run->osversion/
         index.db.bz2
+        index.gen
+        changesets/
+                2.changeset
+                3.changeset
+                ...
         bundle1.mport
         bundle2.mport
         ...
@@ -58,11 +64,15 @@ sub main {
   my $index = make_db_file(\%opts, 'index.db');
 
   build_packages_table(\%opts, $index, $run);
+  build_depends_table(\%opts, $index, $run);
   build_aliases_table(\%opts, $index, $run);
   build_mirror_list(\%opts, $index, $run);
   copy_bundle_files(\%opts, $index, $run);
+  build_bundle_hashes(\%opts, $index, $run);
+  build_generation(\%opts, $index, $run);
   
   finish_index(\%opts, $index, 'index.db');  
+  write_manifest(\%opts);
 
   move_dirs(\%opts);
 }
@@ -82,16 +92,23 @@ sub make_db_file {
   
   my $dbh = DBI->connect("dbi:SQLite:dbname=$file","","", { RaiseError => 1 });
   
-  $dbh->do("CREATE TABLE packages (pkg text NOT NULL, version text NOT NULL, comment text NOT NULL, www text NOT NULL, bundlefile text NOT NULL)");
+  # libmport applies changesets between index generations, and the session
+  # extension only tracks tables with a primary key.
+  $dbh->do("CREATE TABLE packages (pkg text NOT NULL PRIMARY KEY, version text NOT NULL, comment text NOT NULL, www text NOT NULL, bundlefile text NOT NULL, hash text, meta_hash text)");
   $dbh->do("CREATE UNIQUE INDEX packages_pkg ON packages (pkg)");
   
-  $dbh->do("CREATE TABLE categories (pkg text NOT NULL, category text NOT NULL)");
+  $dbh->do("CREATE TABLE depends (pkg text NOT NULL, depend_pkgname text NOT NULL, depend_pkgversion text, PRIMARY KEY (pkg, depend_pkgname))");
+  $dbh->do("CREATE INDEX depends_pkg ON depends (pkg)");
+  
+  $dbh->do("CREATE TABLE categories (pkg text NOT NULL, category text NOT NULL, PRIMARY KEY (pkg, category))");
   $dbh->do("CREATE INDEX categories_pkg ON categories (pkg, category)");
 
-  $dbh->do("CREATE TABLE aliases (alias text NOT NULL, pkg text NOT NULL)");
+  $dbh->do("CREATE TABLE aliases (alias text NOT NULL PRIMARY KEY, pkg text NOT NULL)");
   $dbh->do("CREATE UNIQUE INDEX aliases_als ON aliases (alias)");
   
-  $dbh->do("CREATE TABLE mirrors (mirror text NOT NULL, country text NOT NULL)");
+  $dbh->do("CREATE TABLE mirrors (mirror text NOT NULL, country text NOT NULL, PRIMARY KEY (mirror, country))");
+  
+  $dbh->do("CREATE TABLE meta (field text NOT NULL PRIMARY KEY, value text NOT NULL)");
   
   return $dbh;
 }
@@ -118,6 +135,93 @@ sub build_packages_table {
 }  
   
 
+sub build_depends_table {
+  my ($opts, $index, $run) = @_;
+
+  my $ports = $run->ports;
+  
+  $index->begin_work;
+  
+  # libmport plans whole installs from this, so it has to match the packages table.
+  # A port can list the same dependency more than once (as a build and a run
+  # depend, say), and it only needs the one row.
+  my $sth = $index->prepare("INSERT OR IGNORE INTO depends (pkg, depend_pkgname, depend_pkgversion) VALUES (?,?,?)");
+  
+  while (my $port = $ports->next) {
+    next unless $port->status eq 'pass' || $port->status eq 'warn';
+    
+    foreach my $depend ($port->depends) {
+      $sth->execute($port->name, $depend->name, undef);
+    }
+  }
+  
+  $sth->finish;
+  
+  $index->commit;
+}
+
+
+# libmport's download cache is keyed by these, and checks every download 
+# against them.  meta_hash covers just the stub and metafiles at the front of
+# the bundle, so they can be checked before a bundle installed as it 
+# downloads has finished downloading; see meta_hash() for the format.
+sub build_bundle_hashes {
+  my ($opts, $index, $run) = @_;
+  
+  my $bundles = $index->selectcol_arrayref("SELECT bundlefile FROM packages");
+  
+  $index->begin_work;
+  
+  my $sth = $index->prepare("UPDATE packages SET hash=?, meta_hash=? WHERE bundlefile=?");
+  
+  foreach my $bundle (@$bundles) {
+    my $file = "$opts->{f}/$bundle";
+    
+    open(my $fh, '<', $file) || die "Couldn't open $file: $!\n";
+    binmode($fh);
+    
+    $sth->execute(Digest::SHA->new(256)->addfile($fh)->hexdigest, meta_hash($file), $bundle);
+    
+    close($fh);
+  }
+  
+  $sth->finish;
+  
+  $index->commit;
+}
+
+
+# The metafiles are the + entries the bundle starts with.  Each one is hashed
+# as its name, a newline, its length in decimal, a newline, then its data - 
+# the same way bundle_read.c hashes them as they come off the wire.
+sub meta_hash {
+  my ($file) = @_;
+  
+  my $sha = Digest::SHA->new(256);
+  
+  open(my $list, '-|', 'tar', '-tf', $file) || die "Couldn't list $file: $!\n";
+  
+  while (my $name = <$list>) {
+    chomp($name);
+    
+    last unless $name =~ /^\+/;
+    next if $name =~ m{/$};
+    
+    open(my $fh, '-|', 'tar', '-xOf', $file, $name) || die "Couldn't read $name from $file: $!\n";
+    binmode($fh);
+    my $data = do { local $/; <$fh> };
+    close($fh) || die "Couldn't read $name from $file\n";
+    
+    $data = '' unless defined $data;
+    $sha->add("$name\n" . length($data) . "\n", $data);
+  }
+  
+  close($list);
+  
+  return $sha->hexdigest;
+}  
+  
+
 sub build_aliases_table {
   my ($opts, $index, $run) = @_;
   
@@ -143,7 +247,7 @@ sub build_mirror_list {
   
   $index->begin_work;
   
-  my $sth = $index->prepare("INSERT INTO mirrors (mirror, country) VALUES (?,?)");
+  my $sth = $index->prepare("INSERT OR IGNORE INTO mirrors (mirror, country) VALUES (?,?)");
   
   while (my ($country, $list) = each %$mirrors) {
     foreach my $mirror (@$list) {
@@ -156,10 +260,91 @@ sub build_mirror_list {
 }
 
 
+# Each index is a generation, one after the last published one.  index.gen
+# has the generation, the digest of the index's contents (see index_digest()),
+# and the size of index.db.bz2 (see write_manifest()); clients check it 
+# before anything else.  changesets/N.changeset turns generation N-1 into N,
+# so clients can catch up without the whole index.  We keep the last 
+# $MAX_CHANGESETS of them; a client further behind than that downloads the
+# whole thing.
+my $MAX_CHANGESETS = 30;
+
+sub build_generation {
+  my ($opts, $index, $run) = @_;
+  
+  (my $prevdir = $opts->{f}) =~ s/.new$//;
+  my $generation = 1;
+  
+  if (open(my $fh, '<', "$prevdir/index.gen")) {
+    my ($prev) = split(' ', scalar(<$fh>));
+    close($fh);
+    $generation = $prev + 1 if $prev;
+  }
+  
+  $index->do("INSERT INTO meta (field, value) VALUES ('generation', ?)", undef, $generation);
+  
+  $opts->{generation} = $generation;
+  $opts->{digest}     = index_digest($index);
+  
+  mkpath("$opts->{f}/changesets");
+  
+  return if $generation == 1;
+  
+  foreach my $n (($generation - $MAX_CHANGESETS + 1) .. ($generation - 1)) {
+    next unless -e "$prevdir/changesets/$n.changeset";
+    copy("$prevdir/changesets/$n.changeset", "$opts->{f}/changesets/$n.changeset") 
+      || die "Couldn't copy changeset $n: $!\n";
+  }
+  
+  $index->disconnect;
+  
+  my $prev = "$opts->{f}/index.prev.db";
+  my @cmnds = (
+    "bunzip2 -c $prevdir/index.db.bz2 > $prev",
+    "sqldiff --changeset $opts->{f}/changesets/$generation.changeset $prev $opts->{f}/index.db",
+  );
+  
+  foreach my $cmnd (@cmnds) {
+    if (system($cmnd) != 0) {
+      die "$cmnd returned non-zero: $?\n";
+    }
+  }
+  
+  unlink($prev);
+}
+
+
+# A digest of what's in the index, rather than of the file; sqlite is free to 
+# lay out the same rows differently.  libmport's index_digest() in 
+# index_update.c has to produce the same thing.
+sub index_digest {
+  my ($index) = @_;
+  
+  my $sha = Digest::SHA->new(256);
+  
+  foreach my $table (qw(aliases categories depends meta mirrors packages)) {
+    my $cols = $index->selectall_arrayref("PRAGMA table_info($table)");
+    next unless @$cols;
+    
+    my $order = join(',', 1 .. scalar(@$cols));
+    my $sth   = $index->prepare("SELECT * FROM $table ORDER BY $order");
+    
+    $sha->add("$table\n");
+    $sth->execute;
+    
+    while (my $row = $sth->fetchrow_arrayref) {
+      $sha->add(join("\t", map { defined($_) ? $_ : '\N' } @$row), "\n");
+    }
+  }
+  
+  return $sha->hexdigest;
+}
+
+
 sub finish_index {
   my ($opts, $index, $file) = @_;
   
-  $index->disconnect;
+  $index->disconnect if $index->{Active};
 
   my $cmnd = "bzip2 $opts->{f}/$file";
   
@@ -171,6 +356,20 @@ sub finish_index {
 }
 
 
+# The manifest goes out last, once the index it describes is done.  It's a 
+# single line, "generation digest size", so a client with a current index
+# learns that in one small (and usually not-modified) request.
+sub write_manifest {
+  my ($opts) = @_;
+  
+  my $size = -s "$opts->{f}/index.db.bz2" || die "Couldn't stat $opts->{f}/index.db.bz2: $!\n";
+  
+  open(my $fh, '>', "$opts->{f}/index.gen") || die "Couldn't open $opts->{f}/index.gen: $!\n";
+  print $fh "$opts->{generation} $opts->{digest} $size\n";
+  close($fh) || die "Couldn't write $opts->{f}/index.gen: $!\n";
+}
+
+
 sub move_dirs {
   my ($opts) = @_;
   
@@ -32,8 +32,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sha256.h>
 #include <archive_entry.h>
 
+struct segment_reader {
+  int fd;
+  off_t pos;
+  off_t end;
+  char buff[10240];
+};
+
+/* a bundle coming in over the network, hashed as it goes by */
+struct stream_reader {
+  FILE *fp;
+  SHA256_CTX ctx;
+  SHA256_CTX meta_ctx;  /* just the stub and metafiles; see hash_metafile() */
+  off_t got;
+  off_t size;   /* 0 if the server didn't say */
+  char *hash;
+  char *meta_hash;
+  char buff[10240];
+};
+
+static int bundle_threads(mportBundleRead *);
+static int read_toc(mportBundleRead *, off_t);
+static int open_range(mportBundleRead *, off_t, off_t);
+static int open_segment(mportBundleRead *, int);
+static ssize_t segment_read(struct archive *, void *, const void **);
+static int segment_close(struct archive *, void *);
+static ssize_t stream_read(struct archive *, void *, const void **);
+static void hash_metafile(mportBundleRead *, const char *, const char *, size_t);
+static int verify_meta(mportBundleRead *);
+static int check_bundle_compression(mportInstance *, mportBundleRead *, int);
+static int read_header(mportBundleRead *, struct archive_entry **, int);
+static int read_entry_data(mportBundleRead *, struct archive_entry *, int, char **, size_t *);
+static void free_metafiles(mportBundleRead *);
+
 /*
  * mport_bundle_read_new()
  *
@@ -42,35 +80,416 @@
  */
 mportBundleRead * mport_bundle_read_new()
 {
-  return (mportBundleRead *)calloc(1, sizeof(mportBundleRead));
+  mportBundleRead *bundle;
+  
+  if ((bundle = (mportBundleRead *)calloc(1, sizeof(mportBundleRead))) != NULL)
+    bundle->fd = -1;
+    
+  return bundle;
 }
 
 
 /*
  * mport_bundle_read_init(bundle, filename)
  *
- * connect the bundle struct to the file at filename.
+ * connect the bundle struct to the file at filename.  If the bundle is
+ * segmented, the table of contents is loaded and reading starts at the
+ * meta segment.
  */
 int mport_bundle_read_init(mportBundleRead *bundle, const char *filename)
 {
+  struct stat st;
+  
   if ((bundle->filename = strdup(filename)) == NULL) 
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't dup filename");
     
+  if ((bundle->fd = open(bundle->filename, O_RDONLY)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", bundle->filename, strerror(errno));
+  
+  if (fstat(bundle->fd, &st) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't stat %s: %s", bundle->filename, strerror(errno));
+  
+  if (read_toc(bundle, st.st_size) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (bundle->toc != NULL)
+    return open_segment(bundle, 0);
+    
+  return open_range(bundle, 0, st.st_size);
+}
+    
+  
+/*
+ * mport_bundle_read_init_stream(bundle, name, fp, size, hash, meta_hash)
+ *
+ * connect the bundle struct to a bundle being downloaded, so it can be
+ * installed as it comes in.  name is only for messages; size is the 
+ * expected length (0 if not known), hash its sha256, and meta_hash the 
+ * sha256 of its stub and metafiles, which prep_for_install() checks before
+ * using them.  The bundle takes fp over.  A stream can only be read front
+ * to back, so segmented bundles are read as if they weren't (and can't be
+ * installed this way), and the files can't be trusted until
+ * mport_bundle_read_verify_stream().
+ */
+int mport_bundle_read_init_stream(mportBundleRead *bundle, const char *name, FILE *fp, off_t size, const char *hash, const char *meta_hash)
+{
+  struct stream_reader *reader;
+  
+  if ((reader = (struct stream_reader *)calloc(1, sizeof(struct stream_reader))) == NULL) {
+    fclose(fp);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  reader->fp   = fp;
+  reader->size = size;
+  SHA256_Init(&reader->ctx);
+  SHA256_Init(&reader->meta_ctx);
+  bundle->stream = reader;
+  
+  if ((reader->hash = strdup(hash)) == NULL || (reader->meta_hash = strdup(meta_hash)) == NULL || (bundle->filename = strdup(name)) == NULL) 
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
   if ((bundle->archive = archive_read_new()) == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't dup filename");
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate read archive struct");
+  
+  archive_read_support_format_tar(bundle->archive);
+  mport_bundle_read_support_compression(bundle->archive);
+  
+  /* no close callback; the reader belongs to the bundle, and verifying needs
+   * it after libarchive is done */
+  if (archive_read_open(bundle->archive, reader, NULL, stream_read, NULL) != ARCHIVE_OK) 
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: %s (it may use a compression this mport doesn't support)", bundle->filename, archive_error_string(bundle->archive));
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_bundle_read_verify_stream(bundle)
+ *
+ * read whatever is left of a streamed bundle, and check that what came in 
+ * was the bundle the index promised.  Does nothing for a bundle file.
+ */
+int mport_bundle_read_verify_stream(mportBundleRead *bundle)
+{
+  struct stream_reader *reader = bundle->stream;
+  char digest[65];
+  size_t got;
+  
+  if (reader == NULL)
+    return MPORT_OK;
+  
+  /* the end of the tar archive, and of its compression */
+  while ((got = fread(reader->buff, 1, sizeof(reader->buff), reader->fp)) > 0) {
+    SHA256_Update(&reader->ctx, reader->buff, got);
+    reader->got += got;
+  }
+  
+  if (ferror(reader->fp))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read %s: %s", bundle->filename, strerror(errno));
+  
+  if (reader->size > 0 && reader->got != reader->size)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: got %jd of %jd bytes", bundle->filename, (intmax_t)reader->got, (intmax_t)reader->size);
+  
+  (void)SHA256_End(&reader->ctx, digest);
+  
+  if (strcmp(digest, reader->hash) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: sha256 is %s, expected %s", bundle->filename, digest, reader->hash);
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_bundle_read_seek_pkg(bundle, pkgname)
+ *
+ * position a segmented bundle at the start of pkgname's files, without 
+ * decompressing anything that comes before them.
+ */
+int mport_bundle_read_seek_pkg(mportBundleRead *bundle, const char *pkgname)
+{
+  int i;
+  
+  if (bundle->toc == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: can't seek in a bundle without a table of contents", bundle->filename);
+  
+  for (i = 0; i < bundle->nsegments; i++) {
+    if (strcmp(bundle->toc[i].name, pkgname) == 0)
+      break;
+  }
+  
+  if (i == bundle->nsegments)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: no segment for %s", bundle->filename, pkgname);
+  
+  /* already there; at most the lookahead entry has been read */
+  if (i == bundle->segment && (bundle->seg_entries == 0 || (bundle->seg_entries == 1 && bundle->firstreal != NULL)))
+    return MPORT_OK;
+  
+  bundle->firstreal = NULL;
+  
+  return open_segment(bundle, i);
+}
+
+
+/*
+ * mport_bundle_read_segment_compression(bundle, pkgname, &compression)
+ *
+ * sniff the codec pkgname's segment was compressed with.
+ */
+int mport_bundle_read_segment_compression(mportBundleRead *bundle, const char *pkgname, mportCompression *compression)
+{
+  static const unsigned char xz[]   = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+  static const unsigned char zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+  unsigned char magic[6];
+  int i;
+  
+  for (i = 0; i < bundle->nsegments; i++) {
+    if (strcmp(bundle->toc[i].name, pkgname) == 0)
+      break;
+  }
+  
+  if (i == bundle->nsegments)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: no segment for %s", bundle->filename, pkgname);
+  
+  if (bundle->toc[i].length < (off_t)sizeof(magic) || pread(bundle->fd, magic, sizeof(magic), bundle->toc[i].offset) != sizeof(magic))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: segment for %s is truncated", bundle->filename, pkgname);
+  
+  if (memcmp(magic, "BZh", 3) == 0)
+    *compression = MPORT_COMPRESS_BZIP2;
+  else if (memcmp(magic, xz, sizeof(xz)) == 0)
+    *compression = MPORT_COMPRESS_XZ;
+  else if (memcmp(magic, zstd, sizeof(zstd)) == 0)
+    *compression = MPORT_COMPRESS_ZSTD;
+  else
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: unknown compression on segment for %s", bundle->filename, pkgname);
+  
+  return MPORT_OK;
+}
+
+
+/* load the table of contents, if the bundle has one. */
+static int read_toc(mportBundleRead *bundle, off_t size)
+{
+  unsigned char trailer[MPORT_TOC_TRAILER_LEN];
+  uint64_t where = 0;
+  off_t tocoff, toclen, offset, length;
+  char *toc, *line, *next, *name;
+  int i, n;
+  
+  if (size < MPORT_TOC_TRAILER_LEN)
+    return MPORT_OK;
+  
+  if (pread(bundle->fd, trailer, sizeof(trailer), size - MPORT_TOC_TRAILER_LEN) != sizeof(trailer))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read %s: %s", bundle->filename, strerror(errno));
+  
+  if (memcmp(trailer, MPORT_TOC_MAGIC, MPORT_TOC_MAGIC_LEN) != 0)
+    return MPORT_OK;
+  
+  for (i = MPORT_TOC_MAGIC_LEN; i < MPORT_TOC_TRAILER_LEN; i++)
+    where = (where << 8) | trailer[i];
+  
+  tocoff = (off_t)where;
+  toclen = size - MPORT_TOC_TRAILER_LEN - tocoff;
+  
+  if (where > (uint64_t)size || toclen <= 0 || toclen > MPORT_TOC_MAX_SIZE)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: corrupt bundle table of contents", bundle->filename);
+  
+  if ((toc = (char *)malloc((size_t)toclen + 1)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if (pread(bundle->fd, toc, (size_t)toclen, tocoff) != toclen) {
+    free(toc);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read %s: %s", bundle->filename, strerror(errno));
+  }
+  toc[toclen] = '\0';
+  
+  for (n = 0, line = toc; *line != '\0'; line++) {
+    if (*line == '\n')
+      n++;
+  }
+  
+  /* not a single whole line; calloc(0) could pass for running out of memory */
+  if (n == 0) {
+    free(toc);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: corrupt bundle table of contents", bundle->filename);
+  }
+  
+  if ((bundle->toc = (mportBundleSegment *)calloc(n, sizeof(mportBundleSegment))) == NULL) {
+    free(toc);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  for (line = toc; (next = strchr(line, '\n')) != NULL; line = next + 1) {
+    intmax_t o, l;
+    int used;
+    
+    *next = '\0';
     
+    if (sscanf(line, "%jd %jd %n", &o, &l, &used) != 2 || *(name = line + used) == '\0')
+      goto CORRUPT;
+    
+    offset = (off_t)o;
+    length = (off_t)l;
+    
+    if (offset < 0 || length < 0 || offset > tocoff || length > tocoff - offset)
+      goto CORRUPT;
+    
+    if ((bundle->toc[bundle->nsegments].name = strdup(name)) == NULL) {
+      free(toc);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    bundle->toc[bundle->nsegments].offset = offset;
+    bundle->toc[bundle->nsegments].length = length;
+    bundle->nsegments++;
+  }
+  
+  free(toc);
+  
+  if (bundle->nsegments == 0 || strcmp(bundle->toc[0].name, MPORT_TOC_META) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: bundle table of contents has no meta segment", bundle->filename);
+  
+  return MPORT_OK;
+  
+  CORRUPT:
+    free(toc);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: corrupt bundle table of contents", bundle->filename);
+}
+
+
+/* throw out the current archive, and start reading segment i */
+static int open_segment(mportBundleRead *bundle, int i)
+{
+  bundle->segment     = i;
+  bundle->seg_entries = 0;
+  
+  return open_range(bundle, bundle->toc[i].offset, bundle->toc[i].length);
+}
+
+
+/* point a fresh archive at length bytes of the bundle starting at offset */
+static int open_range(mportBundleRead *bundle, off_t offset, off_t length)
+{
+  struct segment_reader *reader;
+  int fd;
+  
+  if (bundle->archive != NULL) {
+    archive_read_finish(bundle->archive);
+    bundle->archive = NULL;
+  }
+  
+  if ((bundle->archive = archive_read_new()) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate read archive struct");
   
   archive_read_support_format_tar(bundle->archive);
-  archive_read_support_compression_bzip2(bundle->archive);
+
+  /* big bzip2 bundles get decoded on all the cores we've got */
+  if (bundle_threads(bundle) > 1 && mport_bundle_read_bzip2_mt_probe(bundle->fd, offset, length)) {
+    if ((fd = dup(bundle->fd)) == -1)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't dup fd: %s", strerror(errno));
+    
+    return mport_bundle_read_bzip2_mt_open(bundle->archive, fd, offset, length, bundle_threads(bundle));
+  }
   
-  if (archive_read_open_filename(bundle->archive, bundle->filename, 10240) != ARCHIVE_OK) {
-    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+  mport_bundle_read_support_compression(bundle->archive);
+  
+  if ((reader = (struct segment_reader *)malloc(sizeof(struct segment_reader))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  reader->fd  = bundle->fd;
+  reader->pos = offset;
+  reader->end = offset + length;
+
+  if (archive_read_open(bundle->archive, reader, NULL, segment_read, segment_close) != ARCHIVE_OK) {
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: %s (it may use a compression this mport doesn't support)", bundle->filename, archive_error_string(bundle->archive));
   }
   
   return MPORT_OK;    
 }
 
 
+static ssize_t segment_read(struct archive *a, void *client, const void **buffp)
+{
+  struct segment_reader *reader = (struct segment_reader *)client;
+  off_t want = reader->end - reader->pos;
+  ssize_t got;
+  
+  if (want > (off_t)sizeof(reader->buff))
+    want = sizeof(reader->buff);
+  
+  if (want <= 0)
+    return 0;
+  
+  if ((got = pread(reader->fd, reader->buff, (size_t)want, reader->pos)) == -1) {
+    archive_set_error(a, errno, "%s", strerror(errno));
+    return -1;
+  }
+  
+  reader->pos += got;
+  *buffp = reader->buff;
+  
+  return got;
+}
+
+
+/* the fd belongs to the bundle, so just the reader goes */
+static int segment_close(struct archive *a, void *client)
+{
+  free(client);
+  return ARCHIVE_OK;
+}
+
+
+static ssize_t stream_read(struct archive *a, void *client, const void **buffp)
+{
+  struct stream_reader *reader = (struct stream_reader *)client;
+  size_t got;
+  
+  got = fread(reader->buff, 1, sizeof(reader->buff), reader->fp);
+  
+  if (got == 0 && ferror(reader->fp)) {
+    archive_set_error(a, EIO, "%s", strerror(errno));
+    return -1;
+  }
+  
+  SHA256_Update(&reader->ctx, reader->buff, got);
+  reader->got += got;
+  *buffp = reader->buff;
+  
+  return (ssize_t)got;
+}
+
+
+/*
+ * mport_bundle_read_support_compression(archive)
+ *
+ * enable every codec a bundle may be compressed with on a read archive.
+ */
+void mport_bundle_read_support_compression(struct archive *a)
+{
+  archive_read_support_compression_bzip2(a);
+  archive_read_support_compression_xz(a);
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+  archive_read_support_filter_zstd(a);
+#endif
+}
+
+
+/* the number of decoder threads to use; bundle->threads of 0 means one per cpu. */
+static int bundle_threads(mportBundleRead *bundle)
+{
+  long ncpu;
+
+  if (bundle->threads > 0)
+    return bundle->threads;
+
+  if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    return 1;
+
+  return ncpu > MPORT_BZIP2_MT_MAX_THREADS ? MPORT_BZIP2_MT_MAX_THREADS : (int)ncpu;
+}
+
+
 /*  
  * mport_bundle_read_finish(bundle)
  *
@@ -88,12 +507,27 @@ int mport_bundle_read_finish(mportInstance *mport, mportBundleRead *bundle)
       ret = mport_err_code();
   }
 
-  if (bundle->tmpdir != NULL) {
-    if (mport_rmtree(bundle->tmpdir) != MPORT_OK)
-      ret = mport_err_code();
+  free_metafiles(bundle);
+  sqlite3_free(bundle->stub);
+  
+  if (bundle->toc != NULL) {
+    int i;
+    
+    for (i = 0; i < bundle->nsegments; i++)
+      free(bundle->toc[i].name);
+    free(bundle->toc);
   }      
 
-  free(bundle->tmpdir);
+  if (bundle->fd != -1)
+    close(bundle->fd);
+  
+  if (bundle->stream != NULL) {
+    fclose(bundle->stream->fp);
+    free(bundle->stream->hash);
+    free(bundle->stream->meta_hash);
+    free(bundle->stream);
+  }
+  
   free(bundle->filename);
   free(bundle);
                   
@@ -102,31 +536,28 @@ int mport_bundle_read_finish(mportInstance *mport, mportBundleRead *bundle)
                     
 
 /* 
- * mport_bundle_read_extract_metafiles(bundle, &dirnamep)
+ * mport_bundle_read_load_metafiles(bundle)
  *
- * creates a temporary directory containing all the meta files.  It is
+ * reads the stub database and all the meta files into memory.  It is
  * expected that this will be called before next_entry() or next_file(),
  * terrible things might happen if you don't do this!
  *
- * The calling code should free the memory that dirnamep points to.
+ * The stub ends up in bundle->stub, the rest can be had with
+ * mport_bundle_read_get_metafile().
  */
-int mport_bundle_read_extract_metafiles(mportBundleRead *bundle, char **dirnamep)
+int mport_bundle_read_load_metafiles(mportBundleRead *bundle)
 {
-  /* extract the meta-files into the a temp dir */
-  char filepath[FILENAME_MAX];
-  const char *file;
-  char dirtmpl[] = "/tmp/mport.XXXXXXXX";
-  char *tmpdir = mkdtemp(dirtmpl);
+  mportBundleMetafile *meta;
   struct archive_entry *entry;
-     
-  if (tmpdir == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
-  
-  if ((*dirnamep = strdup(tmpdir)) == NULL) 
-    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  const char *file;
+  char *data;
+  size_t len;
+  int is_stub;
   
   while (1) {
-    if (mport_bundle_read_next_entry(bundle, &entry) != MPORT_OK)
+    /* all of a segmented bundle's metafiles are in the meta segment, so 
+     * don't start decoding the first package just to find where they end */
+    if (read_header(bundle, &entry, bundle->toc == NULL) != MPORT_OK)
       RETURN_CURRENT_ERROR;     
  
     if (entry == NULL)
@@ -134,25 +565,170 @@ int mport_bundle_read_extract_metafiles(mportBundleRead *bundle, char **dirnamep
  
     file = archive_entry_pathname(entry);
        
-    if (*file == '+') {
-      (void)snprintf(filepath, FILENAME_MAX, "%s/%s", tmpdir, file);
-      archive_entry_set_pathname(entry, filepath);
-      
-      if (mport_bundle_read_extract_next_file(bundle, entry) != MPORT_OK)
-        RETURN_CURRENT_ERROR;        
-    } else {
+    if (*file != '+') {
       /* entry points to the first real file in the bundle, so we 
        * want to hold on to that until next_entry() is called
        */
       bundle->firstreal = entry;
       break;
     }
+
+    if (archive_entry_filetype(entry) != AE_IFREG) {
+      if (archive_read_data_skip(bundle->archive) != ARCHIVE_OK)
+        RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+      continue;
+    }
+
+    is_stub = (strcmp(file, MPORT_STUB_DB_FILE) == 0);
+    
+    if (read_entry_data(bundle, entry, is_stub, &data, &len) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    hash_metafile(bundle, file, data, len);
+
+    if (is_stub) {
+      sqlite3_free(bundle->stub);
+      bundle->stub    = data;
+      bundle->stublen = len;
+      continue;
+    }
+      
+    if ((meta = (mportBundleMetafile *)malloc(sizeof(mportBundleMetafile))) == NULL) {
+      free(data);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    if ((meta->name = strdup(file)) == NULL) {
+      free(data);
+      free(meta);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    meta->data = data;
+    meta->len  = len;
+    meta->next = bundle->metafiles;
+    bundle->metafiles = meta;
   }
  
   return MPORT_OK;                 
 } 
 
 
+/*
+ * mport_bundle_read_get_metafile(bundle, pkg, type, &len)
+ *
+ * returns the contents of the given meta file (MPORT_INSTALL_FILE, etc) for pkg,
+ * or NULL if the package doesn't have one.  The buffer belongs to the bundle.
+ */
+const char * mport_bundle_read_get_metafile(mportBundleRead *bundle, mportPackageMeta *pkg, const char *type, size_t *lenp)
+{
+  mportBundleMetafile *meta;
+  char name[FILENAME_MAX];
+  
+  (void)snprintf(name, FILENAME_MAX, "%s/%s-%s/%s", MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, type);
+  
+  for (meta = bundle->metafiles; meta != NULL; meta = meta->next) {
+    if (strcmp(meta->name, name) == 0) {
+      if (lenp != NULL)
+        *lenp = meta->len;
+      return meta->data;
+    }
+  }
+  
+  return NULL;
+}
+
+
+/* read the data for entry into a new nul terminated buffer.  The stub is
+ * allocated with sqlite3_malloc() so that it can be handed to sqlite. */
+static int read_entry_data(mportBundleRead *bundle, struct archive_entry *entry, int is_stub, char **datap, size_t *lenp)
+{
+  int64_t size = archive_entry_size(entry);
+  size_t got = 0;
+  ssize_t ret;
+  char *data;
+  
+  if (size < 0 || (uint64_t)size >= SIZE_MAX)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: bad size for %s", bundle->filename, archive_entry_pathname(entry));
+  
+  if (is_stub)
+    data = (char *)sqlite3_malloc64((sqlite3_uint64)size + 1);
+  else
+    data = (char *)malloc((size_t)size + 1);
+  
+  if (data == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  while (got < (size_t)size) {
+    ret = archive_read_data(bundle->archive, data + got, (size_t)size - got);
+    
+    if (ret <= 0) {
+      if (is_stub) sqlite3_free(data); else free(data);
+      if (ret == 0)
+        RETURN_ERRORX(MPORT_ERR_FATAL, "%s: %s is truncated", bundle->filename, archive_entry_pathname(entry));
+      RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+    }
+    
+    got += (size_t)ret;
+  }
+  
+  data[got] = '\0';
+  *datap = data;
+  *lenp  = got;
+  
+  return MPORT_OK;
+}
+
+
+/* a streamed bundle's metafiles are hashed as "name\nlength\n" and the 
+ * data, in the order they're in the bundle; bless_run.pl's meta_hash()
+ * does the same */
+static void hash_metafile(mportBundleRead *bundle, const char *name, const char *data, size_t len)
+{
+  char length[32];
+  
+  if (bundle->stream == NULL)
+    return;
+  
+  (void)snprintf(length, sizeof(length), "%zu", len);
+  
+  SHA256_Update(&bundle->stream->meta_ctx, name, strlen(name));
+  SHA256_Update(&bundle->stream->meta_ctx, "\n", 1);
+  SHA256_Update(&bundle->stream->meta_ctx, length, strlen(length));
+  SHA256_Update(&bundle->stream->meta_ctx, "\n", 1);
+  SHA256_Update(&bundle->stream->meta_ctx, data, len);
+}
+
+
+static int verify_meta(mportBundleRead *bundle)
+{
+  char digest[65];
+  
+  if (bundle->stream == NULL)
+    return MPORT_OK;
+  
+  (void)SHA256_End(&bundle->stream->meta_ctx, digest);
+  
+  if (strcmp(digest, bundle->stream->meta_hash) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: the metadata's sha256 is %s, expected %s", bundle->filename, digest, bundle->stream->meta_hash);
+  
+  return MPORT_OK;
+}
+
+
+static void free_metafiles(mportBundleRead *bundle)
+{
+  mportBundleMetafile *meta;
+  
+  while ((meta = bundle->metafiles) != NULL) {
+    bundle->metafiles = meta->next;
+    free(meta->name);
+    free(meta->data);
+    free(meta);
+  }
+} 
+
+
 /*
  * mport_bundle_read_skip_metafiles(bundle)
  *
@@ -187,8 +763,6 @@ int mport_bundle_read_skip_metafiles(mportBundleRead *bundle)
  */
 int mport_bundle_read_next_entry(mportBundleRead *bundle, struct archive_entry **entryp)
 {
-  int ret;
- 
   if (bundle->firstreal != NULL) {
     /* handle the lookahead issue with extracting metafiles */
     *entryp = bundle->firstreal;
@@ -196,6 +770,16 @@ int mport_bundle_read_next_entry(mportBundleRead *bundle, struct archive_entry *
     return MPORT_OK;
   }
   
+  return read_header(bundle, entryp, 1);
+}  
+
+
+/* read the next header from the archive.  If advance is set, the end of a 
+ * segment moves on to the next one; otherwise entry is set to NULL. */
+static int read_header(mportBundleRead *bundle, struct archive_entry **entryp, int advance)
+{
+  int ret;
+  
   while (1) {
     ret = archive_read_next_header(bundle->archive, entryp);
     
@@ -204,9 +788,18 @@ int mport_bundle_read_next_entry(mportBundleRead *bundle, struct archive_entry *
     if (ret == ARCHIVE_FATAL) 
       RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
 
+    /* in a segmented bundle, the end of one segment is the start of the next */
+    if (ret == ARCHIVE_EOF && advance && bundle->toc != NULL && bundle->segment + 1 < bundle->nsegments) {
+      if (open_segment(bundle, bundle->segment + 1) != MPORT_OK)
+        RETURN_CURRENT_ERROR;
+      continue;
+    }
+
     /* ret was warn or OK, we're done */
     if (ret == ARCHIVE_EOF) 
       *entryp = NULL;  
+    else
+      bundle->seg_entries++;
 
     break;
   }
@@ -226,7 +819,7 @@ int mport_bundle_read_next_entry(mportBundleRead *bundle, struct archive_entry *
  /* XXX - should this be implemented as a macro? inline? */
 int mport_bundle_read_extract_next_file(mportBundleRead *bundle, struct archive_entry *entry)
 {
-  if (archive_read_extract(bundle->archive, entry, ARCHIVE_EXTRACT_OWNER|ARCHIVE_EXTRACT_PERM|ARCHIVE_EXTRACT_TIME|ARCHIVE_EXTRACT_ACL|ARCHIVE_EXTRACT_FFLAGS) != ARCHIVE_OK) 
+  if (archive_read_extract(bundle->archive, entry, MPORT_EXTRACT_FLAGS) != ARCHIVE_OK) 
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
   
   return MPORT_OK;
@@ -237,19 +830,30 @@ int mport_bundle_read_extract_next_file(mportBundleRead *bundle, struct archive_
 /* 
  * mport_bundle_read_prep_for_install(mport, bundle)
  * 
- * Extract the metafile into a tmpdir that the bundle maintains, attach the stub db for the 
+ * Read the metafiles into memory, and attach the stub db to the 
  * instance master database.
  */
 int mport_bundle_read_prep_for_install(mportInstance *mport, mportBundleRead *bundle)
 {
   sqlite3_stmt *stmt;
-  int bundle_version;
+  int bundle_version = 0;
   int ret;
   
-  if (mport_bundle_read_extract_metafiles(bundle, &(bundle->tmpdir)) != MPORT_OK)
+  if (mport_bundle_read_load_metafiles(bundle) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
-  if (mport_attach_stub_db(mport->db, bundle->tmpdir) != MPORT_OK)
+  if (bundle->stub == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: Invalid bundle file: no stub database", bundle->filename);
+  
+  /* nothing from the network gets used before it checks out */
+  if (verify_meta(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  /* sqlite owns the image from here on */
+  ret = mport_attach_stub_db(mport->db, bundle->stub, bundle->stublen);
+  bundle->stub = NULL;
+  
+  if (ret != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
   bundle->stub_attached = 1;
@@ -258,12 +862,12 @@ int mport_bundle_read_prep_for_install(mportInstance *mport, mportBundleRead *bu
     RETURN_CURRENT_ERROR;
 
   ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    bundle_version = sqlite3_column_int(stmt, 0);
   sqlite3_finalize(stmt);
     
   switch (ret) {
     case SQLITE_ROW:
-      bundle_version = sqlite3_column_int(stmt, 0);
-      
       if (bundle_version > MPORT_BUNDLE_VERSION) {
         RETURN_ERRORX(MPORT_ERR_FATAL, "%s: bundle is version %i; this version of mport only supports up to version %i", bundle->filename, bundle_version, MPORT_BUNDLE_VERSION);
       }
@@ -276,6 +880,40 @@ int mport_bundle_read_prep_for_install(mportInstance *mport, mportBundleRead *bu
       break;
   }
   
+  if (bundle_version >= 2)
+    return check_bundle_compression(mport, bundle, bundle_version);
+
   return MPORT_OK;
 }    
 
+
+/* make sure a version 2 or later bundle names a codec we know about */
+static int check_bundle_compression(mportInstance *mport, mportBundleRead *bundle, int bundle_version)
+{
+  sqlite3_stmt *stmt;
+  const char *name;
+  int ret = MPORT_OK;
+
+  if (mport_db_prepare(mport->db, &stmt, "SELECT value FROM stub.meta WHERE field='bundle_compression'") != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  switch (sqlite3_step(stmt)) {
+    case SQLITE_ROW:
+      name = (const char *)sqlite3_column_text(stmt, 0);
+      if (strcmp(name, mport_compression_name(MPORT_COMPRESS_BZIP2)) != 0 &&
+          strcmp(name, mport_compression_name(MPORT_COMPRESS_XZ)) != 0 &&
+          strcmp(name, mport_compression_name(MPORT_COMPRESS_ZSTD)) != 0)
+        ret = SET_ERRORX(MPORT_ERR_FATAL, "%s: bundle uses unknown compression '%s'", bundle->filename, name);
+      break;
+    case SQLITE_DONE:
+      ret = SET_ERRORX(MPORT_ERR_FATAL, "%s: version %i bundle has no bundle_compression field", bundle->filename, bundle_version);
+      break;
+    default:
+      ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+      break;
+  }
+
+  sqlite3_finalize(stmt);
+  return ret;
+}    
+
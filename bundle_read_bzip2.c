@@ -0,0 +1,576 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Multi-threaded bzip2 decoding for bundle reads.
+ *
+ * A bzip2 stream is a series of independently compressed blocks, each
+ * starting with a 48 bit magic number.  The blocks are not byte aligned, so
+ * we scan the compressed data bit by bit for the magic, cut it up into
+ * blocks, and turn each one into a tiny stand-alone stream that libbz2 can
+ * decode on its own.  A pool of worker threads decodes a bounded window of
+ * blocks ahead of the reader, and the results are handed to libarchive in
+ * order through a plain read callback, so the tar reader never knows the
+ * difference.
+ *
+ * The magic can show up by chance inside compressed data.  A false split
+ * leaves a block that ends early; libbz2 never produces any output for a
+ * block it hasn't seen the end of, so we catch that and glue the block back
+ * together with its neighbour.  Every block that does produce output has had
+ * its CRC checked by libbz2, and the block CRCs are folded together and
+ * checked against each stream's trailer as the blocks are handed over.  The
+ * end of stream magic can show up by chance too, so we only take one that
+ * is followed by a trailer that ends the data or the stream.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bzlib.h>
+#include <archive.h>
+#include "mport.h"
+#include "mport_private.h"
+
+
+#define BZ_BLOCK_MAGIC	0x314159265359ULL
+#define BZ_EOS_MAGIC	0x177245385090ULL
+#define BZ_MAGIC_MASK	0xffffffffffffULL
+#define BZ_HEADER_LEN	4
+/* end of stream magic and combined CRC */
+#define BZ_TRAILER_BITS	80
+#define BZ_OUT_CHUNK	(1024 * 1024)
+/* how many times a block may be glued to its neighbour before we give up */
+#define BZ_MAX_MERGES	4
+
+enum block_state { BLOCK_PENDING, BLOCK_RUNNING, BLOCK_DONE, BLOCK_FAILED };
+
+struct bz_block {
+  uint64_t start;  /* bit offset of the block magic */
+  uint64_t end;    /* bit offset of the next magic */
+  int last;        /* the last block in its stream */
+  uint32_t stream_crc;  /* if last, the combined CRC from the trailer */
+  char *out;
+  size_t outlen;
+  enum block_state state;
+};
+
+struct bz_mt {
+  int fd;
+  void *map;
+  size_t maplen;
+  const unsigned char *data;
+  size_t datalen;
+
+  struct bz_block *blocks;
+  size_t nblocks;
+  size_t next_job;
+  size_t next_out;
+  size_t window;
+  uint32_t crc;    /* combined CRC of the current stream, so far */
+
+  pthread_t *workers;
+  int nworkers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int shutdown;
+
+  char *lent;
+};
+
+
+static int scan_blocks(struct bz_mt *);
+static uint32_t get_bits32(const unsigned char *, uint64_t);
+static int is_trailer(struct bz_mt *, uint64_t);
+static int decode_range(const unsigned char *, uint64_t, uint64_t, char **, size_t *);
+static void * worker_main(void *);
+static void stop_workers(struct bz_mt *);
+static void free_mt(struct bz_mt *);
+static ssize_t mt_read(struct archive *, void *, const void **);
+static int mt_close(struct archive *, void *);
+
+
+/*
+ * mport_bundle_read_bzip2_mt_probe(fd, offset, length)
+ *
+ * Returns 1 if the stream at offset in fd is bzip2 data that is worth
+ * decoding on more than one thread, 0 otherwise.
+ */
+int mport_bundle_read_bzip2_mt_probe(int fd, off_t offset, off_t length)
+{
+  unsigned char magic[3];
+
+  if (length < MPORT_BZIP2_MT_MIN_SIZE)
+    return 0;
+
+  /* we map the whole stream, it has to fit in our address space */
+  if ((uint64_t)length > SIZE_MAX / 2)
+    return 0;
+
+  if (pread(fd, magic, sizeof(magic), offset) != sizeof(magic))
+    return 0;
+
+  return (magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h');
+}
+
+
+/*
+ * mport_bundle_read_bzip2_mt_open(archive, fd, offset, length, threads)
+ *
+ * Open the archive so that it reads the decompressed contents of the bzip2
+ * stream at offset in fd, using threads decoder threads.  The archive takes
+ * ownership of fd; it will be closed when the archive is.  The caller should
+ * have checked the stream with mport_bundle_read_bzip2_mt_probe() first.
+ */
+int mport_bundle_read_bzip2_mt_open(struct archive *a, int fd, off_t offset, off_t length, int threads)
+{
+  struct bz_mt *mt;
+  off_t aligned;
+  long pagesize = sysconf(_SC_PAGESIZE);
+  int i;
+
+  if ((mt = (struct bz_mt *)calloc(1, sizeof(struct bz_mt))) == NULL) {
+    close(fd);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+
+  mt->fd = fd;
+
+  if (pthread_mutex_init(&mt->lock, NULL) != 0 || pthread_cond_init(&mt->cond, NULL) != 0) {
+    close(fd);
+    free(mt);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize decoder locks.");
+  }
+
+  aligned = offset - (offset % pagesize);
+  mt->maplen = (size_t)(length + (offset - aligned));
+
+  if ((mt->map = mmap(NULL, mt->maplen, PROT_READ, MAP_SHARED, fd, aligned)) == MAP_FAILED) {
+    mt->map = NULL;
+    free_mt(mt);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't map bundle: %s", strerror(errno));
+  }
+
+  (void)madvise(mt->map, mt->maplen, MADV_SEQUENTIAL);
+
+  mt->data    = (const unsigned char *)mt->map + (offset - aligned);
+  mt->datalen = (size_t)length;
+
+  if (scan_blocks(mt) != MPORT_OK) {
+    free_mt(mt);
+    RETURN_CURRENT_ERROR;
+  }
+
+  if (threads < 1)
+    threads = 1;
+
+  /* a block that has to be merged waits on the next BZ_MAX_MERGES blocks,
+   * so those have to be in the window */
+  mt->window = threads * 2;
+  if (mt->window < BZ_MAX_MERGES + 1)
+    mt->window = BZ_MAX_MERGES + 1;
+
+  if ((mt->workers = (pthread_t *)calloc(threads, sizeof(pthread_t))) == NULL) {
+    free_mt(mt);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&mt->workers[i], NULL, worker_main, mt) != 0) {
+      stop_workers(mt);
+      free_mt(mt);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't start decoder threads.");
+    }
+    mt->nworkers++;
+  }
+
+  if (archive_read_open(a, mt, NULL, mt_read, mt_close) != ARCHIVE_OK)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+
+  return MPORT_OK;
+}
+
+
+/* Find every block in the stream.  A block runs from its magic up to the next
+ * magic of either kind, so concatenated streams are handled for free. */
+static int scan_blocks(struct bz_mt *mt)
+{
+  uint64_t acc = 0, magic, pos;
+  size_t i, alloced = 0;
+  int k, in_block = 0;
+  struct bz_block *tmp;
+
+  for (i = 0; i < mt->datalen; i++) {
+    acc = (acc << 8) | mt->data[i];
+
+    /* test the 8 possible bit alignments of a magic ending in this byte */
+    for (k = 7; k >= 0; k--) {
+      if ((uint64_t)(i + 1) * 8 < (uint64_t)k + 48)
+        continue;
+
+      magic = (acc >> k) & BZ_MAGIC_MASK;
+
+      if (magic != BZ_BLOCK_MAGIC && magic != BZ_EOS_MAGIC)
+        continue;
+
+      pos = (uint64_t)(i + 1) * 8 - k - 48;
+
+      /* one that came up by chance is just part of the block */
+      if (magic == BZ_EOS_MAGIC && !is_trailer(mt, pos))
+        continue;
+
+      if (in_block) {
+        mt->blocks[mt->nblocks - 1].end = pos;
+        in_block = 0;
+
+        if (magic == BZ_EOS_MAGIC) {
+          mt->blocks[mt->nblocks - 1].last = 1;
+          mt->blocks[mt->nblocks - 1].stream_crc = get_bits32(mt->data, pos + 48);
+        }
+      }
+
+      if (magic == BZ_BLOCK_MAGIC) {
+        if (mt->nblocks == alloced) {
+          alloced = alloced == 0 ? 64 : alloced * 2;
+          if ((tmp = realloc(mt->blocks, alloced * sizeof(struct bz_block))) == NULL)
+            RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+          mt->blocks = tmp;
+        }
+        bzero(&mt->blocks[mt->nblocks], sizeof(struct bz_block));
+        mt->blocks[mt->nblocks].start = pos;
+        mt->blocks[mt->nblocks].state = BLOCK_PENDING;
+        mt->nblocks++;
+        in_block = 1;
+      }
+    }
+  }
+
+  if (in_block)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Truncated bzip2 stream in bundle.");
+
+  if (mt->nblocks == 0)
+    RETURN_ERROR(MPORT_ERR_FATAL, "No bzip2 blocks found in bundle.");
+
+  return MPORT_OK;
+}
+
+
+/* An end of stream magic at pos is real if the trailer it starts, padded out
+ * to a byte, ends the data or is followed by another stream's header. */
+static int is_trailer(struct bz_mt *mt, uint64_t pos)
+{
+  size_t next = (size_t)((pos + BZ_TRAILER_BITS + 7) / 8);
+
+  if (pos + BZ_TRAILER_BITS > (uint64_t)mt->datalen * 8)
+    return 0;
+
+  if (next == mt->datalen)
+    return 1;
+
+  return (next + BZ_HEADER_LEN <= mt->datalen && mt->data[next] == 'B' && mt->data[next + 1] == 'Z' &&
+          mt->data[next + 2] == 'h' && mt->data[next + 3] >= '1' && mt->data[next + 3] <= '9');
+}
+
+
+/* the 32 bits of data starting at bit, which the caller has made sure are there */
+static uint32_t get_bits32(const unsigned char *data, uint64_t bit)
+{
+  uint64_t acc = 0;
+  size_t i, first = (size_t)(bit / 8);
+  unsigned int shift = bit % 8;
+
+  for (i = 0; i < 4; i++)
+    acc = (acc << 8) | data[first + i];
+
+  /* only touch a fifth byte if some of the bits are in it */
+  if (shift != 0)
+    acc = (acc << 8) | data[first + 4];
+  else
+    acc <<= 8;
+
+  return (uint32_t)(acc >> (8 - shift));
+}
+
+
+/* Decode the bits [start, end) of data, which must begin at a block magic.
+ * The bits are shifted into a buffer behind a stream header, and fed to
+ * libbz2.  Returns MPORT_OK only if at least one whole block came out. */
+static int decode_range(const unsigned char *data, uint64_t start, uint64_t end, char **outp, size_t *outlenp)
+{
+  bz_stream strm;
+  unsigned char *in;
+  char *out = NULL, *tmp;
+  size_t inlen, outlen = 0, alloced = 0, i;
+  unsigned int last_in;
+  uint64_t bit;
+  unsigned int shift;
+  int ret;
+
+  *outp    = NULL;
+  *outlenp = 0;
+
+  inlen = BZ_HEADER_LEN + (size_t)((end - start + 7) / 8);
+
+  if ((in = (unsigned char *)malloc(inlen)) == NULL)
+    return MPORT_ERR_FATAL;
+
+  /* the block size is only a limit, 9 lets any block through */
+  in[0] = 'B'; in[1] = 'Z'; in[2] = 'h'; in[3] = '9';
+
+  shift = start % 8;
+  for (i = BZ_HEADER_LEN, bit = start; i < inlen; i++, bit += 8) {
+    in[i] = data[bit / 8] << shift;
+    if (shift != 0 && (bit / 8) + 1 < (end + 7) / 8)
+      in[i] |= data[(bit / 8) + 1] >> (8 - shift);
+  }
+
+  /* zero the bits past the end, so they can't look like anything */
+  if ((end - start) % 8 != 0)
+    in[inlen - 1] &= (unsigned char)(0xff << (8 - ((end - start) % 8)));
+
+  bzero(&strm, sizeof(strm));
+
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+    free(in);
+    return MPORT_ERR_FATAL;
+  }
+
+  strm.next_in  = (char *)in;
+  strm.avail_in = inlen;
+
+  while (1) {
+    if (outlen == alloced) {
+      alloced += BZ_OUT_CHUNK;
+      if ((tmp = realloc(out, alloced)) == NULL) {
+        ret = BZ_MEM_ERROR;
+        break;
+      }
+      out = tmp;
+    }
+
+    strm.next_out  = out + outlen;
+    strm.avail_out = alloced - outlen;
+    last_in = strm.avail_in;
+
+    ret = BZ2_bzDecompress(&strm);
+
+    if (ret != BZ_OK)
+      break;
+
+    /* all input used, and it's given us everything it can */
+    if (strm.avail_in == 0 && strm.avail_out != 0)
+      break;
+
+    /* stalled, which shouldn't happen with room on both sides */
+    if (strm.avail_in == last_in && alloced - strm.avail_out == outlen && strm.avail_out != 0)
+      break;
+
+    outlen = alloced - strm.avail_out;
+  }
+
+  outlen = alloced - strm.avail_out;
+
+  BZ2_bzDecompressEnd(&strm);
+  free(in);
+
+  /* We never hand the decoder an end of stream marker, so BZ_OK is success.
+   * BZ_STREAM_END can only mean garbage decoded as a marker. */
+  if (ret != BZ_OK || outlen == 0) {
+    free(out);
+    return MPORT_ERR_FATAL;
+  }
+
+  *outp    = out;
+  *outlenp = outlen;
+
+  return MPORT_OK;
+}
+
+
+static void * worker_main(void *arg)
+{
+  struct bz_mt *mt = (struct bz_mt *)arg;
+  struct bz_block *b;
+  char *out;
+  size_t outlen;
+  int ret;
+
+  pthread_mutex_lock(&mt->lock);
+
+  while (1) {
+    while (!mt->shutdown && (mt->next_job >= mt->nblocks || mt->next_job >= mt->next_out + mt->window))
+      pthread_cond_wait(&mt->cond, &mt->lock);
+
+    if (mt->shutdown)
+      break;
+
+    b = &mt->blocks[mt->next_job++];
+    b->state = BLOCK_RUNNING;
+
+    pthread_mutex_unlock(&mt->lock);
+    ret = decode_range(mt->data, b->start, b->end, &out, &outlen);
+    pthread_mutex_lock(&mt->lock);
+
+    b->out    = out;
+    b->outlen = outlen;
+    b->state  = ret == MPORT_OK ? BLOCK_DONE : BLOCK_FAILED;
+
+    pthread_cond_broadcast(&mt->cond);
+  }
+
+  pthread_mutex_unlock(&mt->lock);
+
+  return NULL;
+}
+
+
+/* wait for the given block to come out of the worker pool. Lock must be held. */
+static void wait_for_block(struct bz_mt *mt, size_t i)
+{
+  while (mt->blocks[i].state == BLOCK_PENDING || mt->blocks[i].state == BLOCK_RUNNING)
+    pthread_cond_wait(&mt->cond, &mt->lock);
+}
+
+
+/* libarchive read callback.  Hands over the blocks one at a time, in order. */
+static ssize_t mt_read(struct archive *a, void *client_data, const void **buff)
+{
+  struct bz_mt *mt = (struct bz_mt *)client_data;
+  struct bz_block *b;
+  size_t i, j;
+  int merges = 0;
+
+  free(mt->lent);
+  mt->lent = NULL;
+
+  pthread_mutex_lock(&mt->lock);
+
+  if (mt->next_out >= mt->nblocks) {
+    pthread_mutex_unlock(&mt->lock);
+    return 0;
+  }
+
+  i = j = mt->next_out;
+  b = &mt->blocks[i];
+  wait_for_block(mt, i);
+
+  while (b->state == BLOCK_FAILED) {
+    /* the block probably ended at a false magic, glue the next one on */
+    if (b->last || ++j >= mt->nblocks || ++merges > BZ_MAX_MERGES) {
+      pthread_mutex_unlock(&mt->lock);
+      archive_set_error(a, EIO, "bzip2 data error in bundle");
+      return -1;
+    }
+
+    wait_for_block(mt, j);
+    free(mt->blocks[j].out);
+    mt->blocks[j].out = NULL;
+
+    b->end        = mt->blocks[j].end;
+    b->last       = mt->blocks[j].last;
+    b->stream_crc = mt->blocks[j].stream_crc;
+
+    pthread_mutex_unlock(&mt->lock);
+    b->state = decode_range(mt->data, b->start, b->end, &b->out, &b->outlen) == MPORT_OK ? BLOCK_DONE : BLOCK_FAILED;
+    pthread_mutex_lock(&mt->lock);
+  }
+
+  /* move the window, and let the workers know there's room */
+  mt->next_out = j + 1;
+  pthread_cond_broadcast(&mt->cond);
+  pthread_mutex_unlock(&mt->lock);
+
+  /* the block's own CRC follows its magic */
+  mt->crc = ((mt->crc << 1) | (mt->crc >> 31)) ^ get_bits32(mt->data, b->start + 48);
+
+  if (b->last) {
+    if (mt->crc != b->stream_crc) {
+      archive_set_error(a, EIO, "bzip2 stream CRC mismatch in bundle");
+      return -1;
+    }
+    mt->crc = 0;
+  }
+
+  mt->lent = b->out;
+  b->out   = NULL;
+  *buff    = mt->lent;
+
+  return (ssize_t)b->outlen;
+}
+
+
+static int mt_close(struct archive *a, void *client_data)
+{
+  struct bz_mt *mt = (struct bz_mt *)client_data;
+
+  stop_workers(mt);
+  free_mt(mt);
+
+  return ARCHIVE_OK;
+}
+
+
+static void stop_workers(struct bz_mt *mt)
+{
+  int i;
+
+  pthread_mutex_lock(&mt->lock);
+  mt->shutdown = 1;
+  pthread_cond_broadcast(&mt->cond);
+  pthread_mutex_unlock(&mt->lock);
+
+  for (i = 0; i < mt->nworkers; i++)
+    pthread_join(mt->workers[i], NULL);
+
+  mt->nworkers = 0;
+}
+
+
+static void free_mt(struct bz_mt *mt)
+{
+  size_t i;
+
+  for (i = 0; i < mt->nblocks; i++)
+    free(mt->blocks[i].out);
+
+  pthread_mutex_destroy(&mt->lock);
+  pthread_cond_destroy(&mt->cond);
+
+  if (mt->map != NULL)
+    munmap(mt->map, mt->maplen);
+
+  close(mt->fd);
+  free(mt->lent);
+  free(mt->blocks);
+  free(mt->workers);
+  free(mt);
+}
@@ -31,10 +31,11 @@
 #include "mport_private.h"
 
 #include <sys/stat.h>
-#include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <archive_entry.h>
 
 
@@ -44,18 +45,32 @@ static int do_post_install(mportInstance *, mportBundleRead *, mportPackageMeta
 static int run_pkg_install(mportInstance *, mportBundleRead *, mportPackageMeta *, const char *);
 static int run_mtree(mportInstance *, mportBundleRead *, mportPackageMeta *);
 static int display_pkg_msg(mportInstance *, mportBundleRead *, mportPackageMeta *);
+static int write_metafiles(mportInstance *, mportBundleRead *, mportPackageMeta *);
+static int write_metafile(mportInstance *, mportBundleRead *, mportPackageMeta *, const char *, mode_t);
 
 
 int mport_bundle_read_install_pkg(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
+  char dir[FILENAME_MAX];
+  int mark = mport_trigger_mark(mport);
+
   if (do_pre_install(mport, bundle, pkg) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+    goto ERROR;
   if (do_actual_install(mport, bundle, pkg) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+    goto ERROR;
   if (do_post_install(mport, bundle, pkg) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
   return MPORT_OK;
+
+  ERROR:
+    /* the package never made it into the db, so its metafiles shouldn't stay around */
+    (void)snprintf(dir, FILENAME_MAX, "%s%s/%s-%s", mport->root, MPORT_INST_INFRA_DIR, pkg->name, pkg->version);
+    if (mport_file_exists(dir))
+      (void)mport_rmtree(dir);
+    /* nor should the triggers it queued run */
+    mport_trigger_drop(mport, mark);
+    RETURN_CURRENT_ERROR;
 }  
 
 
@@ -64,6 +79,10 @@ int mport_bundle_read_install_pkg(mportInstance *mport, mportBundleRead *bundle,
  */
 static int do_pre_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
+  /* put the metafiles where they live for an installed package; the scripts run from there */
+  if (write_metafiles(mport, bundle, pkg) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
   /* run mtree */
   if (run_mtree(mport, bundle, pkg) != MPORT_OK)
     RETURN_CURRENT_ERROR;
@@ -79,17 +98,23 @@ static int do_actual_install(mportInstance *mport, mportBundleRead *bundle, mpor
 {
   int file_total, ret;
   int file_count = 0;
+  int cwdfd = -1;
   mportAssetListEntryType type;
   struct archive_entry *entry;
-  char *data, *checksum, *orig_cwd; 
+  char *data, *checksum;
   char file[FILENAME_MAX], cwd[FILENAME_MAX], dir[FILENAME_MAX];
-  sqlite3_stmt *assets, *count, *insert;
+  char staged[FILENAME_MAX], link[FILENAME_MAX];
+  sqlite3_stmt *assets = NULL, *count, *insert = NULL;
+  mportExtractPool *pool = NULL;
+  mportJournal *journal = NULL;
   sqlite3 *db;
   
   db = mport->db;
+  file[0] = '\0';
 
-  /* sadly, we can't just use abs pathnames, because it will break hardlinks */
-  orig_cwd = getcwd(NULL, 0);
+  /* in a segmented bundle, go straight to this package's files */
+  if (bundle->toc != NULL && mport_bundle_read_seek_pkg(bundle, pkg->name) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
 
   /* get the file count for the progress meter */
   if (mport_db_prepare(db, &count, "SELECT COUNT(*) FROM stub.assets WHERE type=%i AND pkg=%Q", ASSET_FILE, pkg->name) != MPORT_OK)
@@ -109,6 +134,16 @@ static int do_actual_install(mportInstance *mport, mportBundleRead *bundle, mpor
 
   mport_call_progress_init_cb(mport, "Installing %s-%s", pkg->name, pkg->version);  
 
+  /* Everything we do to the master db for this package happens in one
+   * transaction, so that master.db is synced once per package instead of once
+   * per asset row.  We use a savepoint rather than BEGIN so that a caller can
+   * wrap a whole bundle (or more) in its own transaction.
+   */
+  if (mport_db_do(db, "SAVEPOINT install_pkg") != MPORT_OK) {
+    (mport->progress_free_cb)();
+    RETURN_CURRENT_ERROR;
+  }
+
   /* Insert the package meta row into the packages table (We use pack here because things might have been twiddled) */
   /* Note that this will be marked as dirty by default */  
   if (mport_db_do(db, "INSERT INTO packages (pkg, version, origin, prefix, lang, options, comment) VALUES (%Q,%Q,%Q,%Q,%Q,%Q,%Q)", pkg->name, pkg->version, pkg->origin, pkg->prefix, pkg->lang, pkg->options, pkg->comment) != MPORT_OK)
@@ -128,9 +163,20 @@ static int do_actual_install(mportInstance *mport, mportBundleRead *bundle, mpor
   if (mport_db_prepare(db, &assets, "SELECT type,data,checksum FROM stub.assets WHERE pkg=%Q", pkg->name) != MPORT_OK) 
     goto ERROR;
 
+  /* files are extracted relative to cwdfd, and hardlinks resolved against it,
+   * so nothing here depends on the process's cwd */
   (void)strlcpy(cwd, pkg->prefix, sizeof(cwd));
   
-  if (mport_chdir(mport, cwd) != MPORT_OK)
+  if (mport_open_rootdir(mport, cwd, &cwdfd) != MPORT_OK)
+    goto ERROR;
+
+  /* files are extracted under staged names, and renamed into place in batches;
+   * the journal is how we undo that if we fail, or crash, part way */
+  if (mport_journal_open(mport, pkg->name, &journal) != MPORT_OK)
+    goto ERROR;
+
+  /* files are written by a pool of threads while we keep decoding */
+  if (mport_extract_pool_new(&pool, file_total >= MPORT_EXTRACT_MIN_FILES ? MPORT_EXTRACT_THREADS : 0) != MPORT_OK)
     goto ERROR;
 
   while (1) {
@@ -151,23 +197,49 @@ static int do_actual_install(mportInstance *mport, mportBundleRead *bundle, mpor
     switch (type) {
       case ASSET_CWD:      
         (void)strlcpy(cwd, data == NULL ? pkg->prefix : data, sizeof(cwd));
-        if (mport_chdir(mport, cwd) != MPORT_OK)
+        /* the writers may still be using the old one */
+        if (mport_extract_pool_barrier(pool) != MPORT_OK)
+          goto ERROR;
+        (void)close(cwdfd);
+        if (mport_open_rootdir(mport, cwd, &cwdfd) != MPORT_OK)
           goto ERROR;
           
         break;
       case ASSET_EXEC:
+        /* the command may well use the files we've extracted so far */
+        if (mport_extract_pool_barrier(pool) != MPORT_OK)
+          goto ERROR;
+        if (mport_journal_commit(journal) != MPORT_OK)
+          goto ERROR;
         if (mport_run_asset_exec(mport, data, cwd, file) != MPORT_OK)
           goto ERROR;
         break;
+      case ASSET_TRIGGER:
+        /* queued, so it runs after the files are in place */
+        if (mport_run_asset_trigger(mport, data, cwd, file) != MPORT_OK)
+          goto ERROR;
+        break;
       case ASSET_FILE:
         if (mport_bundle_read_next_entry(bundle, &entry) != MPORT_OK)
           goto ERROR;
         
         (void)snprintf(file, FILENAME_MAX, "%s%s/%s", mport->root, cwd, data);
 
-        archive_entry_set_pathname(entry, file);
+        if (mport_journal_stage(journal, cwd, data, staged, sizeof(staged)) != MPORT_OK)
+          goto ERROR;
+
+        /* a link to a file that's still staged has to point at the staged name */
+        if (archive_entry_hardlink(entry) != NULL) {
+          if (mport_journal_link_target(journal, cwd, archive_entry_hardlink(entry), link, sizeof(link)) != MPORT_OK)
+            goto ERROR;
+          archive_entry_set_hardlink(entry, link);
+        }
+        
+        (void)snprintf(dir, FILENAME_MAX, "%s%s/%s", mport->root, cwd, staged);
+        archive_entry_set_pathname(entry, dir);
+        mport_extract_set_owner(mport, entry);
 
-        if (mport_bundle_read_extract_next_file(bundle, entry) != MPORT_OK) 
+        if (mport_extract_pool_add(pool, bundle, cwdfd, staged, entry) != MPORT_OK) 
           goto ERROR;
         
         (mport->progress_step_cb)(++file_count, file_total, file);
@@ -224,45 +296,60 @@ static int do_actual_install(mportInstance *mport, mportBundleRead *bundle, mpor
     sqlite3_reset(insert);
   }
 
+  /* a bundle read off the network has to check out before any of it is kept */
+  if (mport_bundle_read_verify_stream(bundle) != MPORT_OK)
+    goto ERROR;
+
+  /* every file has to be on disk, under its real name, before the package is marked clean */
+  if (mport_extract_pool_barrier(pool) != MPORT_OK)
+    goto ERROR;
+  
+  if (mport_journal_commit(journal) != MPORT_OK)
+    goto ERROR;
+  
+  mport_extract_pool_free(pool);
+  pool = NULL;
+  (void)close(cwdfd);
+  cwdfd = -1;
+
   sqlite3_finalize(assets); 
   sqlite3_finalize(insert);
+  assets = insert = NULL;
   
   if (mport_db_do(db, "UPDATE packages SET status='clean' WHERE pkg=%Q", pkg->name) != MPORT_OK) 
     goto ERROR;
 
-  mport_pkgmeta_logevent(mport, pkg, "Installed");
+  if (mport_pkgmeta_logevent(mport, pkg, "Installed") != MPORT_OK)
+    goto ERROR;
+
+  /* the clean flag, the assets and the log entry all hit the disk together */
+  if (mport_db_do(db, "RELEASE SAVEPOINT install_pkg") != MPORT_OK)
+    goto ERROR;
     
   (mport->progress_free_cb)();
-  (void)mport_chdir(NULL, orig_cwd);
-  free(orig_cwd);
-  return MPORT_OK;
+  
+  /* from here on, mport_recover() would finish the install rather than undo it */
+  return mport_journal_finish(journal);
   
   ERROR:
+    /* stop writing files before anything else */
+    mport_extract_pool_free(pool);
+    if (cwdfd != -1)
+      (void)close(cwdfd);
+    /* the statements have to go before we can roll back */
+    sqlite3_finalize(assets);
+    sqlite3_finalize(insert);
+    /* don't clobber the real error with one from the rollback */
+    (void)sqlite3_exec(db, "ROLLBACK TO SAVEPOINT install_pkg; RELEASE SAVEPOINT install_pkg", NULL, NULL, NULL);
+    /* and take back every file we put down */
+    mport_journal_rollback(journal);
     (mport->progress_free_cb)();
-    free(orig_cwd);
-    //rollback();
     RETURN_CURRENT_ERROR;
 }           
 
 
-#define COPY_METAFILE(TYPE)	(void)snprintf(from, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, TYPE); \
-                                if (mport_file_exists(from)) { \
-                                  (void)snprintf(to, FILENAME_MAX, "%s%s/%s-%s/%s", mport->root, MPORT_INST_INFRA_DIR, pkg->name, pkg->version, TYPE); \
-                                  if (mport_mkdir(dirname(to)) != MPORT_OK) \
-                                    RETURN_CURRENT_ERROR; \
-                                  if (mport_copy_file(from, to) != MPORT_OK) \
-                                    RETURN_CURRENT_ERROR; \
-                                }
-                                
 static int do_post_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
-  char to[FILENAME_MAX], from[FILENAME_MAX];
-
-  COPY_METAFILE(MPORT_MTREE_FILE);
-  COPY_METAFILE(MPORT_INSTALL_FILE);
-  COPY_METAFILE(MPORT_DEINSTALL_FILE);
-  COPY_METAFILE(MPORT_MESSAGE_FILE);
-
   if (display_pkg_msg(mport, bundle, pkg) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
@@ -271,18 +358,70 @@ static int do_post_install(mportInstance *mport, mportBundleRead *bundle, mportP
 
 
 
-static int run_mtree(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
+/* write all the metafiles the bundle has for pkg into the instance's infrastructure dir */
+static int write_metafiles(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
+{
+  if (write_metafile(mport, bundle, pkg, MPORT_MTREE_FILE, 0644) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  if (write_metafile(mport, bundle, pkg, MPORT_INSTALL_FILE, 0755) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  if (write_metafile(mport, bundle, pkg, MPORT_DEINSTALL_FILE, 0755) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  if (write_metafile(mport, bundle, pkg, MPORT_MESSAGE_FILE, 0644) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return MPORT_OK;
+}
+
+
+static int write_metafile(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg, const char *type, mode_t mode)
 {
   char file[FILENAME_MAX];
-  int ret;
+  const char *data;
+  size_t len;
+  ssize_t ret;
+  int fd;
+  
+  if ((data = mport_bundle_read_get_metafile(bundle, pkg, type, &len)) == NULL)
+    return MPORT_OK;
+  
+  (void)snprintf(file, FILENAME_MAX, "%s%s/%s-%s", mport->root, MPORT_INST_INFRA_DIR, pkg->name, pkg->version);
+  if (mport_mkdir(file) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  (void)strlcat(file, "/", FILENAME_MAX);
+  (void)strlcat(file, type, FILENAME_MAX);
   
-  (void)snprintf(file, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, MPORT_MTREE_FILE);
+  if ((fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, mode)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", file, strerror(errno));
   
-  if (mport_file_exists(file)) {
-    if ((ret = mport_xsystem(mport, "%s -U -f %s -d -e -p %s >/dev/null", MPORT_MTREE_BIN, file, pkg->prefix)) != 0) 
-      RETURN_ERRORX(MPORT_ERR_FATAL, "%s returned non-zero: %i", MPORT_MTREE_BIN, ret);
+  while (len > 0) {
+    if ((ret = write(fd, data, len)) == -1) {
+      if (errno == EINTR)
+        continue;
+      SET_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", file, strerror(errno));
+      (void)close(fd);
+      RETURN_CURRENT_ERROR;
+    }
+    data += ret;
+    len  -= (size_t)ret;
   }
   
+  /* the umask may have eaten the exec bits */
+  if (fchmod(fd, mode) != 0 || close(fd) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't finish %s: %s", file, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static int run_mtree(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
+{
+  const char *spec;
+  
+  if ((spec = mport_bundle_read_get_metafile(bundle, pkg, MPORT_MTREE_FILE, NULL)) != NULL) 
+    return mport_mtree_apply(mport, spec, pkg->prefix);
+  
   return MPORT_OK;
 }
 
@@ -290,16 +429,18 @@ static int run_mtree(mportInstance *mport, mportBundleRead *bundle, mportPackage
 static int run_pkg_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg, const char *mode)
 {
   char file[FILENAME_MAX];
-  int ret;
+  char prefix[FILENAME_MAX];
   
-  (void)snprintf(file, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, MPORT_INSTALL_FILE);    
+  (void)snprintf(file, FILENAME_MAX, "%s/%s-%s/%s", MPORT_INST_INFRA_DIR, pkg->name, pkg->version, MPORT_INSTALL_FILE);    
  
-  if (mport_file_exists(file)) {
-    if (chmod(file, 755) != 0)
-      RETURN_ERRORX(MPORT_ERR_FATAL, "chmod(%s, 755): %s", file, strerror(errno));
+  if (mport_bundle_read_get_metafile(bundle, pkg, MPORT_INSTALL_FILE, NULL) != NULL) {
+    const char *argv[] = {file, pkg->name, mode, NULL};
+    const char *env[]  = {prefix, NULL};
       
-    if ((ret = mport_xsystem(mport, "PKG_PREFIX=%s %s %s %s", pkg->prefix, file, pkg->name, mode)) != 0)
-      RETURN_ERRORX(MPORT_ERR_FATAL, "%s %s returned non-zero: %i", MPORT_INSTALL_FILE, mode, ret);
+    (void)snprintf(prefix, FILENAME_MAX, "PKG_PREFIX=%s", pkg->prefix);
+    
+    if (mport_spawn(mport, argv, env) != MPORT_OK)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "%s %s failed: %s", MPORT_INSTALL_FILE, mode, mport_err_string());
   }
   
  return MPORT_OK;
@@ -309,34 +450,11 @@ static int run_pkg_install(mportInstance *mport, mportBundleRead *bundle, mportP
 
 static int display_pkg_msg(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
-  char filename[FILENAME_MAX];
-  char *buf;
-  struct stat st;
-  FILE *file;
-  
-  (void)snprintf(filename, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, MPORT_MESSAGE_FILE);
-  
-  if (stat(filename, &st) == -1) 
-    /* if we couldn't stat the file, we assume there isn't a pkg-msg */
-    return MPORT_OK;
-    
-  if ((file = fopen(filename, "r")) == NULL) 
-    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", filename, strerror(errno));
-  
-  if ((buf = (char *)malloc((st.st_size + 1) * sizeof(char))) == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-
-  
-  if (fread(buf, 1, st.st_size, file) != st.st_size) {
-    free(buf);
-    RETURN_ERRORX(MPORT_ERR_FATAL, "Read error: %s", strerror(errno));
-  }
-  
-  buf[st.st_size] = 0;
-  
-  mport_call_msg_cb(mport, buf);
+  const char *msg;
   
-  free(buf);
+  /* no pkg-message is fine; the buffer is nul terminated for us */
+  if ((msg = mport_bundle_read_get_metafile(bundle, pkg, MPORT_MESSAGE_FILE, NULL)) != NULL)
+    mport_call_msg_cb(mport, "%s", msg);
   
   return MPORT_OK;
 }
@@ -40,6 +40,8 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include "mport.h"
@@ -55,6 +57,13 @@ struct links_table {
   struct link_node **buckets;
 };
 
+struct bundle_toc_entry {
+  char *name;
+  off_t offset;
+  off_t length;
+  struct bundle_toc_entry *next;
+};
+
 struct link_node {
   int links;
   dev_t dev;
@@ -67,6 +76,12 @@ struct link_node {
 
 static int lookup_hardlink(mportBundleWrite *, struct archive_entry *, const struct stat *);
 static void free_linktable(struct links_table *);
+static int open_archive(mportBundleWrite *);
+static int set_compression(mportBundleWrite *);
+static int end_segment(mportBundleWrite *);
+static int add_toc_entry(mportBundleWrite *, char *, off_t, off_t);
+static int write_toc(mportBundleWrite *);
+static int write_all(int, const void *, size_t);
 
 /* 
  * mport_bundle_write_new() 
@@ -81,31 +96,142 @@ mportBundleWrite* mport_bundle_write_new()
  
 
 /*
- * mport_bundle_write_init(bundle, filename)
+ * mport_bundle_write_init(bundle, filename, compression, level, flags)
  * 
  * set up an bundle for adding files.  Sets the bundle file to
- * filename.
+ * filename, compressed with the given codec.  A level of 0 uses
+ * the codec's default.  If flags has MPORT_BUNDLE_SEGMENTED, the 
+ * files added until the first mport_bundle_write_start_segment() 
+ * call make up the meta segment.  MPORT_BUNDLE_RAW_META also leaves
+ * that segment uncompressed.
  */
-int mport_bundle_write_init(mportBundleWrite *bundle, const char *filename)
+int mport_bundle_write_init(mportBundleWrite *bundle, const char *filename, mportCompression compression, int level, int flags)
 {
+  bundle->archive     = NULL;
+  bundle->links       = NULL; 
+  bundle->fd          = -1;
+  bundle->compression = compression;
+  bundle->level       = level;
+  bundle->flags       = flags;
+  bundle->segname     = NULL;
+  bundle->segstart    = 0;
+  bundle->toc         = NULL;
+
+  if (flags & MPORT_BUNDLE_RAW_META)
+    bundle->flags |= MPORT_BUNDLE_SEGMENTED;
+
   if ((bundle->filename = strdup(filename)) == NULL)
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't dup filename");
    
-  if ((bundle->archive = archive_write_new()) == NULL) 
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate archive struct");
+  if ((bundle->fd = open(bundle->filename, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", bundle->filename, strerror(errno));
 
-  archive_write_set_compression_bzip2(bundle->archive);
-  archive_write_set_format_pax(bundle->archive);
+  if ((bundle->flags & MPORT_BUNDLE_SEGMENTED) && (bundle->segname = strdup(MPORT_TOC_META)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
 
-  bundle->links = NULL; 
+  return open_archive(bundle);
+}
 
-  if (archive_write_open_filename(bundle->archive, bundle->filename) != ARCHIVE_OK) {
-    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive)); 
+
+/*
+ * mport_bundle_write_start_segment(bundle, pkgname)
+ *
+ * Close off the current segment, and start a new one for pkgname.  Does nothing
+ * if the bundle isn't segmented, so callers can always call it before adding
+ * a package's files.
+ */
+int mport_bundle_write_start_segment(mportBundleWrite *bundle, const char *pkgname)
+{
+  if (!(bundle->flags & MPORT_BUNDLE_SEGMENTED))
+    return MPORT_OK;
+  
+  if (end_segment(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((bundle->segname = strdup(pkgname)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  return open_archive(bundle);
+}
+
+
+/*
+ * mport_bundle_write_copy_segment(bundle, inbundle, pkgname)
+ *
+ * Copy pkgname's segment from the segmented bundle inbundle without 
+ * recompressing it.  The caller has to make sure the codecs match.
+ */
+int mport_bundle_write_copy_segment(mportBundleWrite *bundle, mportBundleRead *inbundle, const char *pkgname)
+{
+  mportBundleSegment *seg = NULL;
+  char buff[BUFF_SIZE];
+  off_t done, want;
+  ssize_t len;
+  char *name;
+  int i;
+  
+  if (!(bundle->flags & MPORT_BUNDLE_SEGMENTED) || inbundle->toc == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Segments can only be copied between segmented bundles.");
+  
+  for (i = 0; i < inbundle->nsegments; i++) {
+    if (strcmp(inbundle->toc[i].name, pkgname) == 0) {
+      seg = &inbundle->toc[i];
+      break;
+    }
+  }
+  
+  if (seg == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: no segment for %s", inbundle->filename, pkgname);
+  
+  if (end_segment(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  for (done = 0; done < seg->length; done += len) {
+    want = seg->length - done;
+    if (want > (off_t)sizeof(buff))
+      want = sizeof(buff);
+    
+    len = pread(inbundle->fd, buff, (size_t)want, seg->offset + done);
+    
+    if (len <= 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read %s: %s", inbundle->filename, len == 0 ? "short file" : strerror(errno));
+    
+    if (write_all(bundle->fd, buff, (size_t)len) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
   }
   
+  if ((name = strdup(pkgname)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if (add_toc_entry(bundle, name, bundle->segstart, seg->length) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  bundle->segstart += seg->length;
+  
   return MPORT_OK;
 }
 
+
+/*
+ * mport_compression_name(compression)
+ *
+ * The name of the codec as it is recorded in stub.meta.
+ */
+const char * mport_compression_name(mportCompression compression)
+{
+  switch (compression) {
+    case MPORT_COMPRESS_BZIP2:
+      return "bzip2";
+    case MPORT_COMPRESS_XZ:
+      return "xz";
+    case MPORT_COMPRESS_ZSTD:
+      return "zstd";
+  }
+
+  return "unknown";
+}
+
+
 /* 
  * mport_bundle_write_finish(bundle)
  *
@@ -114,12 +240,25 @@ int mport_bundle_write_init(mportBundleWrite *bundle, const char *filename)
  */
 int mport_bundle_write_finish(mportBundleWrite *bundle)
 {
-  int ret = MPORT_OK;
+  struct bundle_toc_entry *toc;
+  int ret;
+  
+  ret = end_segment(bundle);
   
-  if (archive_write_finish(bundle->archive) != ARCHIVE_OK)
-    ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+  if (ret == MPORT_OK && (bundle->flags & MPORT_BUNDLE_SEGMENTED))
+    ret = write_toc(bundle);
+  
+  if (bundle->fd != -1 && close(bundle->fd) != 0 && ret == MPORT_OK)
+    ret = SET_ERRORX(MPORT_ERR_FATAL, "Couldn't close %s: %s", bundle->filename, strerror(errno));
+
+  while ((toc = bundle->toc) != NULL) {
+    bundle->toc = toc->next;
+    free(toc->name);
+    free(toc);
+  }
 
   free_linktable(bundle->links);      
+  free(bundle->segname);
   free(bundle->filename);
   free(bundle);
   
@@ -236,6 +375,187 @@ int mport_bundle_write_add_entry(mportBundleWrite *bundle, mportBundleRead *inbu
 }
 
 
+/* start a new archive on the bundle's fd, for the whole bundle or its next segment */
+static int open_archive(mportBundleWrite *bundle)
+{
+  if ((bundle->archive = archive_write_new()) == NULL) 
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate archive struct");
+
+  if ((bundle->flags & MPORT_BUNDLE_RAW_META) && strcmp(bundle->segname, MPORT_TOC_META) == 0) {
+    archive_write_set_compression_none(bundle->archive);
+  } else if (set_compression(bundle) != MPORT_OK) {
+    RETURN_CURRENT_ERROR;
+  }
+
+  archive_write_set_format_pax(bundle->archive);
+  
+  /* segments are packed end to end, so no block padding */
+  if (bundle->flags & MPORT_BUNDLE_SEGMENTED)
+    archive_write_set_bytes_in_last_block(bundle->archive, 1);
+
+  if (archive_write_open_fd(bundle->archive, bundle->fd) != ARCHIVE_OK) {
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive)); 
+  }
+  
+  return MPORT_OK;
+}
+
+
+static int set_compression(mportBundleWrite *bundle)
+{
+  char opt[32];
+  int ret;
+
+  switch (bundle->compression) {
+    case MPORT_COMPRESS_BZIP2:
+      ret = archive_write_set_compression_bzip2(bundle->archive);
+      break;
+    case MPORT_COMPRESS_XZ:
+      ret = archive_write_set_compression_xz(bundle->archive);
+      break;
+    case MPORT_COMPRESS_ZSTD:
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+      ret = archive_write_add_filter_zstd(bundle->archive);
+#else
+      RETURN_ERROR(MPORT_ERR_FATAL, "This libarchive was built without zstd support.");
+#endif
+      break;
+    default:
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Unknown bundle compression: %i", bundle->compression);
+  }
+
+  if (ret != ARCHIVE_OK)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+
+  if (bundle->level > 0) {
+    (void)snprintf(opt, sizeof(opt), "compression-level=%i", bundle->level);
+    if (archive_write_set_options(bundle->archive, opt) != ARCHIVE_OK)
+      RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+  }
+  
+  return MPORT_OK;
+}
+
+
+/* finish the current archive, and record it in the toc if the bundle is segmented */
+static int end_segment(mportBundleWrite *bundle)
+{
+  off_t end;
+  char *name;
+  
+  if (bundle->archive == NULL)
+    return MPORT_OK;
+  
+  if (archive_write_close(bundle->archive) != ARCHIVE_OK) {
+    SET_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+    archive_write_finish(bundle->archive);
+    bundle->archive = NULL;
+    RETURN_CURRENT_ERROR;
+  }
+
+  archive_write_finish(bundle->archive);
+  bundle->archive = NULL;
+  
+  if (!(bundle->flags & MPORT_BUNDLE_SEGMENTED))
+    return MPORT_OK;
+    
+  if ((end = lseek(bundle->fd, 0, SEEK_CUR)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't seek %s: %s", bundle->filename, strerror(errno));
+  
+  name = bundle->segname;
+  bundle->segname = NULL;
+  
+  if (add_toc_entry(bundle, name, bundle->segstart, end - bundle->segstart) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  bundle->segstart = end;
+  
+  /* a hardlink can't point into another segment */
+  free_linktable(bundle->links);
+  bundle->links = NULL;
+  
+  return MPORT_OK;
+}
+
+
+/* append a segment to the toc; the toc takes ownership of name */
+static int add_toc_entry(mportBundleWrite *bundle, char *name, off_t offset, off_t length)
+{
+  struct bundle_toc_entry *entry, **tail;
+  
+  if (strpbrk(name, " \t\n") != NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Can't put '%s' in a bundle table of contents", name);
+    free(name);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if ((entry = (struct bundle_toc_entry *)malloc(sizeof(struct bundle_toc_entry))) == NULL) {
+    free(name);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  entry->name   = name;
+  entry->offset = offset;
+  entry->length = length;
+  entry->next   = NULL;
+  
+  for (tail = &bundle->toc; *tail != NULL; tail = &(*tail)->next)
+    ;
+  *tail = entry;
+  
+  return MPORT_OK;
+}
+
+
+/* write the toc and the trailer that points at it after the last segment */
+static int write_toc(mportBundleWrite *bundle)
+{
+  struct bundle_toc_entry *entry;
+  unsigned char trailer[MPORT_TOC_TRAILER_LEN];
+  uint64_t where = (uint64_t)bundle->segstart;
+  char line[FILENAME_MAX + 64];
+  int len, i;
+  
+  for (entry = bundle->toc; entry != NULL; entry = entry->next) {
+    len = snprintf(line, sizeof(line), "%jd %jd %s\n", (intmax_t)entry->offset, (intmax_t)entry->length, entry->name);
+    
+    if (len < 0 || (size_t)len >= sizeof(line))
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Segment name too long: %s", entry->name);
+    
+    if (write_all(bundle->fd, line, (size_t)len) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  memcpy(trailer, MPORT_TOC_MAGIC, MPORT_TOC_MAGIC_LEN);
+  for (i = MPORT_TOC_TRAILER_LEN - 1; i >= MPORT_TOC_MAGIC_LEN; i--) {
+    trailer[i] = where & 0xff;
+    where >>= 8;
+  }
+  
+  return write_all(bundle->fd, trailer, sizeof(trailer));
+}
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t ret;
+  
+  while (len > 0) {
+    if ((ret = write(fd, p, len)) == -1) {
+      if (errno == EINTR)
+        continue;
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Write error: %s", strerror(errno));
+    }
+    
+    p   += ret;
+    len -= (size_t)ret;
+  }  
+  
+  return MPORT_OK;
+}
+
+
 /* lookup a file with more than one link in the link table.  If we find an entry
  * for the inode in the table, mark this incoming file as a hardlink to the prior file.
  * otherwise insert the new file into the table
@@ -362,15 +682,11 @@ static void free_linktable(struct links_table *links)
       links->buckets[i] = node->next;
       
       free(node->name);
-      
-      if (node->name != NULL)
-        free(node->name);
-      
       free(node);
     }
   }
   
   free(links->buckets);
-  links->buckets = NULL;
+  free(links);
 }
 
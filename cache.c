@@ -0,0 +1,493 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* A download cache shared by every root on the host.
+ *
+ * Bundles are kept by the sha256 the index gives for them, as
+ * <cache_dir>/<first two hex digits>/<hash>, so identical bundles fetched for
+ * different roots (or under different names) are only downloaded once.  The
+ * cache dir is a host path; it isn't under mport->root.  A fetch looks in the
+ * cache first, then at a copy already in the staging dir, and only then
+ * goes to the network; whatever comes off the network is checked against
+ * the hash before it's used or cached.
+ *
+ * Entries are written under a temp name and renamed into place, so readers
+ * never see half an entry.  Readers and writers hold a shared flock on
+ * <cache_dir>/lock; eviction holds it exclusively, and is skipped when it
+ * can't get it.  Using an entry touches its mtime, which eviction treats as
+ * the last use: entries older than cache_max_age go, then the least recently
+ * used until the cache fits in cache_max_size.  Hits and misses are counted
+ * in <cache_dir>/stats, under its own lock.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sha256.h>
+#include "mport.h"
+#include "mport_private.h"
+
+struct cache_entry {
+  char path[FILENAME_MAX];
+  off_t size;
+  time_t used;
+};
+
+static int cache_open(mportInstance *, int, int *);
+static int entry_path(mportInstance *, const char *, char *, size_t);
+static int place(const char *, const char *);
+static int matches(const char *, const char *);
+static int fetch_checked(mportInstance *, char **, const char *, const char *, const char *, int);
+static int insert(mportInstance *, const char *, const char *);
+static void count(mportInstance *, int, off_t);
+static int read_stats(const char *, mportCacheStats *);
+static int scan(mportInstance *, struct cache_entry **, int *);
+static int entry_cmp(const void *, const void *);
+
+
+/* mport_cache_fetch(mport, mirrors, filename, hash, flags)
+ *
+ * Put the bundle filename, whose sha256 is hash, in MPORT_FETCH_STAGING_DIR:
+ * from the cache if it's there, otherwise from mirrors (see 
+ * mport_fetch_bundle_mirrors()), after which it's cached.  With no cache
+ * dir the download is still checked against hash, it just isn't cached.
+ * With no hash (an old index) there is nothing to check or cache by, and
+ * this is just mport_fetch_bundle_mirrors().  Safe to call from any thread.
+ */
+int mport_cache_fetch(mportInstance *mport, char **mirrors, const char *filename, const char *hash, int flags)
+{
+  char dest[FILENAME_MAX];
+  char entry[FILENAME_MAX];
+  struct stat st;
+  int lockfd;
+  
+  if (hash == NULL)
+    return mport_fetch_bundle_mirrors(mport, mirrors, filename, flags);
+  
+  (void)snprintf(dest, sizeof(dest), "%s/%s", MPORT_FETCH_STAGING_DIR, filename);
+  
+  if (mport->cache_dir == NULL)
+    return fetch_checked(mport, mirrors, filename, dest, hash, flags);
+  
+  if (entry_path(mport, hash, entry, sizeof(entry)) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (cache_open(mport, LOCK_SH, &lockfd) == MPORT_OK) {
+    if (stat(entry, &st) == 0 && place(entry, dest) == MPORT_OK) {
+      (void)utimes(entry, NULL);
+      (void)close(lockfd);
+      count(mport, 1, st.st_size);
+      return MPORT_OK;
+    }
+    
+    (void)close(lockfd);
+  }
+  
+  /* staged by an earlier run, before there was a cache */
+  if (stat(dest, &st) == 0 && matches(dest, hash)) {
+    (void)insert(mport, dest, hash);
+    count(mport, 1, st.st_size);
+    return MPORT_OK;
+  }
+  
+  if (fetch_checked(mport, mirrors, filename, dest, hash, flags) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (stat(dest, &st) == 0)
+    count(mport, 0, st.st_size);
+  
+  /* a cache we can't write to is no reason to fail the fetch */
+  if (insert(mport, dest, hash) == MPORT_OK)
+    (void)mport_cache_clean(mport);
+  
+  return MPORT_OK;
+}
+
+
+/* mport_cache_clean(mport)
+ *
+ * Evict whatever is too old, then the least recently used entries until the
+ * cache fits.  A limit of 0 is no limit.  If another process is using the
+ * cache, try again later.
+ */
+MPORT_PUBLIC_API int mport_cache_clean(mportInstance *mport)
+{
+  struct cache_entry *entries;
+  off_t total = 0;
+  time_t oldest;
+  int lockfd, n, i;
+  
+  if (mport->cache_dir == NULL)
+    return MPORT_OK;
+  
+  if (cache_open(mport, LOCK_EX|LOCK_NB, &lockfd) != MPORT_OK)
+    return MPORT_OK;
+  
+  if (scan(mport, &entries, &n) != MPORT_OK) {
+    (void)close(lockfd);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  qsort(entries, n, sizeof(struct cache_entry), entry_cmp);
+  
+  for (i = 0; i < n; i++)
+    total += entries[i].size;
+  
+  oldest = time(NULL) - mport->cache_max_age;
+  
+  /* oldest first */
+  for (i = 0; i < n; i++) {
+    if ((mport->cache_max_age == 0 || entries[i].used >= oldest) && 
+        (mport->cache_max_size == 0 || total <= mport->cache_max_size))
+      break;
+    
+    if (unlink(entries[i].path) == 0)
+      total -= entries[i].size;
+  }
+  
+  free(entries);
+  (void)close(lockfd);
+  
+  return MPORT_OK;
+}
+
+
+/* mport_cache_stats(mport, &stats)
+ *
+ * Report how the cache has done since it was created, and what's in it.  The
+ * hit rate is hits / (hits + misses).
+ */
+MPORT_PUBLIC_API int mport_cache_stats(mportInstance *mport, mportCacheStats *stats)
+{
+  struct cache_entry *entries;
+  char file[FILENAME_MAX];
+  int lockfd, n, i;
+  
+  bzero(stats, sizeof(mportCacheStats));
+  
+  if (mport->cache_dir == NULL)
+    return MPORT_OK;
+  
+  (void)snprintf(file, sizeof(file), "%s/stats", mport->cache_dir);
+  
+  if (read_stats(file, stats) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (cache_open(mport, LOCK_SH, &lockfd) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (scan(mport, &entries, &n) != MPORT_OK) {
+    (void)close(lockfd);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  (void)close(lockfd);
+  
+  stats->entries = n;
+  for (i = 0; i < n; i++)
+    stats->size += entries[i].size;
+  
+  free(entries);
+  
+  return MPORT_OK;
+}
+
+
+/* open and flock the cache's lock file, making the cache dir if need be */
+static int cache_open(mportInstance *mport, int how, int *fdp)
+{
+  char path[FILENAME_MAX];
+  char *p;
+  int fd;
+  
+  (void)strlcpy(path, mport->cache_dir, sizeof(path));
+  
+  for (p = path + 1; *p != '\0'; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      (void)mkdir(path, 0755);
+      *p = '/';
+    }
+  }
+  
+  (void)mkdir(path, 0755);
+  (void)strlcat(path, "/lock", sizeof(path));
+  
+  if ((fd = open(path, O_RDONLY|O_CREAT, 0644)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", path, strerror(errno));
+  
+  if (flock(fd, how) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't lock %s: %s", path, strerror(errno));
+    (void)close(fd);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  *fdp = fd;
+  
+  return MPORT_OK;
+}
+
+
+static int entry_path(mportInstance *mport, const char *hash, char *path, size_t len)
+{
+  /* it goes in a file name */
+  if (strlen(hash) != 64 || strspn(hash, "0123456789abcdef") != 64)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Malformed bundle checksum in the index: %s", hash);
+  
+  (void)snprintf(path, len, "%s/%.2s/%s", mport->cache_dir, hash, hash);
+  
+  return MPORT_OK;
+}
+
+
+/* make to the same file as from; a link if we can, a copy if we must.  to is
+ * replaced in one go. */
+static int place(const char *from, const char *to)
+{
+  static __thread char self;  /* its address tells our threads apart */
+  char tmp[FILENAME_MAX];
+  
+  (void)snprintf(tmp, sizeof(tmp), "%s.cache.%ld.%p", to, (long)getpid(), (void *)&self);
+  (void)unlink(tmp);
+  
+  if (link(from, tmp) != 0 && mport_copy_file(from, tmp) != MPORT_OK) {
+    (void)unlink(tmp);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if (rename(tmp, to) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't rename %s to %s: %s", tmp, to, strerror(errno));
+    (void)unlink(tmp);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/* fetch filename to dest, and throw it away unless it is hash */
+static int fetch_checked(mportInstance *mport, char **mirrors, const char *filename, const char *dest, const char *hash, int flags)
+{
+  if (mport_fetch_bundle_mirrors(mport, mirrors, filename, flags) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (!matches(dest, hash)) {
+    (void)unlink(dest);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s doesn't match the checksum in the index.", filename);
+  }
+  
+  return MPORT_OK;
+}
+
+
+static int matches(const char *file, const char *hash)
+{
+  char sum[65];
+  
+  if (SHA256_File(file, sum) == NULL)
+    return 0;
+  
+  return strcmp(sum, hash) == 0;
+}
+
+
+/* put file in the cache as hash */
+static int insert(mportInstance *mport, const char *file, const char *hash)
+{
+  char entry[FILENAME_MAX];
+  char dir[FILENAME_MAX];
+  int lockfd, ret;
+  
+  if (entry_path(mport, hash, entry, sizeof(entry)) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (cache_open(mport, LOCK_SH, &lockfd) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  (void)snprintf(dir, sizeof(dir), "%s/%.2s", mport->cache_dir, hash);
+  
+  if ((ret = mport_mkdir(dir)) == MPORT_OK)
+    ret = place(file, entry);
+  
+  (void)close(lockfd);
+  
+  return ret;
+}
+
+
+/* count a hit or a miss of size bytes */
+static void count(mportInstance *mport, int hit, off_t size)
+{
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  unsigned long hits = 0, misses = 0;
+  intmax_t saved = 0, fetched = 0;
+  char file[FILENAME_MAX];
+  FILE *fp;
+  int fd;
+  
+  (void)snprintf(file, sizeof(file), "%s/stats", mport->cache_dir);
+  
+  /* flock() keeps other processes out, the mutex our other threads */
+  pthread_mutex_lock(&lock);
+  
+  if ((fd = open(file, O_RDWR|O_CREAT, 0644)) == -1 || flock(fd, LOCK_EX) != 0 || (fp = fdopen(fd, "r+")) == NULL) {
+    if (fd != -1)
+      (void)close(fd);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  
+  (void)fscanf(fp, "%lu %lu %jd %jd", &hits, &misses, &saved, &fetched);
+  
+  if (hit) {
+    hits++;
+    saved += size;
+  } else {
+    misses++;
+    fetched += size;
+  }
+  
+  rewind(fp);
+  (void)fprintf(fp, "%lu %lu %jd %jd\n", hits, misses, saved, fetched);
+  (void)fflush(fp);
+  (void)ftruncate(fd, ftello(fp));
+  (void)fclose(fp);
+  
+  pthread_mutex_unlock(&lock);
+}
+
+
+static int read_stats(const char *file, mportCacheStats *stats)
+{
+  intmax_t saved = 0, fetched = 0;
+  FILE *fp;
+  
+  if ((fp = fopen(file, "r")) == NULL) {
+    if (errno == ENOENT)
+      return MPORT_OK;
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", file, strerror(errno));
+  }
+  
+  (void)flock(fileno(fp), LOCK_SH);
+  (void)fscanf(fp, "%lu %lu %jd %jd", &stats->hits, &stats->misses, &saved, &fetched);
+  (void)fclose(fp);
+  
+  stats->bytes_saved   = (off_t)saved;
+  stats->bytes_fetched = (off_t)fetched;
+  
+  return MPORT_OK;
+}
+
+
+/* list every entry in the cache.  Temp files left by a crash are cleaned up
+ * as we go. */
+static int scan(mportInstance *mport, struct cache_entry **entriesp, int *np)
+{
+  struct cache_entry *entries = NULL, *e;
+  struct dirent *top, *ent;
+  struct stat st;
+  char dir[FILENAME_MAX];
+  DIR *td, *d;
+  int n = 0, allocated = 0;
+  
+  if ((td = opendir(mport->cache_dir)) == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", mport->cache_dir, strerror(errno));
+  
+  while ((top = readdir(td)) != NULL) {
+    if (strlen(top->d_name) != 2 || top->d_name[0] == '.')
+      continue;
+    
+    (void)snprintf(dir, sizeof(dir), "%s/%s", mport->cache_dir, top->d_name);
+    
+    if ((d = opendir(dir)) == NULL)
+      continue;
+    
+    while ((ent = readdir(d)) != NULL) {
+      if (ent->d_name[0] == '.')
+        continue;
+      
+      if (n == allocated) {
+        allocated = allocated == 0 ? 256 : allocated * 2;
+        if ((e = (struct cache_entry *)realloc(entries, allocated * sizeof(struct cache_entry))) == NULL) {
+          free(entries);
+          (void)closedir(d);
+          (void)closedir(td);
+          RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+        }
+        entries = e;
+      }
+      
+      e = &entries[n];
+      (void)snprintf(e->path, sizeof(e->path), "%s/%s", dir, ent->d_name);
+      
+      if (lstat(e->path, &st) != 0)
+        continue;
+      
+      /* a place() that never finished */
+      if (strstr(ent->d_name, ".cache.") != NULL) {
+        if (st.st_mtime < time(NULL) - 3600)
+          (void)unlink(e->path);
+        continue;
+      }
+      
+      e->size = st.st_size;
+      e->used = st.st_mtime;
+      n++;
+    }
+    
+    (void)closedir(d);
+  }
+  
+  (void)closedir(td);
+  
+  *entriesp = entries;
+  *np = n;
+  
+  return MPORT_OK;
+}
+
+
+/* least recently used first */
+static int entry_cmp(const void *a, const void *b)
+{
+  time_t x = ((const struct cache_entry *)a)->used;
+  time_t y = ((const struct cache_entry *)b)->used;
+  
+  return x < y ? -1 : x > y;
+}
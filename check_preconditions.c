@@ -30,8 +30,8 @@
 #include "mport_private.h"
 
 
-static int check_if_installed(sqlite3 *, mportPackageMeta *);
-static int check_conflicts(sqlite3 *, mportPackageMeta *);
+static int check_if_installed(mportInstance *, mportPackageMeta *);
+static int check_conflicts(mportInstance *, mportPackageMeta *);
 static int check_depends(mportInstance *mport, mportPackageMeta *);
 static int check_if_older_installed(mportInstance *, mportPackageMeta *);
 
@@ -53,11 +53,11 @@ static int check_if_older_installed(mportInstance *, mportPackageMeta *);
  
 int mport_check_preconditions(mportInstance *mport, mportPackageMeta *pack, int flags) 
 {
-  if (flags & MPORT_PRECHECK_INSTALLED && check_if_installed(mport->db, pack) != MPORT_OK)
+  if (flags & MPORT_PRECHECK_INSTALLED && check_if_installed(mport, pack) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   if (flags & MPORT_PRECHECK_UPGRADEABLE && check_if_older_installed(mport, pack) != MPORT_OK)
     RETURN_CURRENT_ERROR;
-  if (flags & MPORT_PRECHECK_CONFLICTS && check_conflicts(mport->db, pack) != MPORT_OK)
+  if (flags & MPORT_PRECHECK_CONFLICTS && check_conflicts(mport, pack) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   if (flags & MPORT_PRECHECK_DEPENDS && check_depends(mport, pack) != MPORT_OK)
     RETURN_CURRENT_ERROR;
@@ -66,13 +66,14 @@ int mport_check_preconditions(mportInstance *mport, mportPackageMeta *pack, int
 }
 
 
-static int check_if_installed(sqlite3 *db, mportPackageMeta *pack)
+static int check_if_installed(mportInstance *mport, mportPackageMeta *pack)
 {
+  sqlite3 *db = mport->db;
   sqlite3_stmt *stmt;
   const char *inst_version;
   
   /* check if the package is already installed */
-  if (mport_db_prepare(db, &stmt, "SELECT version FROM packages WHERE pkg=%Q", pack->name) != MPORT_OK) 
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT version FROM packages WHERE pkg=?", pack->name) != MPORT_OK) 
     RETURN_CURRENT_ERROR;
 
   switch (sqlite3_step(stmt)) {
@@ -84,28 +85,29 @@ static int check_if_installed(sqlite3 *db, mportPackageMeta *pack)
       inst_version = sqlite3_column_text(stmt, 0);
       
       SET_ERRORX(MPORT_ERR_FATAL, "%s (version %s) is already installed.", pack->name, inst_version);
-      sqlite3_finalize(stmt);
+      mport_db_release(mport, stmt);
       RETURN_CURRENT_ERROR;
 
       break;
     default:
       /* Some sort of sqlite error */
       SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-      sqlite3_finalize(stmt);
+      mport_db_release(mport, stmt);
       RETURN_CURRENT_ERROR;
   }
 
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return MPORT_OK;
 }  
 
-static int check_conflicts(sqlite3 *db, mportPackageMeta *pack)
+static int check_conflicts(mportInstance *mport, mportPackageMeta *pack)
 {
+  sqlite3 *db = mport->db;
   sqlite3_stmt *stmt;
   int ret;
   const char *inst_name, *inst_version;
   
-  if (mport_db_prepare(db, &stmt, "SELECT packages.pkg, packages.version FROM stub.conflicts LEFT JOIN packages ON packages.pkg GLOB stub.conflicts.conflict_pkg AND packages.version GLOB stub.conflicts.conflict_version WHERE stub.conflicts.pkg=%Q AND packages.pkg IS NOT NULL", pack->name) != MPORT_OK) 
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT packages.pkg, packages.version FROM stub.conflicts LEFT JOIN packages ON packages.pkg GLOB stub.conflicts.conflict_pkg AND packages.version GLOB stub.conflicts.conflict_version WHERE stub.conflicts.pkg=? AND packages.pkg IS NOT NULL", pack->name) != MPORT_OK) 
     RETURN_CURRENT_ERROR;
   
   while (1) {
@@ -116,19 +118,19 @@ static int check_conflicts(sqlite3 *db, mportPackageMeta *pack)
         inst_version = sqlite3_column_text(stmt, 1);
         
         SET_ERRORX(MPORT_ERR_FATAL, "Installed package %s-%s conflicts with %s", inst_name, inst_version, pack->name);
-        sqlite3_finalize(stmt);
+        mport_db_release(mport, stmt);
         RETURN_CURRENT_ERROR;
     } else if (ret == SQLITE_DONE) {
       /* No conflicts */
       break;
     } else {
       SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-      sqlite3_finalize(stmt);
+      mport_db_release(mport, stmt);
       RETURN_CURRENT_ERROR;
     }
   }
   
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return MPORT_OK;
 }
 
@@ -141,11 +143,11 @@ static int check_depends(mportInstance *mport, mportPackageMeta *pack)
   int ret;
   
   /* check for depends */
-  if (mport_db_prepare(db, &stmt, "SELECT depend_pkgname, depend_pkgversion FROM stub.depends WHERE pkg=%Q", pack->name) != MPORT_OK) 
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT depend_pkgname, depend_pkgversion FROM stub.depends WHERE pkg=?", pack->name) != MPORT_OK) 
     RETURN_CURRENT_ERROR;
  
-  if (mport_db_prepare(db, &lookup, "SELECT version FROM packages WHERE pkg=? AND status='clean'") != MPORT_OK) {
-    sqlite3_finalize(stmt);
+  if (mport_db_prepare_cached(mport, &lookup, "SELECT version FROM packages WHERE pkg=? AND status='clean'", (const char *)NULL) != MPORT_OK) {
+    mport_db_release(mport, stmt);
     RETURN_CURRENT_ERROR;
   }  
   
@@ -158,7 +160,7 @@ static int check_depends(mportInstance *mport, mportPackageMeta *pack)
       
       if (sqlite3_bind_text(lookup, 1, depend_pkg, -1, SQLITE_STATIC) != SQLITE_OK) {
         SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-        sqlite3_finalize(lookup); sqlite3_finalize(stmt);
+        mport_db_release(mport, lookup); mport_db_release(mport, stmt);
         RETURN_CURRENT_ERROR;
       }
       
@@ -174,10 +176,11 @@ static int check_depends(mportInstance *mport, mportPackageMeta *pack)
           ok = mport_version_require_check((char *)inst_version, (char *)depend_version);
           
           if (ok > 0) {
+            mport_db_release(mport, lookup); mport_db_release(mport, stmt);
             RETURN_CURRENT_ERROR;
           } else if (ok == -1) {
             SET_ERRORX(MPORT_ERR_FATAL, "%s depends on %s version %s.  Version %s is installed.", pack->name, depend_pkg, depend_version, inst_version);
-            sqlite3_finalize(lookup); sqlite3_finalize(stmt);
+            mport_db_release(mport, lookup); mport_db_release(mport, stmt);
             RETURN_CURRENT_ERROR;
           }
           
@@ -186,12 +189,12 @@ static int check_depends(mportInstance *mport, mportPackageMeta *pack)
           /* this depend isn't installed. */
            /* this depend isn't installed. */
            SET_ERRORX(MPORT_ERR_FATAL, "%s depends on %s, which is not installed.", pack->name, depend_pkg);
-           sqlite3_finalize(lookup); sqlite3_finalize(stmt);
+           mport_db_release(mport, lookup); mport_db_release(mport, stmt);
            RETURN_CURRENT_ERROR;
           break;
         default:
           SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-          sqlite3_finalize(lookup); sqlite3_finalize(stmt);
+          mport_db_release(mport, lookup); mport_db_release(mport, stmt);
           RETURN_CURRENT_ERROR;
       }
       
@@ -202,11 +205,12 @@ static int check_depends(mportInstance *mport, mportPackageMeta *pack)
       break;
     } else {
       SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-      sqlite3_finalize(lookup); sqlite3_finalize(stmt);
+      mport_db_release(mport, lookup); mport_db_release(mport, stmt);
       RETURN_CURRENT_ERROR;
     }
   }        
   
+  mport_db_release(mport, lookup); mport_db_release(mport, stmt);
   return MPORT_OK;    
 }  
 
@@ -216,7 +220,7 @@ static int check_if_older_installed(mportInstance *mport, mportPackageMeta *pkg)
   sqlite3_stmt *stmt;
   int ret;
     
-  if (mport_db_prepare(mport->db, &stmt, "SELECT 1 FROM packages WHERE pkg=%Q and mport_version_cmp(version, %Q) < 0", pkg->name, pkg->version) != MPORT_OK)
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT 1 FROM packages WHERE pkg=? and mport_version_cmp(version, ?) < 0", pkg->name, pkg->version) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
   switch (sqlite3_step(stmt)) {
@@ -231,6 +235,6 @@ static int check_if_older_installed(mportInstance *mport, mportPackageMeta *pkg)
       break;
   }
   
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return ret;
 }
@@ -42,7 +42,7 @@
 #include "mport.h"
 #include "mport_private.h"
 
-static int create_stub_db(sqlite3 **, const char *);
+static int create_stub_db(sqlite3 **, const char *, mportCreateExtras *);
 static int insert_assetlist(sqlite3 *, mportAssetList *, mportPackageMeta *, mportCreateExtras *);
 static int insert_meta(sqlite3 *, mportPackageMeta *, mportCreateExtras *);
 static int insert_depends(sqlite3 *, mportPackageMeta *, mportCreateExtras *);
@@ -68,7 +68,7 @@ MPORT_PUBLIC_API int mport_create_primative(mportAssetList *assetlist, mportPack
     goto CLEANUP;
   }
   
-  if ((ret = create_stub_db(&db, tmpdir)) != MPORT_OK)
+  if ((ret = create_stub_db(&db, tmpdir, extra)) != MPORT_OK)
     goto CLEANUP;
 
   if ((ret = insert_assetlist(db, assetlist, pack, extra)) != MPORT_OK)
@@ -91,7 +91,7 @@ MPORT_PUBLIC_API int mport_create_primative(mportAssetList *assetlist, mportPack
 }
 
 
-static int create_stub_db(sqlite3 **db, const char *tmpdir) 
+static int create_stub_db(sqlite3 **db, const char *tmpdir, mportCreateExtras *extra) 
 {
   char file[FILENAME_MAX];
   
@@ -103,7 +103,7 @@ static int create_stub_db(sqlite3 **db, const char *tmpdir)
   }
   
   /* create tables */
-  return mport_generate_stub_schema(*db);
+  return mport_generate_stub_schema(*db, extra->compression, extra->bundle_flags);
 }
 
 static int insert_assetlist(sqlite3 *db, mportAssetList *assetlist, mportPackageMeta *pack, mportCreateExtras *extra)
@@ -385,7 +385,7 @@ static int archive_files(mportAssetList *assetlist, mportPackageMeta *pack, mpor
   
   bundle = mport_bundle_write_new();
   
-  if (mport_bundle_write_init(bundle, extra->pkg_filename) != MPORT_OK)
+  if (mport_bundle_write_init(bundle, extra->pkg_filename, extra->compression, extra->compression_level, extra->bundle_flags) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
   /* First step - +CONTENTS.db ALWAYS GOES FIRST!!! */        
@@ -397,11 +397,15 @@ static int archive_files(mportAssetList *assetlist, mportPackageMeta *pack, mpor
   if (archive_metafiles(bundle, pack, extra) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
-  /* last step - the real files from the assetlist */
+  /* last step - the real files from the assetlist, in their own segment if segmented */
+  if (mport_bundle_write_start_segment(bundle, pack->name) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+    
   if (archive_assetlistfiles(bundle, pack, extra, assetlist) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
-  mport_bundle_write_finish(bundle);
+  if (mport_bundle_write_finish(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
   
   return MPORT_OK;    
 }
@@ -30,6 +30,7 @@
 
 #include <sqlite3.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "mport.h"
 #include "mport_private.h"
@@ -68,6 +69,27 @@ int mport_db_do(sqlite3 *db, const char *fmt, ...)
 
 
 
+/* Prepared statements, kept for the life of the instance and keyed by their
+ * sql.  The sql is never formatted, so the same query for a thousand 
+ * packages is parsed once and bound a thousand times. */
+#define STMT_CACHE_BUCKETS	64
+
+struct stmt_entry {
+  char *sql;
+  sqlite3_stmt *stmt;
+  int busy;   /* handed out, and not yet released */
+  struct stmt_entry *next;
+};
+
+struct _StmtCache {
+  struct stmt_entry *buckets[STMT_CACHE_BUCKETS];
+  unsigned long hits;
+  unsigned long misses;
+};
+
+static struct stmt_entry ** stmt_bucket(struct _StmtCache *, const char *);
+
+
 /* mport_db_prepare(sqlite3 *, sqlite3_stmt **, const char *, ...)
  * 
  * A wrapper for preparing sqlite statements into statement structs.
@@ -99,24 +121,176 @@ int mport_db_prepare(sqlite3 *db, sqlite3_stmt **stmt, const char * fmt, ...)
 
   
 
-/* mport_attach_stub_db(sqlite *db, const char *tmpdir) 
+/* mport_db_prepare_cached(mport, &stmt, sql, ...)
  *
- * Attaches tmpdir/MPORT_STUB_DB_FILE to the given database handle as 
- * 'stub'.  (stub.table to access a table in the stub db)
+ * Get a statement for sql from the instance's cache, preparing it the first 
+ * time, with each ? bound to the next (const char *) argument; a NULL 
+ * argument binds NULL.  The arguments are not copied, so they have to last
+ * until the statement is handed back with mport_db_release() - never 
+ * sqlite3_finalize() it.  sql has to be constant text; values go in the
+ * arguments.  If the cached statement is already out (a query that ends up
+ * running itself), a private one is prepared instead.
+ */
+int mport_db_prepare_cached(mportInstance *mport, sqlite3_stmt **stmt, const char *sql, ...)
+{
+  struct _StmtCache *cache;
+  struct stmt_entry **bucket, *e;
+  va_list args;
+  int i, n;
+  
+  if ((cache = mport->stmt_cache) == NULL) {
+    if ((cache = (struct _StmtCache *)calloc(1, sizeof(struct _StmtCache))) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    mport->stmt_cache = cache;
+  }
+  
+  bucket = stmt_bucket(cache, sql);
+  
+  for (e = *bucket; e != NULL; e = e->next) {
+    if (strcmp(e->sql, sql) == 0)
+      break;
+  }
+  
+  if (e != NULL && !e->busy) {
+    cache->hits++;
+    *stmt = e->stmt;
+  } else {
+    cache->misses++;
+    
+    if (sqlite3_prepare_v2(mport->db, sql, -1, stmt, NULL) != SQLITE_OK) 
+      RETURN_ERRORX(MPORT_ERR_FATAL, "sql error preparing '%s': %s", sql, sqlite3_errmsg(mport->db));
+    
+    if (e == NULL) {
+      if ((e = (struct stmt_entry *)calloc(1, sizeof(struct stmt_entry))) == NULL || (e->sql = strdup(sql)) == NULL) {
+        free(e);
+        sqlite3_finalize(*stmt);
+        RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+      }
+      
+      e->stmt = *stmt;
+      e->next = *bucket;
+      *bucket = e;
+    }
+  }
+  
+  if (e->stmt == *stmt)
+    e->busy = 1;
+  
+  n = sqlite3_bind_parameter_count(*stmt);
+  
+  va_start(args, sql);
+  
+  for (i = 1; i <= n; i++) {
+    if (sqlite3_bind_text(*stmt, i, va_arg(args, const char *), -1, SQLITE_STATIC) != SQLITE_OK) {
+      va_end(args);
+      SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+      mport_db_release(mport, *stmt);
+      RETURN_CURRENT_ERROR;
+    }
+  }
+  
+  va_end(args);
+  
+  return MPORT_OK;
+}
+
+
+/* mport_db_release(mport, stmt)
  *
- * Returns MPORT_OK on success.
+ * Hand a statement from mport_db_prepare_cached() back.  It's reset, so it
+ * holds no locks (and can't get in the way of a DETACH), and its bindings
+ * are cleared.
+ */
+void mport_db_release(mportInstance *mport, sqlite3_stmt *stmt)
+{
+  struct stmt_entry *e;
+  
+  if (stmt == NULL)
+    return;
+  
+  for (e = mport->stmt_cache == NULL ? NULL : *stmt_bucket(mport->stmt_cache, sqlite3_sql(stmt)); e != NULL; e = e->next) {
+    if (e->stmt == stmt) {
+      (void)sqlite3_reset(stmt);
+      (void)sqlite3_clear_bindings(stmt);
+      e->busy = 0;
+      return;
+    }
+  }
+  
+  /* one prepared because the cached one was busy */
+  sqlite3_finalize(stmt);
+}
+
+
+/* mport_stmt_cache_stats(mport, &hits, &misses)
+ *
+ * How often mport_db_prepare_cached() found a statement ready, and how often
+ * it had to prepare one.
+ */
+MPORT_PUBLIC_API void mport_stmt_cache_stats(mportInstance *mport, unsigned long *hits, unsigned long *misses)
+{
+  *hits   = mport->stmt_cache == NULL ? 0 : mport->stmt_cache->hits;
+  *misses = mport->stmt_cache == NULL ? 0 : mport->stmt_cache->misses;
+}
+
+
+/* mport_stmt_cache_free(cache)
+ *
+ * Finalize every cached statement; this has to happen before the db is
+ * closed.
  */
-int mport_attach_stub_db(sqlite3 *db, const char *dir)
+void mport_stmt_cache_free(struct _StmtCache *cache)
 {
-  char *file;
-  asprintf(&file, "%s/%s", dir, MPORT_STUB_DB_FILE);
+  struct stmt_entry *e;
+  int i;
+  
+  if (cache == NULL)
+    return;
+  
+  for (i = 0; i < STMT_CACHE_BUCKETS; i++) {
+    while ((e = cache->buckets[i]) != NULL) {
+      cache->buckets[i] = e->next;
+      sqlite3_finalize(e->stmt);
+      free(e->sql);
+      free(e);
+    }
+  }
   
-  if (mport_db_do(db, "ATTACH %Q AS stub", file) != MPORT_OK) { 
-    free(file);
+  free(cache);
+}
+
+
+static struct stmt_entry ** stmt_bucket(struct _StmtCache *cache, const char *sql)
+{
+  unsigned int h = 5381;
+  
+  while (*sql != '\0')
+    h = h * 33 + (unsigned char)*sql++;
+  
+  return &cache->buckets[h % STMT_CACHE_BUCKETS];
+}
+
+
+/* mport_attach_stub_db(sqlite *db, void *image, size_t len) 
+ *
+ * Attaches the in memory stub database `image` to the given database handle as 
+ * 'stub'.  (stub.table to access a table in the stub db)  image must come 
+ * from sqlite3_malloc(); sqlite owns it after this call, even on failure.
+ *
+ * Returns MPORT_OK on success.
+ */
+int mport_attach_stub_db(sqlite3 *db, void *image, size_t len)
+{
+  if (mport_db_do(db, "ATTACH ':memory:' AS stub") != MPORT_OK) { 
+    sqlite3_free(image);
     RETURN_CURRENT_ERROR;
   }
   
-  free(file);
+  if (sqlite3_deserialize(db, "stub", image, len, len, SQLITE_DESERIALIZE_FREEONCLOSE|SQLITE_DESERIALIZE_RESIZEABLE) != SQLITE_OK) {
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+    (void)sqlite3_exec(db, "DETACH stub", NULL, NULL, NULL);
+    RETURN_CURRENT_ERROR;
+  }
   
   return MPORT_OK;
 }
@@ -145,10 +319,36 @@ int mport_detach_stub_db(sqlite3 *db)
     RETURN_CURRENT_ERROR
 
 
-int mport_generate_stub_schema(sqlite3 *db) 
+/* mport_generate_stub_schema(db, compression, flags)
+ *
+ * Create the stub tables.  Bundles are marked with the oldest format version
+ * that can read them, so that older mports can still install plain bzip2 bundles.
+ */
+int mport_generate_stub_schema(sqlite3 *db, mportCompression compression, int flags) 
 {
+  int version = 1;
+  
+  if (compression != MPORT_COMPRESS_BZIP2)
+    version = 2;
+  if (flags & (MPORT_BUNDLE_SEGMENTED|MPORT_BUNDLE_RAW_META))
+    version = 3;
+  
   RUN_SQL(db, "CREATE TABLE meta      (field text NOT NULL, value text NOT NULL)");
-  RUN_SQL(db, "INSERT INTO meta VALUES (\"bundle_format_version\", " MPORT_BUNDLE_VERSION_STR ")");
+
+  if (mport_db_do(db, "INSERT INTO meta VALUES ('bundle_format_version', %i)", version) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (version >= 2) {
+    if (mport_db_do(db, "INSERT INTO meta VALUES ('bundle_compression', %Q)", mport_compression_name(compression)) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  if (flags & MPORT_BUNDLE_RAW_META) {
+    RUN_SQL(db, "INSERT INTO meta VALUES ('bundle_layout', 'raw_meta')");
+  } else if (flags & MPORT_BUNDLE_SEGMENTED) {
+    RUN_SQL(db, "INSERT INTO meta VALUES ('bundle_layout', 'segmented')");
+  }
+
   RUN_SQL(db, "CREATE TABLE assets    (pkg text not NULL, type int NOT NULL, data text, checksum text)");
   RUN_SQL(db, "CREATE TABLE packages  (pkg text NOT NULL, version text NOT NULL, origin text NOT NULL, lang text, options text, prefix text NOT NULL, comment text)");
   RUN_SQL(db, "CREATE TABLE conflicts (pkg text NOT NULL, conflict_pkg text NOT NULL, conflict_version text NOT NULL)");
@@ -175,5 +375,9 @@ int mport_generate_master_schema(sqlite3 *db)
   
   RUN_SQL(db, "CREATE TABLE IF NOT EXISTS categories (pkg text NOT NULL, category text NOT NULL)");
   RUN_SQL(db, "CREATE INDEX IF NOT EXISTS categories_pkg ON categories (pkg, category)");
+
+  /* see mirror.c */
+  RUN_SQL(db, "CREATE TABLE IF NOT EXISTS mirror_health (mirror text NOT NULL, connect_time real, throughput real, failures int NOT NULL default 0, last_failure int, updated int)");
+  RUN_SQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS mirror_health_mirror ON mirror_health (mirror)");
   return MPORT_OK;
 }
@@ -40,12 +40,23 @@
 
 
 
+static int delete_pkg(mportInstance *, mportPackageMeta *, int);
 static int run_pkg_deinstall(mportInstance *, mportPackageMeta *, const char *);
 static int delete_pkg_infra(mportInstance *, mportPackageMeta *);
 static int check_for_upwards_depends(mportInstance *, mportPackageMeta *);
 
 
 MPORT_PUBLIC_API int mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force) 
+{
+  /* @unexec triggers run after all the files are gone */
+  if (mport_batch_begin(mport) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return mport_batch_finish(mport, delete_pkg(mport, pack, force));
+}
+
+
+static int delete_pkg(mportInstance *mport, mportPackageMeta *pack, int force) 
 {
   sqlite3_stmt *stmt;
   int ret, current, total;
@@ -195,16 +206,25 @@ MPORT_PUBLIC_API int mport_delete_primative(mportInstance *mport, mportPackageMe
 static int run_pkg_deinstall(mportInstance *mport, mportPackageMeta *pack, const char *mode)
 {
   char file[FILENAME_MAX];
-  int ret;
+  char path[FILENAME_MAX];
+  char prefix[FILENAME_MAX];
   
+  /* file is where the script runs from, inside the root; path is where we
+   * find it from out here */
   (void)snprintf(file, FILENAME_MAX, "%s/%s-%s/%s", MPORT_INST_INFRA_DIR, pack->name, pack->version, MPORT_DEINSTALL_FILE);    
+  (void)snprintf(path, FILENAME_MAX, "%s%s", mport->root, file);
 
-  if (mport_file_exists(file)) {
-    if (chmod(file, 755) != 0)
-      RETURN_ERRORX(MPORT_ERR_FATAL, "chmod(%s, 755): %s", file, strerror(errno));
+  if (mport_file_exists(path)) {
+    const char *argv[] = {file, pack->name, mode, NULL};
+    const char *env[]  = {prefix, NULL};
       
-    if ((ret = mport_xsystem(mport, "PKG_PREFIX=%s %s %s %s", pack->prefix, file, pack->name, mode)) != 0)
-      RETURN_ERRORX(MPORT_ERR_FATAL, "%s %s returned non-zero: %i", MPORT_INSTALL_FILE, mode, ret);
+    if (chmod(path, 0755) != 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "chmod(%s, 0755): %s", path, strerror(errno));
+      
+    (void)snprintf(prefix, FILENAME_MAX, "PKG_PREFIX=%s", pack->prefix);
+    
+    if (mport_spawn(mport, argv, env) != MPORT_OK)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "%s %s failed: %s", MPORT_DEINSTALL_FILE, mode, mport_err_string());
   }
   
   return MPORT_OK;
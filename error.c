@@ -34,8 +34,9 @@
 #include <stdarg.h>
 
 
-static int mport_err;
-static char err_msg[256];
+/* per thread, so the extract pool's writers can report errors of their own */
+static __thread int mport_err;
+static __thread char err_msg[256];
 
 /* This goes with the error codes in mport.h */
 static char *default_error_msg = "An error occured.";
@@ -52,7 +53,8 @@ MPORT_PUBLIC_API int mport_err_code()
 
 /* mport_err_string()
  *
- * Return the current error string (if any).  Do not free this memory, it is static. 
+ * Return the current error string (if any).  Do not free this memory, it is static,
+ * and belongs to the calling thread.
  */
 MPORT_PUBLIC_API const char * mport_err_string()
 {
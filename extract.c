@@ -0,0 +1,378 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Extraction of bundle entries relative to a directory fd.
+ *
+ * Nothing here looks at the process's working directory, so installs into
+ * different roots can run side by side in one process, and the extract pool's
+ * writers can share it.  Regular files, hardlinks, symlinks and directories
+ * are handled here; anything else (devices, fifos, files with ACLs) has to go
+ * through libarchive, see mport_extract_supported().
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include "mport.h"
+#include "mport_private.h"
+
+static int extract_file(int, const char *, struct archive_entry *, struct archive *, const char *, size_t);
+static int extract_dir(int, const char *, struct archive_entry *);
+static int extract_symlink(int, const char *, struct archive_entry *);
+static int extract_hardlink(int, const char *, struct archive_entry *);
+static int make_parents(int, const char *);
+static int clear_path(int, const char *);
+static int write_data(int, const char *, struct archive_entry *, struct archive *, const char *, size_t);
+static void set_times(struct timespec *, struct archive_entry *);
+
+
+/*
+ * mport_extract_supported(entry)
+ *
+ * returns non-zero if mport_extract_at() can handle this entry.
+ */
+int mport_extract_supported(struct archive_entry *entry)
+{
+  if (archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS) > 0)
+    return 0;
+  
+  if (archive_entry_hardlink(entry) != NULL)
+    return 1;
+  
+  switch (archive_entry_filetype(entry)) {
+    case AE_IFREG:
+    case AE_IFDIR:
+    case AE_IFLNK:
+      return 1;
+  }
+  
+  return 0;
+}
+
+
+/*
+ * mport_extract_set_owner(mport, entry)
+ *
+ * resolve entry's owner and group names against the instance root's passwd
+ * and group files (not the host's), and store the ids in entry.  A name the
+ * root doesn't know leaves the numeric id from the bundle, as 
+ * archive_write_disk_set_standard_lookup() would.  This uses the instance,
+ * so it has to be called on the installing thread, before the entry goes to
+ * the extract pool.
+ */
+void mport_extract_set_owner(mportInstance *mport, struct archive_entry *entry)
+{
+  const char *name;
+  uid_t uid;
+  gid_t gid;
+  
+  if ((name = archive_entry_uname(entry)) != NULL && *name != '\0' && mport_root_uid(mport, name, &uid) == MPORT_OK) {
+    archive_entry_set_uid(entry, uid);
+    /* so libarchive, for the entries it writes, doesn't look it up on the host */
+    archive_entry_set_uname(entry, NULL);
+  }
+  
+  if ((name = archive_entry_gname(entry)) != NULL && *name != '\0' && mport_root_gid(mport, name, &gid) == MPORT_OK) {
+    archive_entry_set_gid(entry, gid);
+    archive_entry_set_gname(entry, NULL);
+  }
+  
+  /* a root we can't read the files of is no reason to fail the install */
+  (void)mport_set_err(MPORT_OK, NULL);
+}
+
+
+/*
+ * mport_extract_at(dirfd, path, entry, src, data, len)
+ *
+ * Create path (relative to dirfd) as described by entry, with the same owner,
+ * mode, times and flags handling as libarchive's MPORT_EXTRACT_FLAGS.  A
+ * regular file's contents come from src's current entry if src isn't NULL,
+ * otherwise from the len bytes at data.  The owner is entry's uid and gid;
+ * see mport_extract_set_owner().  Hardlink targets are relative to dirfd
+ * too.  Missing parent directories are created.
+ */
+int mport_extract_at(int dirfd, const char *path, struct archive_entry *entry, struct archive *src, const char *data, size_t len)
+{
+  if (archive_entry_hardlink(entry) != NULL)
+    return extract_hardlink(dirfd, path, entry);
+    
+  switch (archive_entry_filetype(entry)) {
+    case AE_IFREG:
+      return extract_file(dirfd, path, entry, src, data, len);
+    case AE_IFDIR:
+      return extract_dir(dirfd, path, entry);
+    case AE_IFLNK:
+      return extract_symlink(dirfd, path, entry);
+  }
+  
+  RETURN_ERRORX(MPORT_ERR_FATAL, "%s: unsupported file type", path);
+}
+
+
+static int extract_file(int dirfd, const char *path, struct archive_entry *entry, struct archive *src, const char *data, size_t len)
+{
+  mode_t mode = archive_entry_mode(entry) & 07777;
+  struct timespec times[2];
+  int fd;
+  
+  if (clear_path(dirfd, path) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  /* mode 0600 until the data and owner are in place; the real mode comes last */
+  if ((fd = openat(dirfd, path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600)) == -1 && errno == ENOENT) {
+    if (make_parents(dirfd, path) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    fd = openat(dirfd, path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+  }
+  
+  if (fd == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't create %s: %s", path, strerror(errno));
+  
+  if (write_data(fd, path, entry, src, data, len) != MPORT_OK) {
+    (void)close(fd);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  /* chown clears the setuid bits, so it has to go before chmod */
+  if (geteuid() == 0 && fchown(fd, archive_entry_uid(entry), archive_entry_gid(entry)) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't chown %s: %s", path, strerror(errno));
+    (void)close(fd);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  set_times(times, entry);
+  
+  if (fchmod(fd, mode) != 0 || futimens(fd, times) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't set attributes of %s: %s", path, strerror(errno));
+    (void)close(fd);
+    RETURN_CURRENT_ERROR;
+  }
+  
+#ifdef UF_IMMUTABLE
+  {
+    unsigned long set, clear;
+    
+    archive_entry_fflags(entry, &set, &clear);
+    if (set != 0 && fchflags(fd, set) != 0) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Couldn't set flags on %s: %s", path, strerror(errno));
+      (void)close(fd);
+      RETURN_CURRENT_ERROR;
+    }
+  }
+#endif
+  
+  if (close(fd) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", path, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static int extract_dir(int dirfd, const char *path, struct archive_entry *entry)
+{
+  mode_t mode = archive_entry_mode(entry) & 07777;
+  struct timespec times[2];
+  struct stat st;
+  int ret;
+  
+  if ((ret = mkdirat(dirfd, path, 0700)) != 0 && errno == ENOENT) {
+    if (make_parents(dirfd, path) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    ret = mkdirat(dirfd, path, 0700);
+  }
+  
+  if (ret != 0) {
+    if (errno != EEXIST || fstatat(dirfd, path, &st, 0) != 0 || !S_ISDIR(st.st_mode))
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't mkdir %s: %s", path, strerror(errno));
+  }
+  
+  set_times(times, entry);
+  
+  if (geteuid() == 0 && fchownat(dirfd, path, archive_entry_uid(entry), archive_entry_gid(entry), 0) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't chown %s: %s", path, strerror(errno));
+  
+  if (fchmodat(dirfd, path, mode, 0) != 0 || utimensat(dirfd, path, times, 0) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't set attributes of %s: %s", path, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static int extract_symlink(int dirfd, const char *path, struct archive_entry *entry)
+{
+  const char *target = archive_entry_symlink(entry);
+  struct timespec times[2];
+  int ret;
+  
+  if (target == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: symlink without a target", path);
+  
+  if (clear_path(dirfd, path) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((ret = symlinkat(target, dirfd, path)) != 0 && errno == ENOENT) {
+    if (make_parents(dirfd, path) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    ret = symlinkat(target, dirfd, path);
+  }
+  
+  if (ret != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't symlink %s: %s", path, strerror(errno));
+  
+  set_times(times, entry);
+  
+  if (geteuid() == 0 && fchownat(dirfd, path, archive_entry_uid(entry), archive_entry_gid(entry), AT_SYMLINK_NOFOLLOW) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't chown %s: %s", path, strerror(errno));
+  
+  /* not every filesystem can set a link's times; that's not worth failing over */
+  (void)utimensat(dirfd, path, times, AT_SYMLINK_NOFOLLOW);
+  
+  return MPORT_OK;
+}
+
+
+static int extract_hardlink(int dirfd, const char *path, struct archive_entry *entry)
+{
+  const char *target = archive_entry_hardlink(entry);
+  int ret;
+  
+  if (clear_path(dirfd, path) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((ret = linkat(dirfd, target, dirfd, path, 0)) != 0 && errno == ENOENT) {
+    if (make_parents(dirfd, path) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    ret = linkat(dirfd, target, dirfd, path, 0);
+  }
+  
+  if (ret != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't link %s to %s: %s", path, target, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+/* like mkdir -p on the directory part of path; racing another thread is fine */
+static int make_parents(int dirfd, const char *path)
+{
+  char dir[FILENAME_MAX];
+  char *p;
+  
+  if (strlcpy(dir, path, sizeof(dir)) >= sizeof(dir))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: path too long", path);
+  
+  for (p = dir + 1; (p = strchr(p, '/')) != NULL; p++) {
+    *p = '\0';
+    
+    if (mkdirat(dirfd, dir, 0755) != 0 && errno != EEXIST)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't mkdir %s: %s", dir, strerror(errno));
+    
+    *p = '/';
+  }
+  
+  return MPORT_OK;
+}
+
+
+/* get rid of whatever non-directory is at path, the way libarchive does */
+static int clear_path(int dirfd, const char *path)
+{
+  if (unlinkat(dirfd, path, 0) != 0 && errno != ENOENT && errno != ENOTDIR)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", path, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static int write_data(int fd, const char *path, struct archive_entry *entry, struct archive *src, const char *data, size_t len)
+{
+  const void *buff;
+  size_t size;
+  off_t offset;
+  ssize_t ret;
+  int r;
+  
+  if (src == NULL) {
+    while (len > 0) {
+      if ((ret = write(fd, data, len)) == -1) {
+        if (errno == EINTR)
+          continue;
+        RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", path, strerror(errno));
+      }
+      data += ret;
+      len  -= (size_t)ret;
+    }
+    
+    return MPORT_OK;
+  }
+  
+  /* straight from the archive, a block at a time; blocks of a sparse file have holes between them */
+  while ((r = archive_read_data_block(src, &buff, &size, &offset)) == ARCHIVE_OK) {
+    const char *p = (const char *)buff;
+    
+    while (size > 0) {
+      if ((ret = pwrite(fd, p, size, offset)) == -1) {
+        if (errno == EINTR)
+          continue;
+        RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", path, strerror(errno));
+      }
+      p      += ret;
+      size   -= (size_t)ret;
+      offset += ret;
+    }
+  }
+  
+  if (r != ARCHIVE_EOF)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: %s", path, archive_error_string(src));
+  
+  /* a sparse file may end in a hole */
+  if (ftruncate(fd, archive_entry_size(entry)) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't truncate %s: %s", path, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static void set_times(struct timespec *times, struct archive_entry *entry)
+{
+  times[0].tv_sec  = archive_entry_atime(entry);
+  times[0].tv_nsec = archive_entry_atime_nsec(entry);
+  times[1].tv_sec  = archive_entry_mtime(entry);
+  times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+  
+  if (!archive_entry_atime_is_set(entry))
+    times[0] = times[1];
+}
@@ -0,0 +1,350 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* A pool of threads that write extracted files to disk.
+ *
+ * Installing a package full of small files is bound by the latency of
+ * open/write/close/chmod/utimes, not by the decoder.  The installing thread
+ * keeps decoding the bundle, reads each small regular file into memory, and
+ * queues it; the writers put the files on disk in parallel with
+ * mport_extract_at(), relative to the directory fd the file was queued with.
+ * Queued data is capped, so a big package can't eat all our memory.
+ *
+ * Anything that depends on what came before it - hardlinks, symlinks, 
+ * directories - or is too big to buffer is extracted by the installing thread
+ * after the queue drains, as are all the files of small packages.  The
+ * installing thread owns the directory fds; it must drain the queue before
+ * closing one.  The caller also drains the queue with
+ * mport_extract_pool_barrier() before anything (like @exec) that expects the
+ * files to be there.
+ *
+ * The error state is per thread, so a writer's failure is copied into the
+ * pool and reported from the next add or barrier on the installing thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include "mport.h"
+#include "mport_private.h"
+
+struct extract_job {
+  int dirfd;
+  char *path;
+  struct archive_entry *entry;
+  char *data;
+  size_t len;
+  struct extract_job *next;
+};
+
+struct _ExtractPool {
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;  /* there's a job queued, or it's time to go */
+  pthread_cond_t idle;  /* a job finished */
+  struct extract_job *head;
+  struct extract_job *tail;
+  size_t queued_bytes;
+  int pending;          /* queued or being written */
+  int shutdown;
+  char *error;          /* the first thing that went wrong in a writer */
+};
+
+static void * writer_main(void *);
+static int read_data(mportBundleRead *, struct archive_entry *, char **, size_t *);
+static void free_job(struct extract_job *);
+
+
+/*
+ * mport_extract_pool_new(&pool, nthreads)
+ *
+ * start a pool of nthreads writers.  A pool of 0 threads is fine; every file
+ * is then extracted by the calling thread.
+ */
+int mport_extract_pool_new(mportExtractPool **poolp, int nthreads)
+{
+  mportExtractPool *pool;
+  int i;
+  
+  if ((pool = (mportExtractPool *)calloc(1, sizeof(mportExtractPool))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    free(pool);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize extract pool lock.");
+  }
+  
+  (void)pthread_cond_init(&pool->work, NULL);
+  (void)pthread_cond_init(&pool->idle, NULL);
+  
+  *poolp = pool;
+  
+  if (nthreads <= 0)
+    return MPORT_OK;
+  
+  if ((pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, writer_main, pool) != 0)
+      break;
+    pool->nthreads++;
+  }
+  
+  /* we can get by with fewer writers than we asked for, even none */
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_extract_pool_add(pool, bundle, dirfd, path, entry)
+ *
+ * extract the current entry of bundle to path (relative to dirfd), either by 
+ * queuing it for the writers or, if it has to be done in order, by draining 
+ * the queue and extracting it here.  entry's pathname should be the absolute
+ * version of path; libarchive uses it for the few entries we can't write 
+ * ourselves.
+ */
+int mport_extract_pool_add(mportExtractPool *pool, mportBundleRead *bundle, int dirfd, const char *path, struct archive_entry *entry)
+{
+  struct extract_job *job;
+  
+  if (pool->nthreads == 0 || archive_entry_filetype(entry) != AE_IFREG || 
+      archive_entry_hardlink(entry) != NULL || archive_entry_size(entry) > MPORT_EXTRACT_MAX_BUFFER ||
+      !mport_extract_supported(entry)) {
+    if (mport_extract_pool_barrier(pool) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    if (!mport_extract_supported(entry))
+      return mport_bundle_read_extract_next_file(bundle, entry);
+    
+    return mport_extract_at(dirfd, path, entry, bundle->archive, NULL, 0);
+  }
+  
+  if ((job = (struct extract_job *)calloc(1, sizeof(struct extract_job))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  job->dirfd = dirfd;
+  
+  if ((job->entry = archive_entry_clone(entry)) == NULL || (job->path = strdup(path)) == NULL) {
+    free_job(job);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  if (read_data(bundle, entry, &job->data, &job->len) != MPORT_OK) {
+    free_job(job);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  while (pool->error == NULL && pool->pending > 0 && pool->queued_bytes + job->len > MPORT_EXTRACT_MAX_QUEUED)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  
+  if (pool->error != NULL) {
+    pthread_mutex_unlock(&pool->lock);
+    free_job(job);
+    return mport_extract_pool_barrier(pool);
+  }
+  
+  if (pool->tail == NULL)
+    pool->head = job;
+  else
+    pool->tail->next = job;
+  pool->tail = job;
+  
+  pool->queued_bytes += job->len;
+  pool->pending++;
+  
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_extract_pool_barrier(pool)
+ *
+ * wait for every queued file to be written.  Returns the error from the first
+ * write that failed, if any did.
+ */
+int mport_extract_pool_barrier(mportExtractPool *pool)
+{
+  char *error;
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  
+  error = pool->error;
+  pool->error = NULL;
+  
+  pthread_mutex_unlock(&pool->lock);
+  
+  if (error != NULL) {
+    SET_ERROR(MPORT_ERR_FATAL, error);
+    free(error);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_extract_pool_free(pool)
+ *
+ * stop the writers and free the pool.  Anything still queued is thrown
+ * away, so call mport_extract_pool_barrier() first unless you're bailing out.
+ */
+void mport_extract_pool_free(mportExtractPool *pool)
+{
+  struct extract_job *job;
+  int i;
+  
+  if (pool == NULL)
+    return;
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  while ((job = pool->head) != NULL) {
+    pool->head = job->next;
+    pool->pending--;
+    free_job(job);
+  }
+  
+  pool->tail = NULL;
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  
+  for (i = 0; i < pool->nthreads; i++)
+    (void)pthread_join(pool->threads[i], NULL);
+  
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->error);
+  free(pool->threads);
+  free(pool);
+}
+
+
+static void * writer_main(void *arg)
+{
+  mportExtractPool *pool = (mportExtractPool *)arg;
+  struct extract_job *job;
+  char *error;
+  int failed;
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  while (1) {
+    while (pool->head == NULL && !pool->shutdown)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    
+    if (pool->head == NULL)
+      break;
+    
+    job = pool->head;
+    if ((pool->head = job->next) == NULL)
+      pool->tail = NULL;
+    
+    /* once something has failed, the rest is just drained */
+    failed = (pool->error != NULL);
+    error  = NULL;
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (!failed && mport_extract_at(job->dirfd, job->path, job->entry, NULL, job->data, job->len) != MPORT_OK) {
+      if ((error = strdup(mport_err_string())) == NULL)
+        error = strdup("Out of memory.");
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    if (error != NULL && pool->error == NULL)
+      pool->error = error;
+    else
+      free(error);
+    
+    pool->queued_bytes -= job->len;
+    pool->pending--;
+    free_job(job);
+    
+    pthread_cond_broadcast(&pool->idle);
+  }
+  
+  pthread_mutex_unlock(&pool->lock);
+  
+  return NULL;
+}
+
+
+/* read the data for the bundle's current entry into memory */
+static int read_data(mportBundleRead *bundle, struct archive_entry *entry, char **datap, size_t *lenp)
+{
+  size_t size = (size_t)archive_entry_size(entry);
+  size_t got = 0;
+  ssize_t ret;
+  
+  /* malloc(0) may hand back NULL */
+  if ((*datap = (char *)malloc(size + 1)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  while (got < size) {
+    ret = archive_read_data(bundle->archive, *datap + got, size - got);
+    
+    if (ret < 0)
+      RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+    if (ret == 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "%s: %s is truncated", bundle->filename, archive_entry_pathname(entry));
+    
+    got += (size_t)ret;
+  }
+  
+  *lenp = got;
+  
+  return MPORT_OK;
+}
+
+
+static void free_job(struct extract_job *job)
+{
+  if (job->entry != NULL)
+    archive_entry_free(job->entry);
+  free(job->path);
+  free(job->data);
+  free(job);
+}
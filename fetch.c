@@ -32,50 +32,122 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
 #include <fetch.h>
 #include <string.h>
 #include <errno.h>
+#include <bzlib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 #define BUFFSIZE	1024 * 8
 
-static int fetch(mportInstance *, const char *, const char *);
+/* what a .part download is the start of */
+struct part_meta {
+  char url[MPORT_URL_MAX];
+  off_t size;
+  time_t mtime;
+};
 
+/* one of two fetches of the same file from different mirrors; the first to
+ * finish wins.  See fetch_hedged(). */
+struct hedge;
 
-/* mport_fetch_index(mport)
+struct hedge_attempt {
+  struct hedge *hedge;
+  int index;                    /* 0 is the first mirror we asked */
+  char *mirror;
+  char *url;
+  char *dest;                   /* where fetch() puts it */
+  int done;
+  int ret;
+  char *error;
+  off_t got;
+  off_t size;
+  struct timespec started;
+  struct timespec progressed;   /* when the last bytes came in */
+  double first_byte;            /* seconds; -1 until there is one */
+};
+
+struct hedge {
+  mportInstance *mport;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *dest;
+  struct hedge_attempt attempts[2];
+  int started;
+  int winner;      /* -1 until an attempt claims the file */
+  int cancelled;   /* the caller is gone; stragglers just clean up */
+  int refs;
+};
+
+/* A decoder that sits between the socket and the disk: write() is handed
+ * the bytes as they come in and writes out what they decode to, and finish()
+ * says whether the stream was complete.  See fetch_filtered(). */
+struct fetch_filter {
+  const char *name;
+  int (*init)(void **);
+  int (*write)(void *, const char *, size_t, FILE *);
+  int (*finish)(void *);
+  void (*free)(void *);
+};
+
+static int bz_filter_init(void **);
+static int bz_filter_write(void *, const char *, size_t, FILE *);
+static int bz_filter_finish(void *);
+static void bz_filter_free(void *);
+
+static const struct fetch_filter bzip2_filter = {
+  "bzip2", bz_filter_init, bz_filter_write, bz_filter_finish, bz_filter_free
+};
+
+static int fetch(mportInstance *, const char *, const char *, const char *, int, struct hedge_attempt *);
+static int fetch_filtered(mportInstance *, const char *, const char *, const char *, const struct fetch_filter *, const mportIndexManifest *);
+static FILE * get_if_modified(struct url *, struct url_stat *, time_t, int *);
+static int sync_parent(const char *);
+static int fetch_hedged(mportInstance *, char **, const char *, const char *, int);
+static int start_attempt(struct hedge *, int, const char *, const char *, const char *);
+static void * attempt_main(void *);
+static int hedge_progress(struct hedge_attempt *, off_t, off_t);
+static int hedge_claim(struct hedge_attempt *);
+static void hedge_release(struct hedge *);
+static int read_part_meta(const char *, struct part_meta *);
+static int write_part_meta(const char *, const char *, const struct url_stat *);
+
+
+/* mport_fetch_index(mport, manifest)
  *
  * Fetch the index from a remote, or the bootstrap if we don't currently
- * have an index.  If the current index is recentish, then don't do
- * anything.
+ * have an index.  It's decompressed on the way in, and replaces the current
+ * index only once the whole thing is on disk and, if the mirrors published
+ * a manifest, matches its size and digest.  manifest is NULL for mirrors
+ * that don't.
  */
-int mport_fetch_index(mportInstance *mport)
+int mport_fetch_index(mportInstance *mport, const mportIndexManifest *m)
 {
   char **mirrors;
   char *url;
-  char *dest;
   int i;
   
   MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_index()");
   
-  asprintf(&dest, "%s/%s.bz2", MPORT_FETCH_STAGING_DIR, MPORT_INDEX_FILE);
-  
-  if (dest == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-
   if (mport_index_get_mirror_list(mport, &mirrors) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
-  while (mirrors[i] != NULL) {
+  for (i = 0; mirrors[i] != NULL; i++) {
     asprintf(&url, "%s/%s", mirrors[i], MPORT_INDEX_URL_PATH);
 
     if (url == NULL) {
-      free(dest);
       mport_free_vec(mirrors);
       RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
     }
 
-    if (fetch(mport, url, MPORT_INDEX_FILE) == MPORT_OK) {
+    if (fetch_filtered(mport, mirrors[i], url, MPORT_INDEX_FILE, &bzip2_filter, m) == MPORT_OK) {
       free(url);
-      free(dest);
       mport_free_vec(mirrors);
       return MPORT_OK;
     } 
@@ -83,13 +155,206 @@ int mport_fetch_index(mportInstance *mport)
     free(url);
   }
     
-  free(dest);
   mport_free_vec(mirrors);
   RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to fetch index file: %s", mport_err_string());
 }
 
 
 
+/* mport_fetch_file(mport, path, dest)
+ *
+ * Fetch path, relative to MPORT_URL_PATH on the mirrors, to dest from the
+ * first mirror that has it.  For the small files that go with the index.
+ */
+int mport_fetch_file(mportInstance *mport, const char *path, const char *dest)
+{
+  char **mirrors;
+  char url[MPORT_URL_MAX];
+  int i;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_file()");
+  
+  if (mport_index_get_mirror_list(mport, &mirrors) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  for (i = 0; mirrors[i] != NULL; i++) {
+    (void)snprintf(url, sizeof(url), "%s/%s/%s", mirrors[i], MPORT_URL_PATH, path);
+    
+    if (fetch(mport, mirrors[i], url, dest, MPORT_FETCH_QUIET, NULL) == MPORT_OK) {
+      mport_free_vec(mirrors);
+      return MPORT_OK;
+    }
+  }
+  
+  mport_free_vec(mirrors);
+  RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to fetch %s: %s", path, mport_err_string());
+}
+
+
+/* mport_fetch_if_modified(mport, path, dest, &changed)
+ *
+ * Like mport_fetch_file(), but only asks for path if it's newer than dest
+ * (If-Modified-Since).  dest is given the server's modification time, so the
+ * next request compares the server's clock with itself.  *changed is set to
+ * 0 if our copy was current, and dest is left alone.
+ */
+int mport_fetch_if_modified(mportInstance *mport, const char *path, const char *dest, int *changed)
+{
+  char **mirrors;
+  char url[MPORT_URL_MAX];
+  char tmp[FILENAME_MAX];
+  char buffer[BUFFSIZE];
+  struct url *u;
+  struct url_stat us;
+  struct stat st;
+  struct timeval times[2];
+  struct timespec start;
+  FILE *remote, *local;
+  size_t size;
+  int i, ok, unchanged;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_if_modified()");
+  
+  if (mport_index_get_mirror_list(mport, &mirrors) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  (void)snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+  
+  for (i = 0; mirrors[i] != NULL; i++) {
+    (void)snprintf(url, sizeof(url), "%s/%s/%s", mirrors[i], MPORT_URL_PATH, path);
+    
+    if ((u = fetchParseURL(url)) == NULL)
+      continue;
+    
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    remote = get_if_modified(u, &us, stat(dest, &st) == 0 ? st.st_mtime : 0, &unchanged);
+    fetchFreeURL(u);
+    
+    if (remote == NULL) {
+      if (unchanged) {
+        mport_mirror_sample(mport, mirrors[i], 1, mport_mirror_elapsed(&start), 0, 0);
+        mport_free_vec(mirrors);
+        *changed = 0;
+        return MPORT_OK;
+      }
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+      mport_mirror_sample(mport, mirrors[i], 0, 0, 0, 0);
+      continue;
+    }
+    
+    if ((local = fopen(tmp, "w")) == NULL) {
+      fclose(remote);
+      mport_free_vec(mirrors);
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", tmp, strerror(errno));
+    }
+    
+    while ((size = fread(buffer, 1, sizeof(buffer), remote)) > 0) {
+      if (fwrite(buffer, 1, size, local) != size)
+        break;
+    }
+    
+    ok = !ferror(remote) && !ferror(local);
+    fclose(remote);
+    ok = (fclose(local) == 0) && ok;
+    
+    mport_mirror_sample(mport, mirrors[i], ok, ok ? mport_mirror_elapsed(&start) : 0, 0, 0);
+    
+    if (!ok || rename(tmp, dest) != 0) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, strerror(errno));
+      (void)unlink(tmp);
+      continue;
+    }
+    
+    if (us.mtime > 0) {
+      times[0].tv_sec  = times[1].tv_sec  = us.mtime;
+      times[0].tv_usec = times[1].tv_usec = 0;
+      (void)utimes(dest, times);
+    }
+    
+    mport_free_vec(mirrors);
+    *changed = 1;
+    return MPORT_OK;
+  }
+  
+  mport_free_vec(mirrors);
+  RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to fetch %s: %s", path, mport_err_string());
+}
+
+
+/* fetchXGet() u, unless the server's copy is no newer than since (0 if we
+ * have none), in which case NULL is returned with *unchanged set. */
+static FILE * get_if_modified(struct url *u, struct url_stat *us, time_t since, int *unchanged)
+{
+  FILE *remote;
+  
+  *unchanged = 0;
+  
+#ifdef FETCH_UNCHANGED
+  u->ims_time = since;
+  
+  if ((remote = fetchXGet(u, us, "i")) == NULL && fetchLastErrCode == FETCH_UNCHANGED)
+    *unchanged = 1;
+#else
+  /* this libfetch reports a 304 like any other failure, so don't ask for
+   * one: check the date first, and only get the file if it's newer */
+  if (since != 0 && fetchStat(u, us, "") == 0 && us->mtime > 0 && us->mtime <= since) {
+    *unchanged = 1;
+    return NULL;
+  }
+  
+  remote = fetchXGet(u, us, "");
+#endif
+  
+  return remote;
+}
+
+
+/* mport_fetch_errstr()
+ *
+ * libfetch keeps its last error in one global buffer, and bundles are
+ * fetched on several threads at once, so another fetch can be rewriting it
+ * while we format a message.  This copies it, under a lock and bounded by the
+ * buffer's size, into one per thread, so the result is always a terminated 
+ * string.  When two fetches fail together it may be the other one's reason;
+ * libfetch gives us no way to do better.
+ */
+const char * mport_fetch_errstr(void)
+{
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static __thread char copy[MAXERRSTRING];
+  
+  pthread_mutex_lock(&lock);
+  (void)memcpy(copy, fetchLastErrString, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+  pthread_mutex_unlock(&lock);
+  
+  return copy;
+}
+
+
+/* mport_fetch_rate(buf, len, bytes, start)
+ *
+ * Formats the rate bytes have come in at since start ("312.5 KB/s") into
+ * buf for the progress callbacks, and returns buf.
+ */
+const char * mport_fetch_rate(char *buf, size_t len, off_t bytes, const struct timespec *start)
+{
+  static const char *units[] = { "B", "KB", "MB", "GB" };
+  double secs, rate;
+  int u;
+  
+  secs = mport_mirror_elapsed(start);
+  rate = secs > 0 ? (double)bytes / secs : 0;
+  
+  for (u = 0; rate >= 1024 && u < 3; u++)
+    rate /= 1024;
+  
+  (void)snprintf(buf, len, "%.1f %s/s", rate, units[u]);
+  
+  return buf;
+}
+
+
 /* mport_fetch_bootstrap_index(mportInstance *mport)
  *
  * Fetches the index for the bootstrap site.  The index need not be loaded for this 
@@ -97,36 +362,92 @@ int mport_fetch_index(mportInstance *mport)
  */
 int mport_fetch_bootstrap_index(mportInstance *mport)
 {
-  return fetch(mport, MPORT_BOOTSTRAP_INDEX_URL, MPORT_INDEX_FILE);
+  return fetch_filtered(mport, NULL, MPORT_BOOTSTRAP_INDEX_URL, MPORT_INDEX_FILE, &bzip2_filter, NULL);
 }
 
 /* mport_fetch_bundle(mport, filename)
  *
  * Fetch a given bundle from a remote.  If there is no loaded index, then
  * an error is thrown.  The file will be downloaded to the MPORT_FETCH_STAGING_DIR
- * directory.
+ * directory, by way of the download cache if the index has the bundle's hash.
  */
 int mport_fetch_bundle(mportInstance *mport, const char *filename)
 {
+  sqlite3_stmt *stmt;
   char **mirrors;
-  char *url;
-  char *dest;
-  int i;
+  char *hash = NULL;
+  int ret;
 
   MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_bundle()");
   
-  if (mport_index_get_mirror_list(mport, &mirrors) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+  if (mport_index_has_hashes(mport)) {
+    if (mport_db_prepare(mport->db, &stmt, "SELECT hash FROM index.packages WHERE bundlefile=%Q AND hash IS NOT NULL", filename) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
     
+    if (sqlite3_step(stmt) == SQLITE_ROW && (hash = strdup((const char *)sqlite3_column_text(stmt, 0))) == NULL) {
+      sqlite3_finalize(stmt);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    sqlite3_finalize(stmt);
+  }
+  
+  if (mport_index_get_mirror_list(mport, &mirrors) != MPORT_OK) {
+    free(hash);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  ret = mport_cache_fetch(mport, mirrors, filename, hash, 0);
+  
+  free(hash);
+  mport_free_vec(mirrors); 
+  
+  /* the mirror stats are a nicety; they can't fail a fetch */
+  if (ret == MPORT_OK)
+    (void)mport_mirror_flush(mport);
+  
+  return ret;
+}
+
+
+/* mport_fetch_bundle_mirrors(mport, mirrors, filename, flags)
+ *
+ * The guts of mport_fetch_bundle(), for callers that already have the
+ * mirror list.  This doesn't touch the database, so it is safe to call
+ * from another thread; pass MPORT_FETCH_QUIET there, as the progress
+ * callbacks belong to the main thread.
+ */
+int mport_fetch_bundle_mirrors(mportInstance *mport, char **mirrors, const char *filename, int flags)
+{
+  char *url;
+  char *dest;
+  int i;
+
   asprintf(&dest, "%s/%s", MPORT_FETCH_STAGING_DIR, filename);
   
-  while (mirrors[i] != NULL) {
+  if (dest == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  /* big bundles come from several mirrors at once, if we have them; failing
+   * that, from the first mirror, with the second standing by in case it
+   * stalls; failing that, from the first mirror that works */
+  if (mport_fetch_segmented(mport, mirrors, filename, dest, flags) == MPORT_OK ||
+      fetch_hedged(mport, mirrors, filename, dest, flags) == MPORT_OK) {
+    free(dest);
+    return MPORT_OK;
+  }
+  
+  for (i = 0; mirrors[i] != NULL; i++) {
     asprintf(&url, "%s/%s/%s", mirrors[i], MPORT_URL_PATH, filename);
 
-    if (fetch(mport, url, dest) == MPORT_OK) {
+    if (url == NULL) {
+      free(dest);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+
+    if (fetch(mport, mirrors[i], url, dest, flags, NULL) == MPORT_OK) {
       free(url);
       free(dest);
-      mport_free_vec(mirrors);
       return MPORT_OK;
     } 
     
@@ -134,59 +455,179 @@ int mport_fetch_bundle(mportInstance *mport, const char *filename)
   }
   
   free(dest);
-  mport_free_vec(mirrors); 
   RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to fetch %s: %s", filename, mport_err_string());
 }
 
 
 
-static int fetch(mportInstance *mport, const char *url, const char *dest) 
+/* mport_fetch_bundle_stream(mport, filename, &fp, &size)
+ *
+ * Open filename on the first mirror that has it, for reading straight off
+ * the network.  size is what the server says the file is, or 0 if it won't
+ * say.  The caller reads fp and closes it.
+ */
+int mport_fetch_bundle_stream(mportInstance *mport, const char *filename, FILE **fpp, off_t *sizep)
 {
+  char **mirrors;
+  char url[MPORT_URL_MAX];
+  struct url_stat us;
+  struct timespec start;
   FILE *remote;
-  FILE *local;
+  int i;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_bundle_stream()");
+  
+  if (mport_index_get_mirror_list(mport, &mirrors) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  for (i = 0; mirrors[i] != NULL; i++) {
+    (void)snprintf(url, sizeof(url), "%s/%s/%s", mirrors[i], MPORT_URL_PATH, filename);
+    
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if ((remote = fetchXGetURL(url, &us, "p")) == NULL) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+      mport_mirror_sample(mport, mirrors[i], 0, 0, 0, 0);
+      continue;
+    }
+    
+    /* no throughput; the installer sets the pace, not the mirror */
+    mport_mirror_sample(mport, mirrors[i], 1, mport_mirror_elapsed(&start), 0, 0);
+    mport_free_vec(mirrors);
+    
+    *fpp   = remote;
+    *sizep = us.size > 0 ? us.size : 0;
+    return MPORT_OK;
+  }
+  
+  mport_free_vec(mirrors); 
+  RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to fetch %s: %s", filename, mport_err_string());
+}
+
+
+
+/* fetch(mport, mirror, url, dest, flags, attempt)
+ *
+ * Download url, on mirror (if it's on one), to dest.  How the mirror did is
+ * recorded for mirror.c.  The data goes to dest.part, next to a small sidecar
+ * (dest.part.meta) recording the url and the size and mtime the server gave
+ * for it.  If the transfer fails the .part is kept, and the next fetch of the
+ * same url picks up where it stopped with a Range request - unless the
+ * remote file changed in between, in which case we start over.  dest only
+ * appears once every byte is there.
+ */
+static int fetch(mportInstance *mport, const char *mirror, const char *url, const char *dest, int flags, struct hedge_attempt *ha) 
+{
+  FILE *remote = NULL;
+  FILE *local  = NULL;
+  struct url *u;
   struct url_stat stat;
+  struct part_meta meta;
+  struct stat st;
+  char part[FILENAME_MAX];
+  char sidecar[FILENAME_MAX];
   char buffer[BUFFSIZE];
+  char rate[32];
   char *ptr;
   size_t size;                                  
-  size_t got;
   size_t wrote;
+  off_t offset = 0;
+  off_t got;
+  struct timespec start;
+  double connect;
+  int fd;
+  int quiet = (flags & MPORT_FETCH_QUIET);
+  int remote_failed = 0;
+  
+  (void)snprintf(part, sizeof(part), "%s.part", dest);
+  (void)snprintf(sidecar, sizeof(sidecar), "%s.part.meta", dest);
+  
+  if (read_part_meta(sidecar, &meta) && strcmp(meta.url, url) == 0 && lstat(part, &st) == 0)
+    offset = st.st_size;
   
-  if ((local = fopen(dest, "w")) == NULL) {
-    RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", dest, strerror(errno));
+  if ((u = fetchParseURL(url)) == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+
+  if (!quiet)
+    mport_call_progress_init_cb(mport, "Downloading %s", url);
+  
+  u->offset = offset;
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+  remote = fetchXGet(u, &stat, "p");
+
+  if (remote == NULL && offset > 0 && fetchLastErrCode == FETCH_PROTO) {
+    /* the range was refused (416): the file shrank below our .part since it
+     * was started, and asking again would only be refused again */
+    offset = 0;
+    u->offset = 0;
+    remote = fetchXGet(u, &stat, "p");
   }
 
-  mport_call_progress_init_cb(mport, "Downloading %s", url);
+  if (remote == NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+    remote_failed = 1;
+    goto ERROR;
+  }
+
+  if (offset > 0 && (stat.size != meta.size || stat.mtime != meta.mtime)) {
+    /* not the file we have the start of any more */
+    fclose(remote);
+    u->offset = 0;
   
-  if ((remote = fetchXGetURL(url, &stat, "p")) == NULL) {
-    fclose(local);
-    unlink(dest);
-    RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, fetchLastErrString);
+    if ((remote = fetchXGet(u, &stat, "p")) == NULL) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+      remote_failed = 1;
+      goto ERROR;
+    }
   }
   
+  connect = mport_mirror_elapsed(&start);
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  /* the server is free to ignore the range and send it all */
+  offset = u->offset;
+  
+  if (write_part_meta(sidecar, url, &stat) != MPORT_OK)
+    goto ERROR;
+  
+  if ((fd = open(part, O_WRONLY|O_CREAT, 0644)) == -1) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", part, strerror(errno));
+    goto ERROR;
+  }
+  
+  if (ftruncate(fd, offset) != 0 || lseek(fd, offset, SEEK_SET) == -1 || (local = fdopen(fd, "w")) == NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", part, strerror(errno));
+    (void)close(fd);
+    goto ERROR;
+  }
+  
+  got = offset;
+  
   while (1) {
     size = fread(buffer, 1, BUFFSIZE, remote);
     
-    if (size < BUFFSIZE) {
-      if (ferror(remote)) {
-        fclose(local);
-        fclose(remote);
-        unlink(dest);
-        RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, fetchLastErrString);  
-      } else if (feof(remote)) {
-        /* do nothing */
-      } 
+    if (size < BUFFSIZE && ferror(remote)) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+      remote_failed = 1;
+      goto ERROR;
     } 
   
     got += size;
   
-    (mport->progress_step_cb)(got, stat.size, "XXX Rate");
+    if (!quiet)
+      (mport->progress_step_cb)(got, stat.size, mport_fetch_rate(rate, sizeof(rate), got - offset, &start));
+    
+    if (ha != NULL && hedge_progress(ha, got, stat.size)) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch of %s cancelled: another mirror won.", url);
+      goto ERROR;
+    }
 
     for (ptr = buffer; size > 0; ptr += wrote, size -= wrote) {
       wrote = fwrite(ptr, 1, size, local);
       if (wrote < size) {
-        fclose(local); fclose(remote);
-        unlink(dest);
-        RETURN_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", dest, strerror(errno));
+        SET_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", part, strerror(errno));
+        goto ERROR;
       }
     }
 
@@ -194,10 +635,658 @@ static int fetch(mportInstance *mport, const char *url, const char *dest)
       break;
   }
   
-  fclose(local);
   fclose(remote);
+  remote = NULL;
+  
+  if (fclose(local) != 0) {
+    local = NULL;
+    SET_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", part, strerror(errno));
+    goto ERROR;
+  }
+  local = NULL;
+  
+  /* a connection that drops early looks like a clean EOF; the .part is kept
+   * for next time */
+  if (stat.size > 0 && got < stat.size) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: got %jd of %jd bytes", url, (intmax_t)got, (intmax_t)stat.size);
+    remote_failed = 1;
+    goto ERROR;
+  }
+  
+  if (stat.size > 0 && got > stat.size) {
+    (void)unlink(part);
+    (void)unlink(sidecar);
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: got %jd bytes, expected %jd", url, (intmax_t)got, (intmax_t)stat.size);
+    remote_failed = 1;
+    goto ERROR;
+  }
+  
+  if (ha != NULL && !hedge_claim(ha)) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch of %s cancelled: another mirror won.", url);
+    goto ERROR;
+  }
+  
+  if (mirror != NULL)
+    mport_mirror_sample(mport, mirror, 1, connect, got - offset, mport_mirror_elapsed(&start));
+  
+  if (rename(part, dest) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't rename %s to %s: %s", part, dest, strerror(errno));
+    goto ERROR;
+  }
+  
+  (void)unlink(sidecar);
+  fetchFreeURL(u);
+  
+  if (!quiet)
+    (mport->progress_free_cb)();
+
+  return MPORT_OK;
+  
+  ERROR:
+    if (mirror != NULL && remote_failed)
+      mport_mirror_sample(mport, mirror, 0, 0, 0, 0);
+    if (remote != NULL)
+      fclose(remote);
+    if (local != NULL)
+      fclose(local);
+    fetchFreeURL(u);
+    if (!quiet)
+      (mport->progress_free_cb)();
+    RETURN_CURRENT_ERROR;
+}
+
+
+/* fetch_filtered(mport, mirror, url, dest, filter, manifest)
+ *
+ * Fetch url through filter to dest.  The decoded bytes go to a temp file
+ * next to dest as they arrive, so decoding overlaps the download and there's
+ * never a second full copy; once the stream is complete the temp file is
+ * synced and renamed over dest, so nothing ever sees half of it.  A
+ * decoder's state can't be picked up again later, so unlike fetch() there's
+ * no resuming: a failed transfer starts over.  If there's a manifest, the
+ * download has to be its size, and the index its digest, before it replaces
+ * dest.
+ */
+static int fetch_filtered(mportInstance *mport, const char *mirror, const char *url, const char *dest, const struct fetch_filter *filter, const mportIndexManifest *m)
+{
+  FILE *remote = NULL;
+  FILE *local  = NULL;
+  struct url_stat stat;
+  struct timespec start;
+  char tmp[FILENAME_MAX];
+  char buffer[BUFFSIZE];
+  char rate[32];
+  void *ctx = NULL;
+  size_t size;
+  off_t got = 0;
+  double connect;
+  int fd;
+  int remote_failed = 0;
+  
+  (void)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dest);
+  
+  mport_call_progress_init_cb(mport, "Downloading %s", url);
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  if ((remote = fetchXGetURL(url, &stat, "p")) == NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+    remote_failed = 1;
+    tmp[0] = '\0';
+    goto ERROR;
+  }
+  
+  connect = mport_mirror_elapsed(&start);
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  if ((fd = mkstemp(tmp)) == -1) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Unable to create %s: %s", tmp, strerror(errno));
+    tmp[0] = '\0';
+    goto ERROR;
+  }
+  
+  if (fchmod(fd, 0644) != 0 || (local = fdopen(fd, "w")) == NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", tmp, strerror(errno));
+    (void)close(fd);
+    goto ERROR;
+  }
+  
+  if ((filter->init)(&ctx) != MPORT_OK)
+    goto ERROR;
+  
+  while ((size = fread(buffer, 1, BUFFSIZE, remote)) > 0) {
+    got += size;
+    (mport->progress_step_cb)(got, stat.size, mport_fetch_rate(rate, sizeof(rate), got, &start));
+    
+    if ((filter->write)(ctx, buffer, size, local) != MPORT_OK) {
+      /* bad data is the mirror's fault; a full disk isn't */
+      remote_failed = !ferror(local);
+      goto ERROR;
+    }
+  }
+  
+  if (ferror(remote)) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+    remote_failed = 1;
+    goto ERROR;
+  }
+  
+  if ((stat.size > 0 && got != stat.size) || (filter->finish)(ctx) != MPORT_OK) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: incomplete %s stream (got %jd of %jd bytes)", url, filter->name, (intmax_t)got, (intmax_t)stat.size);
+    remote_failed = 1;
+    goto ERROR;
+  }
+  
+  if (m != NULL && m->size > 0 && got != m->size) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: got %jd bytes, the manifest says %jd", url, (intmax_t)got, (intmax_t)m->size);
+    remote_failed = 1;
+    goto ERROR;
+  }
+  
+  fclose(remote);
+  remote = NULL;
+  
+  if (fflush(local) != 0 || fsync(fileno(local)) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", tmp, strerror(errno));
+    goto ERROR;
+  }
+  
+  if (fclose(local) != 0) {
+    local = NULL;
+    SET_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", tmp, strerror(errno));
+    goto ERROR;
+  }
+  local = NULL;
+  
+  if (m != NULL && mport_index_verify(tmp, m) != MPORT_OK) {
+    remote_failed = 1;
+    goto ERROR;
+  }
+  
+  if (mirror != NULL)
+    mport_mirror_sample(mport, mirror, 1, connect, got, mport_mirror_elapsed(&start));
+  
+  if (rename(tmp, dest) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't rename %s to %s: %s", tmp, dest, strerror(errno));
+    goto ERROR;
+  }
+  
+  (void)sync_parent(dest);
+  
+  (filter->free)(ctx);
   (mport->progress_free_cb)();
+  
+  return MPORT_OK;
+  
+  ERROR:
+    if (mirror != NULL && remote_failed)
+      mport_mirror_sample(mport, mirror, 0, 0, 0, 0);
+    if (remote != NULL)
+      fclose(remote);
+    if (local != NULL)
+      fclose(local);
+    if (tmp[0] != '\0')
+      (void)unlink(tmp);
+    if (ctx != NULL)
+      (filter->free)(ctx);
+    (mport->progress_free_cb)();
+    RETURN_CURRENT_ERROR;
+}
+
+
+/* make a rename into path's directory durable */
+static int sync_parent(const char *path)
+{
+  char dir[FILENAME_MAX];
+  char *slash;
+  int fd, ret;
+  
+  (void)strlcpy(dir, path, sizeof(dir));
+  
+  if ((slash = strrchr(dir, '/')) == NULL)
+    (void)strlcpy(dir, ".", sizeof(dir));
+  else if (slash == dir)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+  
+  if ((fd = open(dir, O_RDONLY)) == -1)
+    return MPORT_ERR_FATAL;
+  
+  ret = fsync(fd);
+  (void)close(fd);
+  
+  return ret == 0 ? MPORT_OK : MPORT_ERR_FATAL;
+}
+
+
+/* fetch_hedged(mport, mirrors, filename, dest, flags)
+ *
+ * Fetch filename from the first mirror, and if no bytes come from it for
+ * longer than mport_mirror_hedge_deadline(), ask the second mirror as well;
+ * whichever finishes first wins, and the other is cancelled.  If the first
+ * mirror simply fails, the second is asked straight away.
+ *
+ * libfetch can't interrupt a blocked read, so the attempts run on detached
+ * threads and a loser notices it lost the next time it gets data, or when
+ * libfetch times it out, then removes its partial download.  If nobody has
+ * set fetchTimeout we do, for the whole process and for good: a loser can
+ * still be reading after we return.  The first attempt downloads through
+ * dest's own .part, so if both fail the plain fetch() that follows resumes
+ * it; the second downloads to a name of its own and is renamed to dest if it
+ * wins.  A dest that is partly fetched already isn't hedged at all, so the
+ * resume isn't thrown away.  The attempts never touch mport once the caller
+ * has returned.
+ */
+static int fetch_hedged(mportInstance *mport, char **mirrors, const char *filename, const char *dest, int flags)
+{
+  struct hedge *h;
+  struct hedge_attempt *a;
+  struct timespec ts;
+  double deadline, idle;
+  off_t got, size;
+  char adest[2][FILENAME_MAX];
+  char rate[32];
+  int i, running, ret;
+  int quiet = (flags & MPORT_FETCH_QUIET);
+  
+  if (mport->fetch_hedge_percentile == 0 || mirrors[0] == NULL || mirrors[1] == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "No second mirror to hedge with.");
+  
+  /* an interrupted fetch is better resumed */
+  (void)snprintf(adest[0], sizeof(adest[0]), "%s.part", dest);
+  if (mport_file_exists(adest[0]))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s is partly fetched already.", filename);
+  
+  deadline = mport_mirror_hedge_deadline(mport);
+  
+  if ((h = (struct hedge *)calloc(1, sizeof(struct hedge))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if ((h->dest = strdup(dest)) == NULL) {
+    free(h);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  h->mport  = mport;
+  h->winner = -1;
+  h->refs   = 1;
+  (void)pthread_mutex_init(&h->lock, NULL);
+  (void)pthread_cond_init(&h->cond, NULL);
+  
+  /* h is unique among live hedges in this process, and the name only has
+   * to last as long as it does */
+  (void)strlcpy(adest[0], dest, sizeof(adest[0]));
+  (void)snprintf(adest[1], sizeof(adest[1]), "%s.hedge.%ld.%lx.1", dest, (long)getpid(), (unsigned long)(uintptr_t)h);
+  
+  /* a loser blocked in a read has to give up some time */
+  if (fetchTimeout <= 0)
+    fetchTimeout = MPORT_HEDGE_FETCH_TIMEOUT;
+  
+  if (!quiet)
+    mport_call_progress_init_cb(mport, "Downloading %s", filename);
+  
+  pthread_mutex_lock(&h->lock);
+  
+  if (start_attempt(h, 0, mirrors[0], filename, adest[0]) != MPORT_OK) {
+    h->cancelled = 1;
+    pthread_mutex_unlock(&h->lock);
+    hedge_release(h);
+    if (!quiet)
+      (mport->progress_free_cb)();
+    RETURN_CURRENT_ERROR;
+  }
+  
+  while (1) {
+    if (h->winner >= 0 && h->attempts[h->winner].done)
+      break;
+    
+    for (running = 0, i = 0; i < h->started; i++) 
+      running += !h->attempts[i].done;
+    
+    a = &h->attempts[0];
+    idle = mport_mirror_elapsed(&a->progressed);
+    
+    /* the first mirror failed or stalled; ask the second.  Failing to 
+     * start it just leaves us waiting on the first. */
+    if (h->started == 1 && (running == 0 || idle >= deadline)) {
+      (void)start_attempt(h, 1, mirrors[1], filename, adest[1]);
+      continue;
+    }
+    
+    if (running == 0)
+      break;
+    
+    if (!quiet) {
+      for (a = NULL, got = 0, size = 0, i = 0; i < h->started; i++) {
+        if (h->attempts[i].got > got) {
+          a    = &h->attempts[i];
+          got  = a->got;
+          size = a->size;
+        }
+      }
+      (mport->progress_step_cb)(got, size, a == NULL ? "" : mport_fetch_rate(rate, sizeof(rate), got, &a->started));
+    }
+    
+    /* wake for the deadline, or once a second for the progress bar */
+    idle = (h->started == 1 && deadline - idle < 1.0) ? deadline - idle : 1.0;
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += (time_t)idle;
+    ts.tv_nsec += (long)((idle - (time_t)idle) * 1e9);
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    (void)pthread_cond_timedwait(&h->cond, &h->lock, &ts);
+  }
+  
+  if (h->winner >= 0 && h->attempts[h->winner].ret == MPORT_OK) {
+    ret = MPORT_OK;
+  } else {
+    a = &h->attempts[h->winner >= 0 ? h->winner : h->started - 1];
+    ret = SET_ERRORX(MPORT_ERR_FATAL, "Unable to fetch %s: %s", filename, a->error != NULL ? a->error : "unknown error");
+  }
+  
+  h->cancelled = 1;
+  pthread_mutex_unlock(&h->lock);
+  hedge_release(h);
+  
+  if (!quiet)
+    (mport->progress_free_cb)();
+  
+  return ret;
+}
+
+
+/* start attempt i of h, fetching filename from mirror to dest.  Call with the
+ * lock held. */
+static int start_attempt(struct hedge *h, int i, const char *mirror, const char *filename, const char *dest)
+{
+  struct hedge_attempt *a = &h->attempts[i];
+  pthread_t thread;
+  
+  h->started = i + 1;
+  a->hedge   = h;
+  a->index   = i;
+  a->first_byte = -1;
+  (void)clock_gettime(CLOCK_MONOTONIC, &a->started);
+  a->progressed = a->started;
+  
+  (void)asprintf(&a->url, "%s/%s/%s", mirror, MPORT_URL_PATH, filename);
+  a->mirror = strdup(mirror);
+  a->dest   = strdup(dest);
+  
+  if (a->url == NULL || a->mirror == NULL || a->dest == NULL) {
+    a->done  = 1;
+    a->ret   = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    a->error = strdup(mport_err_string());
+    RETURN_CURRENT_ERROR;
+  }
+  
+  h->refs++;
+  
+  if (pthread_create(&thread, NULL, attempt_main, a) != 0) {
+    h->refs--;
+    a->done  = 1;
+    a->ret   = SET_ERROR(MPORT_ERR_FATAL, "Couldn't start a fetch thread.");
+    a->error = strdup(mport_err_string());
+    RETURN_CURRENT_ERROR;
+  }
+  
+  (void)pthread_detach(thread);
 
   return MPORT_OK;
 }
 
+
+static void * attempt_main(void *arg)
+{
+  struct hedge_attempt *a = (struct hedge_attempt *)arg;
+  struct hedge *h = a->hedge;
+  char file[FILENAME_MAX];
+  char *error = NULL;
+  int ret, lost;
+  
+  /* no mirror, so fetch() leaves the stats to us; quiet, so it never
+   * touches mport */
+  ret = fetch(h->mport, NULL, a->url, a->dest, MPORT_FETCH_QUIET, a);
+  
+  pthread_mutex_lock(&h->lock);
+  
+  lost = (h->winner >= 0 && h->winner != a->index);
+  
+  /* the first attempt's fetch() already put it in place */
+  if (ret == MPORT_OK && a->index != 0 && rename(a->dest, h->dest) != 0) {
+    ret = SET_ERRORX(MPORT_ERR_FATAL, "Couldn't rename %s to %s: %s", a->dest, h->dest, strerror(errno));
+    (void)unlink(a->dest);
+  }
+  
+  if (ret != MPORT_OK && (error = strdup(mport_err_string())) == NULL)
+    error = strdup("Out of memory.");
+  
+  /* losing isn't the mirror's fault */
+  if (!h->cancelled && !lost) 
+    mport_mirror_sample(h->mport, a->mirror, ret == MPORT_OK, a->first_byte < 0 ? 0 : a->first_byte, a->got, mport_mirror_elapsed(&a->started));
+  
+  /* nothing will ever resume from the second attempt's name, and the first
+   * attempt's .part is only worth keeping if nobody else got the file */
+  if (ret != MPORT_OK && (a->index != 0 || lost)) {
+    (void)snprintf(file, sizeof(file), "%s.part", a->dest);
+    (void)unlink(file);
+    (void)snprintf(file, sizeof(file), "%s.part.meta", a->dest);
+    (void)unlink(file);
+  }
+  
+  a->done  = 1;
+  a->ret   = ret;
+  a->error = error;
+  
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->lock);
+  
+  hedge_release(h);
+  
+  return NULL;
+}
+
+
+/* note that attempt a has got bytes of size.  Returns true if it should give
+ * up, because the other attempt has already won. */
+static int hedge_progress(struct hedge_attempt *a, off_t got, off_t size)
+{
+  struct hedge *h = a->hedge;
+  int stop;
+  
+  pthread_mutex_lock(&h->lock);
+  
+  if (a->first_byte < 0)
+    a->first_byte = mport_mirror_elapsed(&a->started);
+  
+  a->got  = got;
+  a->size = size;
+  (void)clock_gettime(CLOCK_MONOTONIC, &a->progressed);
+  
+  stop = h->cancelled || (h->winner >= 0 && h->winner != a->index);
+  
+  pthread_mutex_unlock(&h->lock);
+  
+  return stop;
+}
+
+
+/* attempt a has the whole file; returns true if it's the first */
+static int hedge_claim(struct hedge_attempt *a)
+{
+  struct hedge *h = a->hedge;
+  int won = 0;
+  
+  pthread_mutex_lock(&h->lock);
+  
+  if (h->winner < 0 && !h->cancelled) {
+    h->winner = a->index;
+    won = 1;
+  }
+  
+  pthread_mutex_unlock(&h->lock);
+  
+  return won;
+}
+
+
+/* drop a reference to h; the last one out frees it */
+static void hedge_release(struct hedge *h)
+{
+  int i, last;
+  
+  pthread_mutex_lock(&h->lock);
+  last = (--h->refs == 0);
+  pthread_mutex_unlock(&h->lock);
+  
+  if (!last)
+    return;
+  
+  for (i = 0; i < 2; i++) {
+    free(h->attempts[i].mirror);
+    free(h->attempts[i].url);
+    free(h->attempts[i].dest);
+    free(h->attempts[i].error);
+  }
+  
+  pthread_cond_destroy(&h->cond);
+  pthread_mutex_destroy(&h->lock);
+  free(h->dest);
+  free(h);
+}
+
+
+/* read_part_meta(file, &meta)
+ *
+ * Read a .part sidecar.  Returns true if there was one, and it made sense.
+ */
+static int read_part_meta(const char *file, struct part_meta *meta)
+{
+  FILE *fp;
+  intmax_t size, mtime;
+  int ok;
+  
+  if ((fp = fopen(file, "r")) == NULL)
+    return 0;
+  
+  ok = fgets(meta->url, sizeof(meta->url), fp) != NULL && fscanf(fp, "%jd\n%jd\n", &size, &mtime) == 2;
+  
+  fclose(fp);
+  
+  if (!ok)
+    return 0;
+  
+  meta->url[strcspn(meta->url, "\n")] = '\0';
+  meta->size  = (off_t)size;
+  meta->mtime = (time_t)mtime;
+  
+  return 1;
+}
+
+
+/* write_part_meta(file, url, stat)
+ *
+ * Record what the .part next to file is the start of.
+ */
+static int write_part_meta(const char *file, const char *url, const struct url_stat *stat)
+{
+  FILE *fp;
+  
+  if ((fp = fopen(file, "w")) == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", file, strerror(errno));
+  
+  (void)fprintf(fp, "%s\n%jd\n%jd\n", url, (intmax_t)stat->size, (intmax_t)stat->mtime);
+  
+  if (fclose(fp) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", file, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+/* The bzip2 filter.  bzip2 (and pbzip2 especially) may write several
+ * streams back to back; each one is decoded in turn. */
+struct bz_filter {
+  bz_stream bz;
+  int ended;    /* at the end of a stream; anything more starts another */
+  char out[BUFFSIZE];
+};
+
+static int bz_filter_init(void **ctx)
+{
+  struct bz_filter *f;
+  
+  if ((f = calloc(1, sizeof(struct bz_filter))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if (BZ2_bzDecompressInit(&f->bz, 0, 0) != BZ_OK) {
+    free(f);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize bzip2.");
+  }
+  
+  *ctx = f;
+  return MPORT_OK;
+}
+
+static int bz_filter_write(void *ctx, const char *buf, size_t len, FILE *out)
+{
+  struct bz_filter *f = ctx;
+  size_t n;
+  int ret;
+  
+  f->bz.next_in  = (char *)buf;
+  f->bz.avail_in = len;
+  
+  while (1) {
+    if (f->ended) {
+      if (f->bz.avail_in == 0)
+        break;
+      
+      (void)BZ2_bzDecompressEnd(&f->bz);
+      if (BZ2_bzDecompressInit(&f->bz, 0, 0) != BZ_OK)
+        RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize bzip2.");
+      f->bz.next_in  = (char *)buf + (len - f->bz.avail_in);
+      f->ended = 0;
+    }
+    
+    f->bz.next_out  = f->out;
+    f->bz.avail_out = sizeof(f->out);
+    
+    ret = BZ2_bzDecompress(&f->bz);
+    
+    if (ret != BZ_OK && ret != BZ_STREAM_END)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "bzip2 error %d: the data is corrupt.", ret);
+    
+    n = sizeof(f->out) - f->bz.avail_out;
+    
+    if (n > 0 && fwrite(f->out, 1, n, out) != n)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Write error: %s", strerror(errno));
+    
+    if (ret == BZ_STREAM_END)
+      f->ended = 1;
+    else if (f->bz.avail_in == 0 && f->bz.avail_out > 0)
+      break;
+  }
+  
+  return MPORT_OK;
+}
+
+static int bz_filter_finish(void *ctx)
+{
+  struct bz_filter *f = ctx;
+  
+  if (!f->ended)
+    RETURN_ERROR(MPORT_ERR_FATAL, "The bzip2 stream ends early.");
+  
+  return MPORT_OK;
+}
+
+static void bz_filter_free(void *ctx)
+{
+  struct bz_filter *f = ctx;
+  
+  (void)BZ2_bzDecompressEnd(&f->bz);
+  free(f);
+}
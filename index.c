@@ -39,6 +39,8 @@
 
 static int index_is_recentish(mportInstance *);
 static int lookup_alias(mportInstance *, const char *, char **);
+static int mirror_list(mportInstance *, int, char ***);
+static int index_has_column(mportInstance *, const char *);
 
 /*
  * Loads the index database.  The index contains a list of bundles that are
@@ -46,20 +48,26 @@ static int lookup_alias(mportInstance *, const char *, char **);
  * example), and a list of mirrors.
  *
  * This function will use the current local index if it is present and younger
- * than the max index age.  Otherwise, it will download the index.  If any 
- * index is present, the mirror list will be used; otherwise the bootstrap
- * url will be used.
+ * than the max index age.  Otherwise, it asks the mirrors' manifest whether
+ * anything changed, and if so brings the index up to date with the
+ * changesets on the mirrors (see index_update.c), or failing that downloads
+ * the index.  If any index is present, the mirror list will be used; 
+ * otherwise the bootstrap url will be used.
  */
 MPORT_PUBLIC_API int mport_index_load(mportInstance *mport)
 {
+  mportIndexManifest m;
+  int have_manifest;
+  
   if (mport_file_exists(MPORT_INDEX_FILE)) {
     if (mport_db_do(mport->db, "ATTACH %Q AS index", MPORT_INDEX_FILE) != MPORT_OK)
         RETURN_CURRENT_ERROR;
         
     mport->flags |= MPORT_INST_HAVE_INDEX;
   
-    if (!index_is_recentish(mport)) {
-      if (mport_fetch_index(mport) != MPORT_OK)
+    if (!index_is_recentish(mport) && mport_index_update(mport, &m, &have_manifest) != MPORT_OK) {
+      /* mirrors that don't publish a manifest yet still get a whole index */
+      if (mport_fetch_index(mport, have_manifest ? &m : NULL) != MPORT_OK)
         RETURN_CURRENT_ERROR;
         
       if (mport_db_do(mport->db, "DETACH index") != MPORT_OK)
@@ -87,7 +95,8 @@ MPORT_PUBLIC_API int mport_index_load(mportInstance *mport)
 }
 
 
-/* return 1 if the index is younger than the max age, 0 otherwise */
+/* return 1 if the index is younger than the max age, 0 otherwise.  An index
+ * brought up to date in place keeps its birth time, so this goes by mtime. */
 static int index_is_recentish(mportInstance *mport) 
 {
   struct stat st;
@@ -99,7 +108,7 @@ static int index_is_recentish(mportInstance *mport)
   if (clock_gettime(CLOCK_REALTIME, &now) != 0) 
     RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
       
-  if ((st.st_birthtime + MPORT_MAX_INDEX_AGE) < now.tv_sec) 
+  if ((st.st_mtime + MPORT_MAX_INDEX_AGE) < now.tv_sec) 
     return 0;
     
   return 1;
@@ -108,16 +117,35 @@ static int index_is_recentish(mportInstance *mport)
 
 /*
  * Fills the string vector with the list of the mirrors for the current
- * country.  
+ * country, the ones we expect to be fastest first.  Mirrors that failed
+ * within the last MPORT_MIRROR_COOLDOWN seconds are left out, unless they
+ * all did.  See mirror.c.
  * 
  * XXX - The country is currently hardcoded to the US.
  */
 int mport_index_get_mirror_list(mportInstance *mport, char ***list_p)
+{
+  return mirror_list(mport, 0, list_p);
+}
+
+/*
+ * Like mport_index_get_mirror_list(), but nothing is left out.
+ */
+int mport_index_get_all_mirrors(mportInstance *mport, char ***list_p)
+{
+  return mirror_list(mport, 1, list_p);
+}
+
+
+static int mirror_list(mportInstance *mport, int all, char ***list_p)
 {
   char **list;
-  int len, ret, i;
+  int len, ret, i, usable;
   sqlite3_stmt *stmt;
   
+  /* whatever the fetch threads learned goes into the ordering */
+  (void)mport_mirror_flush(mport);
+  
   /* XXX the country is hard coded until a configuration system is created */    
   if (mport_db_prepare(mport->db, &stmt, "SELECT COUNT(*) FROM index.mirrors WHERE country='us'") != MPORT_OK)
     RETURN_CURRENT_ERROR;
@@ -138,17 +166,29 @@ int mport_index_get_mirror_list(mportInstance *mport, char ***list_p)
       RETURN_CURRENT_ERROR;
   }
   
-  list = calloc(len + 1, sizeof(char *));
+  if ((list = calloc(len + 1, sizeof(char *))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
   *list_p = list;  
   i = 0;
+  usable = 0;
     
-  if (mport_db_prepare(mport->db, &stmt, "SELECT mirror FROM index.mirrors WHERE country='us'") != MPORT_OK)
+  /* mirrors we've never measured go after the ones we have; the probe gives
+   * them a chance */
+  if (mport_db_prepare(mport->db, &stmt, 
+      "SELECT m.mirror, (h.last_failure IS NOT NULL AND h.last_failure > %ld) AS cooling "
+      "FROM index.mirrors m LEFT JOIN mirror_health h ON h.mirror = m.mirror WHERE m.country='us' "
+      "ORDER BY cooling, COALESCE(h.throughput, 0) DESC, COALESCE(h.connect_time, %d)",
+      (long)(time(NULL) - MPORT_MIRROR_COOLDOWN), MPORT_MIRROR_COOLDOWN) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
-  while (1) {
+  while (i < len) {
     ret = sqlite3_step(stmt);
     
     if (ret == SQLITE_ROW) {
+      if (!all && usable > 0 && sqlite3_column_int(stmt, 1)) 
+        break;
+      
       list[i] = strdup(sqlite3_column_text(stmt, 0));
       
       if (list[i] == NULL) {
@@ -156,9 +196,11 @@ int mport_index_get_mirror_list(mportInstance *mport, char ***list_p)
         RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
       }
       
+      if (!sqlite3_column_int(stmt, 1))
+        usable++;
+      
       i++;
     } else if (ret == SQLITE_DONE) {
-      list[i] = NULL;
       break;
     } else {
       sqlite3_finalize(stmt);
@@ -166,10 +208,52 @@ int mport_index_get_mirror_list(mportInstance *mport, char ***list_p)
     }
   }
   
+  list[i] = NULL;
   sqlite3_finalize(stmt);
   return MPORT_OK;
 }
 
+/*
+ * Returns true if the index has the sha256 of each bundle; indexes from
+ * before the download cache don't.
+ */
+int mport_index_has_hashes(mportInstance *mport)
+{
+  return index_has_column(mport, "hash");
+}
+
+
+/*
+ * Returns true if the index also has the sha256 of each bundle's stub and
+ * metafiles, which installing a bundle as it downloads needs.
+ */
+int mport_index_has_meta_hashes(mportInstance *mport)
+{
+  return index_has_column(mport, "meta_hash");
+}
+
+
+static int index_has_column(mportInstance *mport, const char *column)
+{
+  sqlite3_stmt *stmt;
+  int found = 0;
+  
+  if (mport_db_prepare(mport->db, &stmt, "PRAGMA index.table_info(packages)") != MPORT_OK)
+    return 0;
+  
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (strcmp((const char *)sqlite3_column_text(stmt, 1), column) == 0) {
+      found = 1;
+      break;
+    }
+  }
+  
+  sqlite3_finalize(stmt);
+  
+  return found;
+}
+
+
 /*
  * Looks up a pkgname from the index and fills a vector of index entries
  * with the result.
@@ -181,7 +265,8 @@ int mport_index_get_mirror_list(mportInstance *mport, char ***list_p)
 MPORT_PUBLIC_API int mport_index_lookup_pkgname(mportInstance *mport, const char *pkgname, mportIndexEntry ***entry_vec)
 {
   char *lookup;
-  int count, i, step;
+  int count, step;
+  int i = 0;
   sqlite3_stmt *stmt;
   int ret = MPORT_OK;
   mportIndexEntry **e;
@@ -191,8 +276,10 @@ MPORT_PUBLIC_API int mport_index_lookup_pkgname(mportInstance *mport, const char
   if (lookup_alias(mport, pkgname, &lookup) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
-  if (mport_db_prepare(mport->db, &stmt, "SELECT COUNT(*) FROM index.packages WHERE pkg GLOB %Q", lookup) != MPORT_OK)
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT COUNT(*) FROM index.packages WHERE pkg GLOB ?", lookup) != MPORT_OK) {
+    free(lookup);
     RETURN_CURRENT_ERROR;
+  }
     
   switch (sqlite3_step(stmt)) {
     case SQLITE_ROW:
@@ -208,15 +295,17 @@ MPORT_PUBLIC_API int mport_index_lookup_pkgname(mportInstance *mport, const char
       break;
   }
   
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
+  stmt = NULL;
   
   e = (mportIndexEntry **)calloc(count + 1, sizeof(mportIndexEntry *));
   *entry_vec = e;
   
   if (count == 0) 
-    return MPORT_OK;
+    goto DONE;
   
-  if (mport_db_prepare(mport->db, &stmt, "SELECT pkg, version, comment, www, bundlefile FROM index.packages WHERE pkg GLOB %Q", lookup) != MPORT_OK) {
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT pkg, version, comment, www, bundlefile FROM index.packages WHERE pkg GLOB ?", lookup) != MPORT_OK) {
+    stmt = NULL;
     ret = mport_err_code();
     goto DONE;
   }
@@ -252,8 +341,9 @@ MPORT_PUBLIC_API int mport_index_lookup_pkgname(mportInstance *mport, const char
   }
       
   DONE:
+    /* the statement goes first; lookup is bound to it */
+    mport_db_release(mport, stmt);
     free(lookup);
-    sqlite3_finalize(stmt);
     return ret; 
 }
 
@@ -263,7 +353,7 @@ static int lookup_alias(mportInstance *mport, const char *query, char **result)
   sqlite3_stmt *stmt;
   int ret = MPORT_OK;
   
-  if (mport_db_prepare(mport->db, &stmt, "SELECT pkg FROM index.aliases WHERE alias=%Q", query) != MPORT_OK)
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT pkg FROM index.aliases WHERE alias=?", query) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
   switch (sqlite3_step(stmt)) {
@@ -278,7 +368,7 @@ static int lookup_alias(mportInstance *mport, const char *query, char **result)
       break;
   }
   
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return ret;   
 }
 
@@ -0,0 +1,373 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Keeping the index up to date cheaply.
+ *
+ * Each published index is a generation.  Next to it on the mirrors is a tiny
+ * manifest, index.gen, with the latest generation, a digest of the index's
+ * contents, and the size of index.db.bz2; and changesets/N.changeset, which
+ * turns generation N-1 into generation N (see bless_run.pl).  The local
+ * index records its generation in its meta table.
+ *
+ * When the index gets old we ask for the manifest with If-Modified-Since
+ * against our last copy of it, so when nothing has changed that's one small
+ * round trip.  If the mirrors are ahead, we fetch the changesets in between,
+ * apply them in one transaction with the session extension, and commit only
+ * if the result has the published digest.  Anything else - an old index with
+ * no generation, a missing changeset, a conflict, a digest that doesn't
+ * match, or an sqlite built without the session extension - leaves the index
+ * alone and tells the caller to download the whole thing.
+ *
+ * The session API is only declared when sqlite3.h is told it's there; the
+ * Makefile does that with WITH_INDEX_CHANGESETS.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sha256.h>
+#include "mport.h"
+#include "mport_private.h"
+
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+#define HAVE_CHANGESETS
+#endif
+
+static int local_generation(mportInstance *, int *);
+static int index_digest(sqlite3 *, char *);
+#ifdef HAVE_CHANGESETS
+static int apply_changesets(mportInstance *, int, mportIndexManifest *);
+static int apply_changeset(sqlite3 *, const char *);
+static int abort_on_conflict(void *, int, sqlite3_changeset_iter *);
+#endif
+
+
+/* mport_index_update(mport, &manifest, &have_manifest)
+ *
+ * Bring the loaded index up to the mirrors' generation.  Returns MPORT_OK if
+ * the index is now current; otherwise the index is untouched and should be
+ * downloaded whole.  Either way have_manifest says whether the mirrors'
+ * manifest was got into manifest, so that download can check against it
+ * without asking for it again.
+ */
+int mport_index_update(mportInstance *mport, mportIndexManifest *m, int *have_manifest)
+{
+  int have;
+  
+  *have_manifest = 0;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_index_update()");
+  
+  if (mport_index_manifest(mport, m) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  *have_manifest = 1;
+  
+  if (local_generation(mport, &have) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (m->generation < have)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "The index on the mirrors is older (%d) than ours (%d).", m->generation, have);
+  
+  if (m->generation > have) {
+#ifdef HAVE_CHANGESETS
+    if (apply_changesets(mport, have, m) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+#else
+    RETURN_ERROR(MPORT_ERR_FATAL, "libmport was built without index changeset support.");
+#endif
+  }
+  
+  /* current as of now, as far as index_is_recentish() cares */
+  (void)utimes(MPORT_INDEX_FILE, NULL);
+  
+  return MPORT_OK;
+}
+
+
+/* mport_index_manifest(mport, &manifest)
+ *
+ * Get the mirrors' index manifest; only downloaded if it changed since our
+ * copy in MPORT_INDEX_MANIFEST.
+ */
+int mport_index_manifest(mportInstance *mport, mportIndexManifest *m)
+{
+  FILE *fp;
+  intmax_t size = 0;
+  int changed, n;
+  
+  if (mport_fetch_if_modified(mport, "index.gen", MPORT_INDEX_MANIFEST, &changed) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((fp = fopen(MPORT_INDEX_MANIFEST, "r")) == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", MPORT_INDEX_MANIFEST, strerror(errno));
+  
+  /* the size came later; older manifests stop at the digest */
+  n = fscanf(fp, "%d %64s %jd", &m->generation, m->digest, &size);
+  fclose(fp);
+  
+  if (n < 2 || strlen(m->digest) != 64) {
+    /* don't let a bad copy be "not modified" next time */
+    (void)unlink(MPORT_INDEX_MANIFEST);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s is malformed.", MPORT_INDEX_MANIFEST);
+  }
+  
+  m->size = (off_t)size;
+  
+  return MPORT_OK;
+}
+
+
+/* mport_index_verify(file, manifest)
+ *
+ * Check that the index database in file is the one the manifest describes,
+ * before it replaces ours.
+ */
+int mport_index_verify(const char *file, const mportIndexManifest *m)
+{
+  sqlite3 *db;
+  char digest[65];
+  
+  if (sqlite3_open_v2(file, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", file, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if (index_digest(db, digest) != MPORT_OK) {
+    sqlite3_close(db);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  sqlite3_close(db);
+  
+  if (strcmp(digest, m->digest) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "The downloaded index doesn't match the published digest (%s, expected %s).", digest, m->digest);
+  
+  return MPORT_OK;
+}
+
+
+#ifdef HAVE_CHANGESETS
+/* apply changesets have+1 through m's generation to the index, in one
+ * transaction, if the result matches m's digest */
+static int apply_changesets(mportInstance *mport, int have, mportIndexManifest *m)
+{
+  sqlite3 *db;
+  char local[65];
+  char file[FILENAME_MAX];
+  char path[FILENAME_MAX];
+  int gen;
+  
+  /* get the whole chain before changing anything */
+  for (gen = have + 1; gen <= m->generation; gen++) {
+    (void)snprintf(path, sizeof(path), "changesets/%d.changeset", gen);
+    (void)snprintf(file, sizeof(file), "%s/index-%d.changeset", MPORT_FETCH_STAGING_DIR, gen);
+    
+    if (mport_fetch_file(mport, path, file) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  if (sqlite3_open(MPORT_INDEX_FILE, &db) != SQLITE_OK) {
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if (mport_db_do(db, "BEGIN EXCLUSIVE") != MPORT_OK) {
+    sqlite3_close(db);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  for (gen = have + 1; gen <= m->generation; gen++) {
+    (void)snprintf(file, sizeof(file), "%s/index-%d.changeset", MPORT_FETCH_STAGING_DIR, gen);
+    
+    if (apply_changeset(db, file) != MPORT_OK)
+      goto ERROR;
+    
+    (void)unlink(file);
+  }
+  
+  if (index_digest(db, local) != MPORT_OK)
+    goto ERROR;
+  
+  if (strcmp(local, m->digest) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "The index after changesets %d to %d doesn't match the published digest.", have + 1, m->generation);
+    goto ERROR;
+  }
+  
+  if (mport_db_do(db, "COMMIT") != MPORT_OK)
+    goto ERROR;
+  
+  sqlite3_close(db);
+  
+  return MPORT_OK;
+  
+  ERROR:
+    (void)sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    sqlite3_close(db);
+    RETURN_CURRENT_ERROR;
+}
+#endif
+
+
+static int local_generation(mportInstance *mport, int *gen)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+  
+  /* indexes from before generations have no meta table; that's an error
+   * here, which is what we want */
+  if (mport_db_prepare(mport->db, &stmt, "SELECT value FROM index.meta WHERE field='generation'") != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((ret = sqlite3_step(stmt)) != SQLITE_ROW) {
+    sqlite3_finalize(stmt);
+    if (ret == SQLITE_DONE)
+      RETURN_ERROR(MPORT_ERR_FATAL, "The index has no generation.");
+    RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+  }
+  
+  *gen = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  
+  return MPORT_OK;
+}
+
+
+#ifdef HAVE_CHANGESETS
+static int apply_changeset(sqlite3 *db, const char *file)
+{
+  struct stat st;
+  FILE *fp;
+  char *data;
+  int ret;
+  
+  if ((fp = fopen(file, "r")) == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", file, strerror(errno));
+  
+  if (fstat(fileno(fp), &st) != 0 || st.st_size == 0 || (data = (char *)malloc(st.st_size)) == NULL) {
+    fclose(fp);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read %s.", file);
+  }
+  
+  if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size) {
+    free(data);
+    fclose(fp);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read %s: %s", file, strerror(errno));
+  }
+  
+  fclose(fp);
+  
+  ret = sqlite3changeset_apply(db, (int)st.st_size, data, NULL, abort_on_conflict, NULL);
+  free(data);
+  
+  if (ret != SQLITE_OK)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't apply %s: %s", file, sqlite3_errmsg(db));
+  
+  return MPORT_OK;
+}
+
+
+/* our index isn't the generation the changeset expects; don't guess */
+static int abort_on_conflict(void *ctx, int type, sqlite3_changeset_iter *iter)
+{
+  return SQLITE_CHANGESET_ABORT;
+}
+#endif
+
+
+/* index_digest(db, digest)
+ *
+ * The sha256 of what's in the index (rather than of the file, which sqlite 
+ * is free to lay out differently): for each table, its name and a line per
+ * row, the columns tab separated, NULL as \N, in order.  This has to match
+ * index_digest() in bless_run.pl.
+ */
+static int index_digest(sqlite3 *db, char *digest)
+{
+  static const char *tables[] = {"aliases", "categories", "depends", "meta", "mirrors", "packages", NULL};
+  sqlite3_stmt *stmt;
+  SHA256_CTX ctx;
+  char order[256];
+  const char *value;
+  int i, col, ncols, ret;
+  
+  SHA256_Init(&ctx);
+  
+  for (i = 0; tables[i] != NULL; i++) {
+    if (mport_db_prepare(db, &stmt, "PRAGMA table_info(%s)", tables[i]) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    for (ncols = 0; sqlite3_step(stmt) == SQLITE_ROW; ncols++)
+      ;
+    
+    sqlite3_finalize(stmt);
+    
+    if (ncols == 0)
+      continue;
+    
+    order[0] = '\0';
+    for (col = 1; col <= ncols; col++) 
+      (void)snprintf(order + strlen(order), sizeof(order) - strlen(order), col == 1 ? "%d" : ",%d", col);
+    
+    if (mport_db_prepare(db, &stmt, "SELECT * FROM %s ORDER BY %s", tables[i], order) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    SHA256_Update(&ctx, tables[i], strlen(tables[i]));
+    SHA256_Update(&ctx, "\n", 1);
+    
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+      for (col = 0; col < ncols; col++) {
+        if (col > 0)
+          SHA256_Update(&ctx, "\t", 1);
+        
+        if ((value = (const char *)sqlite3_column_text(stmt, col)) == NULL)
+          SHA256_Update(&ctx, "\\N", 2);
+        else
+          SHA256_Update(&ctx, value, sqlite3_column_bytes(stmt, col));
+      }
+      
+      SHA256_Update(&ctx, "\n", 1);
+    }
+    
+    sqlite3_finalize(stmt);
+    
+    if (ret != SQLITE_DONE)
+      RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+  }
+  
+  (void)SHA256_End(&ctx, digest);
+  
+  return MPORT_OK;
+}
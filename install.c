@@ -32,22 +32,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+static int install_pkgname(mportInstance *, const char *, const char *);
+static int install_plan_streamed(mportInstance *, mportPlanEntry **, const char *);
+static int install_staged(mportInstance *, mportPlanEntry *, const char *);
 static int install_bundle_file(mportInstance *, const char *, const char *);
+static int install_bundle_stream(mportInstance *, mportPlanEntry *, const char *, int *);
+static int install_pkg(mportInstance *, mportBundleRead *, mportPackageMeta *, const char *);
+static int can_stream(mportInstance *, mportBundleRead *, mportPackageMeta *);
 static int resolve_depends(mportInstance *, mportPackageMeta *, const char *);
+static int upgrade_depend(mportInstance *, const char *);
 
 MPORT_PUBLIC_API int mport_install(mportInstance *mport, const char *pkgname, const char *prefix)
 {
-  mportIndexEntry **e;
-  char *filename;
-  int ret = MPORT_OK;
+  /* the package and all its depends are one operation, as far as triggers go */
+  if (mport_batch_begin(mport) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return mport_batch_finish(mport, install_pkgname(mport, pkgname, prefix));
+}
+
+
+static int install_pkgname(mportInstance *mport, const char *pkgname, const char *prefix)
+{
+  mportPlanEntry **plan;
+  mportPrefetch *pf;
+  int i, ret = MPORT_OK;
 
   MPORT_CHECK_FOR_INDEX(mport, "mport_install()");
   
   if (mport_file_exists(pkgname)) 
     return install_bundle_file(mport, pkgname, prefix);
-  
-  if (mport_index_lookup_pkgname(mport, pkgname, &e) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
 
   /* we don't support installing more than one top-level package at a time.
    * Consider a situation like this:
@@ -66,25 +80,95 @@ MPORT_PUBLIC_API int mport_install(mportInstance *mport, const char *pkgname, co
    * If a user facing application wants this functionality, it would be
    * easy to piece together with mport_index_lookup_pkgname(), a
    * check for already installed packages, and mport_install().
+   *
+   * The plan has the package and every depend it needs installed or 
+   * upgraded, depends first.
    */
+  if (mport_plan_install(mport, pkgname, &plan) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
   
-  if (e[1] != NULL)
-    RETURN_ERRORX(MPORT_ERR_FATAL, "Could not resolve '%s' to a single package.", pkgname);
+  if (mport->flags & MPORT_INST_STREAM_INSTALL) {
+    ret = install_plan_streamed(mport, plan, prefix);
+    mport_plan_free_vec(plan);
+    return ret;
+  }
   
-  if (mport_fetch_bundle(mport, e[0]->bundlefile) != MPORT_OK)
+  /* the bundles are downloaded ahead of us while we install, in plan
+   * order, so a missing bundle stops us after the depends before it - each
+   * of which is completely installed. */
+  if (mport_prefetch_new(mport, plan, &pf) != MPORT_OK) {
+    mport_plan_free_vec(plan);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  for (i = 0; plan[i] != NULL; i++) {
+    if ((ret = mport_prefetch_wait(pf, i)) != MPORT_OK)
+      goto DONE;
+    
+    if ((ret = install_staged(mport, plan[i], prefix)) != MPORT_OK)
+      goto DONE;
+  }
+  
+  DONE:
+    mport_prefetch_free(pf);
+    mport_plan_free_vec(plan);
+    return ret;
+}
+
+
+/* 
+ * Install the plan without a staged copy of each bundle, for when disk is
+ * tighter than bandwidth: a bundle's files are extracted as it downloads.
+ * Its stub and metafiles are checked against the index before they're used,
+ * and the files are renamed into place and the package committed only once
+ * the whole bundle matches the index's hash.  Nothing from the bundle gets
+ * run before that, so bundles with a pkg-install script, an mtree or @exec
+ * lines are downloaded first as usual - as are upgrades, bundles the index
+ * has no hashes for, and segmented bundles (which can't be read front to
+ * back).  We find out about those before anything is installed.
+ */
+static int install_plan_streamed(mportInstance *mport, mportPlanEntry **plan, const char *prefix)
+{
+  int i, fallback;
+  
+  for (i = 0; plan[i] != NULL; i++) {
+    if (plan[i]->action == MPORT_PLAN_INSTALL && plan[i]->hash != NULL && plan[i]->meta_hash != NULL) {
+      if (install_bundle_stream(mport, plan[i], prefix, &fallback) == MPORT_OK)
+        continue;
+      
+      if (!fallback)
+        RETURN_CURRENT_ERROR;
+    }
+    
+    if (mport_fetch_bundle(mport, plan[i]->bundlefile) != MPORT_OK)
       RETURN_CURRENT_ERROR;
     
-  (void)asprintf(&filename, "%s/%s", MPORT_FETCH_STAGING_DIR, e[0]->bundlefile);
+    if (install_staged(mport, plan[i], prefix) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/* install or upgrade from the entry's bundle in the staging dir */
+static int install_staged(mportInstance *mport, mportPlanEntry *entry, const char *prefix)
+{
+  char *filename;
+  int ret;
+  
+  (void)asprintf(&filename, "%s/%s", MPORT_FETCH_STAGING_DIR, entry->bundlefile);
     
   if (filename == NULL) 
     RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory."); 
     
-  ret = install_bundle_file(mport, filename, prefix);
+  if (entry->action == MPORT_PLAN_UPGRADE)
+    ret = mport_update_primative(mport, filename);
+  else
+    ret = install_bundle_file(mport, filename, prefix);
   
   free(filename);
   
-  mport_index_entry_free_vec(e);
-  
   return ret;
 }
 
@@ -92,12 +176,14 @@ MPORT_PUBLIC_API int mport_install(mportInstance *mport, const char *pkgname, co
 static int install_bundle_file(mportInstance *mport, const char *filename, const char *prefix)
 {
   mportBundleRead *bundle;
-  mportPackageMeta **pkgs, *pkg;
+  mportPackageMeta **pkgs;
   int i;
   
   if ((bundle = mport_bundle_read_new()) == NULL)
     RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
   
+  bundle->threads = mport->bundle_threads;
+  
   if (mport_bundle_read_init(bundle, filename) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
@@ -108,26 +194,123 @@ static int install_bundle_file(mportInstance *mport, const char *filename, const
     RETURN_CURRENT_ERROR;
   
   for (i=0; *(pkgs + i) != NULL; i++) {
-    pkg = pkgs[i];
+    if (install_pkg(mport, bundle, pkgs[i], prefix) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * Install entry's bundle as it comes off the network.  If it turns out it
+ * can't be done that way, *fallback is set and nothing has been changed.
+ */
+static int install_bundle_stream(mportInstance *mport, mportPlanEntry *entry, const char *prefix, int *fallback)
+{
+  mportBundleRead *bundle;
+  mportPackageMeta **pkgs;
+  FILE *fp;
+  off_t size;
+  int ret = MPORT_ERR_FATAL;
+  
+  *fallback = 1;
+  
+  if (mport_fetch_bundle_stream(mport, entry->bundlefile, &fp, &size) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((bundle = mport_bundle_read_new()) == NULL) {
+    fclose(fp);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  bundle->threads = mport->bundle_threads;
+  
+  if (mport_bundle_read_init_stream(bundle, entry->bundlefile, fp, size, entry->hash, entry->meta_hash) != MPORT_OK)
+    goto DONE;
+  
+  /* this checks the stub and metafiles against meta_hash before attaching */
+  if (mport_bundle_read_prep_for_install(mport, bundle) != MPORT_OK)
+    goto DONE;
+  
+  if (mport_pkgmeta_read_stub(mport, &pkgs) != MPORT_OK)
+    goto DONE;
+  
+  /* the hash is only checked at the end of the stream, so the package that
+   * ends it has to be the only one */
+  if (pkgs[0] == NULL || pkgs[1] != NULL) {
+    mport_pkgmeta_vec_free(pkgs);
+    SET_ERRORX(MPORT_ERR_FATAL, "%s doesn't have exactly one package; it can't be installed as it downloads.", entry->bundlefile);
+    goto DONE;
+  }
+  
+  if (!can_stream(mport, bundle, pkgs[0])) {
+    mport_pkgmeta_vec_free(pkgs);
+    goto DONE;
+  }
+  
+  *fallback = 0;
+  ret = install_pkg(mport, bundle, pkgs[0], prefix);
+  mport_pkgmeta_vec_free(pkgs);
+  
+  DONE:
+    /* don't clobber the install's error with one from closing the stream */
+    if (ret == MPORT_OK)
+      ret = mport_bundle_read_finish(mport, bundle);
+    else
+      (void)mport_bundle_read_finish(mport, bundle);
+    return ret == MPORT_OK ? MPORT_OK : mport_err_code();
+}
+
+
+static int install_pkg(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg, const char *prefix)
+{
+  if (prefix != NULL) {
+    /* override the default prefix with the given prefix */
+    free(pkg->prefix);
+    if ((pkg->prefix = strdup(prefix)) == NULL) /* all hope is lost! bail */
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+
+  if (resolve_depends(mport, pkg, prefix) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  if (mport_check_preconditions(mport, pkg, MPORT_PRECHECK_INSTALLED|MPORT_PRECHECK_CONFLICTS) != MPORT_OK) 
+    RETURN_CURRENT_ERROR;
     
-    if (prefix != NULL) {
-      /* override the default prefix with the given prefix */
-      free(pkg->prefix);
-      if ((pkg->prefix = strdup(prefix)) == NULL) /* all hope is lost! bail */
-        RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-    }
+  return mport_bundle_read_install_pkg(mport, bundle, pkg);
+}
 
-    if (resolve_depends(mport, pkg, prefix) != MPORT_OK)
-      RETURN_CURRENT_ERROR;
 
-    if (mport_check_preconditions(mport, pkg, MPORT_PRECHECK_INSTALLED|MPORT_PRECHECK_CONFLICTS) != MPORT_OK) 
-      RETURN_CURRENT_ERROR;
-      
-    if (mport_bundle_read_install_pkg(mport, bundle, pkg) != MPORT_OK)
-      RETURN_CURRENT_ERROR;
+/* 
+ * Returns true if pkg can be installed from a stream: nothing in it may run
+ * before the whole bundle has been checked, and it has to be readable front
+ * to back.  If not, the error says why.
+ */
+static int can_stream(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
+{
+  sqlite3_stmt *stmt;
+  int found;
+  
+  if (mport_bundle_read_get_metafile(bundle, pkg, MPORT_INSTALL_FILE, NULL) != NULL ||
+      mport_bundle_read_get_metafile(bundle, pkg, MPORT_MTREE_FILE, NULL) != NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "%s has install scripts; it can't be installed as it downloads.", pkg->name);
+    return 0;
   }
   
-  return MPORT_OK;
+  /* segmented bundles say so in the stub */
+  if (mport_db_prepare(mport->db, &stmt, "SELECT 1 FROM stub.meta WHERE field='bundle_layout' UNION ALL SELECT 1 FROM stub.assets WHERE pkg=%Q AND type=%i", pkg->name, ASSET_EXEC) != MPORT_OK)
+    return 0;
+  
+  found = (sqlite3_step(stmt) != SQLITE_DONE);
+  sqlite3_finalize(stmt);
+  
+  if (found) {
+    SET_ERRORX(MPORT_ERR_FATAL, "%s is segmented or has @exec lines; it can't be installed as it downloads.", pkg->name);
+    return 0;
+  }
+  
+  return 1;
 }
 
 
@@ -137,7 +320,7 @@ static int resolve_depends(mportInstance *mport, mportPackageMeta *pkg, const ch
   char *dname, *dversion, *iversion;
   int step, check;
   
-  if (mport_db_prepare(mport->db, &stmt, "SELECT depend_pkgname, depend_version FROM stub.depends WHERE pkg=%Q", pkg->name) != MPORT_OK)
+  if (mport_db_prepare(mport->db, &stmt, "SELECT depend_pkgname, depend_pkgversion FROM stub.depends WHERE pkg=%Q", pkg->name) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
   if (mport_db_prepare(mport->db, &lookup, "SELECT version FROM packages WHERE pkg=? AND status='clean'") != MPORT_OK)
@@ -162,13 +345,13 @@ static int resolve_depends(mportInstance *mport, mportPackageMeta *pkg, const ch
             /* no minimal version */
             break;
         
-          iversion = (char *)sqlite3_column_text(stmt, 0);
+          iversion = (char *)sqlite3_column_text(lookup, 0);
           
           check = mport_version_require_check(iversion, dversion);
           
           if (check == -1) {
             /* we need to upgrade */
-            if (mport_upgrade(mport, dname) != MPORT_OK)
+            if (upgrade_depend(mport, dname) != MPORT_OK)
               RETURN_CURRENT_ERROR;
           } else if (check > 0) {
             RETURN_CURRENT_ERROR;
@@ -199,3 +382,41 @@ static int resolve_depends(mportInstance *mport, mportPackageMeta *pkg, const ch
   sqlite3_finalize(lookup); sqlite3_finalize(stmt);
   return MPORT_OK;           
 }
+
+
+/* 
+ * Bring an installed depend up to the index's version.  Installs from the
+ * index are planned up front, so this is only for bundle files, and indexes
+ * that don't list depends.
+ */
+static int upgrade_depend(mportInstance *mport, const char *pkgname)
+{
+  mportIndexEntry **e;
+  char *filename;
+  int ret;
+  
+  if (mport_index_lookup_pkgname(mport, pkgname, &e) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (e[0] == NULL || e[1] != NULL) {
+    mport_index_entry_free_vec(e);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Could not resolve '%s' to a single package.", pkgname);
+  }
+  
+  if (mport_fetch_bundle(mport, e[0]->bundlefile) != MPORT_OK) {
+    mport_index_entry_free_vec(e);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  (void)asprintf(&filename, "%s/%s", MPORT_FETCH_STAGING_DIR, e[0]->bundlefile);
+  mport_index_entry_free_vec(e);
+  
+  if (filename == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  ret = mport_update_primative(mport, filename);
+  
+  free(filename);
+  
+  return ret;
+}
@@ -33,15 +33,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+static int install_bundle(mportInstance *, const char *, const char *);
+
 MPORT_PUBLIC_API int mport_install_primative(mportInstance *mport, const char *filename, const char *prefix) 
+{
+  /* triggers from every package in the bundle run once, at the end */
+  if (mport_batch_begin(mport) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return mport_batch_finish(mport, install_bundle(mport, filename, prefix));
+}
+
+
+static int install_bundle(mportInstance *mport, const char *filename, const char *prefix) 
 {
   mportBundleRead *bundle;
   mportPackageMeta **pkgs, *pkg;
   int i;
   
+  /* clean up after any install that died part way through */
+  if (mport_recover(mport) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
   if ((bundle = mport_bundle_read_new()) == NULL)
     RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
   
+  bundle->threads = mport->bundle_threads;
+  
   if (mport_bundle_read_init(bundle, filename) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
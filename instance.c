@@ -31,6 +31,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -50,6 +52,21 @@ MPORT_PUBLIC_API int mport_instance_init(mportInstance *mport, const char *root)
   char dir[FILENAME_MAX];
 
   mport->flags = 0;
+  mport->rootfd = -1;
+  mport->mtree_cache = NULL;
+  mport->triggers = NULL;
+  mport->finished_journals = NULL;
+  mport->mirror_stats = NULL;
+  mport->stmt_cache = NULL;
+  mport->fetch_jobs = MPORT_PREFETCH_JOBS;
+  mport->fetch_max_staged = MPORT_PREFETCH_MAX_STAGED;
+  mport->fetch_hedge_percentile = MPORT_HEDGE_PERCENTILE;
+  mport->bundle_threads = 0;
+  mport->cache_max_size = MPORT_CACHE_MAX_SIZE;
+  mport->cache_max_age = MPORT_CACHE_MAX_AGE;
+  
+  if ((mport->cache_dir = strdup(MPORT_CACHE_DIR)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
   
   if (root != NULL) {
     mport->root = strdup(root);
@@ -64,9 +81,18 @@ MPORT_PUBLIC_API int mport_instance_init(mportInstance *mport, const char *root)
   
   (void)snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_INST_INFRA_DIR);
   
+  if (mport_mkdir(dir) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  (void)snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_JOURNAL_DIR);
+  
   if (mport_mkdir(dir) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
+  /* files are installed relative to this, never to the cwd */
+  if ((mport->rootfd = open(*(mport->root) == '\0' ? "/" : mport->root, O_RDONLY|O_DIRECTORY)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", mport->root, strerror(errno));
+
   /* dir is a file here, just trying to save memory */
   (void)snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_MASTER_DB_FILE);
   if (sqlite3_open(dir, &(mport->db)) != 0) {
@@ -89,6 +115,9 @@ MPORT_PUBLIC_API int mport_instance_init(mportInstance *mport, const char *root)
   
   
 
+  if (mport_mirror_stats_new(mport) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
   /* create tables */
   return mport_generate_master_schema(mport->db);
 }
@@ -122,6 +151,75 @@ MPORT_PUBLIC_API void mport_set_confirm_cb(mportInstance *mport, mport_confirm_c
 }
 
 
+/* How many bundles to download at once, and how many bytes of them may sit
+ * in the staging dir waiting for the installer.  A single bundle bigger than
+ * the cap is still fetched, once the installer has caught up. */
+MPORT_PUBLIC_API void mport_set_fetch_jobs(mportInstance *mport, int jobs)
+{
+  mport->fetch_jobs = jobs < 1 ? 1 : jobs;
+}
+
+MPORT_PUBLIC_API void mport_set_fetch_max_staged(mportInstance *mport, off_t bytes)
+{
+  mport->fetch_max_staged = bytes;
+}
+
+/* A fetch that goes this percentile of recent connect times without a byte
+ * is also asked of the next mirror, and the first to finish wins.  0 turns
+ * that off.  The loser can only be stopped by libfetch timing it out, so
+ * unless the program has set libfetch's fetchTimeout itself, the first
+ * hedged fetch sets it to MPORT_HEDGE_FETCH_TIMEOUT seconds.  That is
+ * global to the process and stays set, since a loser can outlive the fetch
+ * that started it; set fetchTimeout first to choose another. */
+MPORT_PUBLIC_API void mport_set_fetch_hedge_percentile(mportInstance *mport, int percentile)
+{
+  mport->fetch_hedge_percentile = percentile < 0 ? 0 : (percentile > 100 ? 100 : percentile);
+}
+
+/* How many threads decode each bzip2 bundle this instance reads.  0, the
+ * default, is one per cpu, up to MPORT_BZIP2_MT_MAX_THREADS; 1 decodes
+ * on the calling thread. */
+MPORT_PUBLIC_API void mport_set_bundle_threads(mportInstance *mport, int threads)
+{
+  mport->bundle_threads = threads < 0 ? 0 : threads;
+}
+
+
+/* Where the download cache lives; it's a host path, not under the root, so
+ * that several roots can share it.  NULL turns the cache off. */
+MPORT_PUBLIC_API int mport_set_cache_dir(mportInstance *mport, const char *dir)
+{
+  char *copy = NULL;
+  
+  if (dir != NULL && (copy = strdup(dir)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  free(mport->cache_dir);
+  mport->cache_dir = copy;
+  
+  return MPORT_OK;
+}
+
+/* How big and how old (in seconds) the download cache may get; 0 for no
+ * limit. */
+MPORT_PUBLIC_API void mport_set_cache_limits(mportInstance *mport, off_t max_size, time_t max_age)
+{
+  mport->cache_max_size = max_size;
+  mport->cache_max_age  = max_age;
+}
+
+
+/* Install bundles from the index as they download, instead of staging each
+ * one first; for machines with more bandwidth than disk.  See install.c. */
+MPORT_PUBLIC_API void mport_set_stream_install(mportInstance *mport, int on)
+{
+  if (on)
+    mport->flags |= MPORT_INST_STREAM_INSTALL;
+  else
+    mport->flags &= ~MPORT_INST_STREAM_INSTALL;
+}
+
+
 /* callers for the callbacks (only for msg at the moment) */
 void mport_call_msg_cb(mportInstance *mport, const char *fmt, ...)
 {
@@ -162,10 +260,26 @@ void mport_call_progress_init_cb(mportInstance *mport, const char *fmt, ...)
 
 MPORT_PUBLIC_API int mport_instance_free(mportInstance *mport) 
 {
+  /* installs that finished in a transaction the caller has since ended */
+  (void)mport_journal_settle(mport);
+  
+  /* sqlite won't close with statements still open */
+  mport_stmt_cache_free(mport->stmt_cache);
+  mport->stmt_cache = NULL;
+  
   if (sqlite3_close(mport->db) != SQLITE_OK) {
     RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
   }
   
+  if (mport->rootfd != -1)
+    (void)close(mport->rootfd);
+  
+  mport_mtree_cache_free(mport->mtree_cache);
+  mport_trigger_set_free(mport->triggers);
+  mport_journal_set_free(mport->finished_journals);
+  mport_mirror_stats_free(mport->mirror_stats);
+  free(mport->cache_dir);
+  
   free(mport->root);  
   free(mport);
   return MPORT_OK;
@@ -0,0 +1,785 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* The install journal.
+ *
+ * A package's files are extracted under staged names (.~mport.<name>, in the
+ * file's own directory) and renamed into place in batches: once before each
+ * @exec, and once at the end.  The journal, one per package being installed
+ * under MPORT_JOURNAL_DIR, has a line for each directory files are staged in,
+ * on disk before the first of them is
+ *
+ *   D usr/local/bin
+ *
+ * a line for each file
+ *
+ *   S usr/local/bin/foo
+ *
+ * and an F line before each batch of renames.  The S lines only have to be on
+ * disk by the F that renames them, so a package costs one sync per directory
+ * and per batch rather than one per file; a staged name whose S line was lost
+ * in a crash is still found, by looking through the D directories.  A file
+ * that would be renamed over is hardlinked to a backup name
+ * (.~mport-old.<name>) first, and gets a
+ *
+ *   B usr/local/bin/foo
+ *
+ * line ahead of the batch's F.  So rolling back only has to touch the files 
+ * listed: a staged name that still exists is unlinked, for files listed 
+ * before the last F (renamed, or about to be) the real name is unlinked too,
+ * then any backups are renamed back over them, and then anything else with a
+ * staged name in a D directory is unlinked.
+ *
+ * After a crash the master database decides: if the package made it in clean,
+ * mport_recover() finishes the renames and drops the backups, otherwise it 
+ * rolls the files back and drops whatever dirty rows are left.  The journal
+ * is only removed once the package is in a committed transaction.  One
+ * finished inside a caller's transaction is remembered on the instance, and
+ * settled the same way as after a crash by mport_journal_settle() once the
+ * transaction is over: at the end of the outermost batch, at the next
+ * install, or when the instance is freed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mport.h"
+#include "mport_private.h"
+
+#define STAGE_PREFIX  ".~mport."
+#define BACKUP_PREFIX ".~mport-old."
+
+struct _InstallJournal {
+  mportInstance *mport;
+  char *filename;
+  FILE *fp;
+  char **paths;     /* root relative, no leading / */
+  char *backed;     /* backed[i] if paths[i] was renamed over a file we kept */
+  int npaths;
+  int allocated;
+  int renamed;      /* paths[0 .. renamed-1] have been renamed into place */
+  char **dirs;      /* every directory with a D line */
+  int ndirs;
+  int dirs_allocated;
+};
+
+/* journals finished inside a transaction that hadn't committed */
+struct _FinishedJournals {
+  char **pkgs;
+  int n;
+  int allocated;
+};
+
+static int stage_name(const char *, char *, size_t);
+static int backup_name(const char *, char *, size_t);
+static int prefix_name(const char *, const char *, char *, size_t);
+static int write_record(mportJournal *, char, const char *);
+static int note_dir(mportJournal *, const char *);
+static void sweep_dir(mportInstance *, const char *);
+static int root_path(const char *, const char *, char *, size_t);
+static int undo_file(mportInstance *, const char *, int);
+static void restore_file(mportInstance *, const char *);
+static void drop_backup(mportInstance *, const char *);
+static int recover_pkg(mportInstance *, const char *, int);
+static int remember_finished(mportInstance *, const char *);
+static void free_journal(mportJournal *);
+
+
+/*
+ * mport_journal_open(mport, pkgname, &journal)
+ *
+ * start the journal for installing pkgname.
+ */
+int mport_journal_open(mportInstance *mport, const char *pkgname, mportJournal **journalp)
+{
+  mportJournal *journal;
+  
+  if ((journal = (mportJournal *)calloc(1, sizeof(mportJournal))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  journal->mport = mport;
+  
+  if (asprintf(&journal->filename, "%s%s/%s", mport->root, MPORT_JOURNAL_DIR, pkgname) == -1) {
+    free(journal);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  if ((journal->fp = fopen(journal->filename, "w")) == NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", journal->filename, strerror(errno));
+    free_journal(journal);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  *journalp = journal;
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_journal_stage(journal, cwd, file, staged, len)
+ *
+ * record that file (relative to cwd, which is absolute in the instance root)
+ * is about to be extracted, and put the name to extract it as, also relative
+ * to cwd, in staged.
+ */
+int mport_journal_stage(mportJournal *journal, const char *cwd, const char *file, char *staged, size_t len)
+{
+  char path[FILENAME_MAX];
+  char **paths;
+  char *backed;
+  
+  if (root_path(cwd, file, path, sizeof(path)) != MPORT_OK || stage_name(file, staged, len) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (journal->npaths == journal->allocated) {
+    journal->allocated = journal->allocated == 0 ? 64 : journal->allocated * 2;
+    
+    if ((paths = (char **)realloc(journal->paths, journal->allocated * sizeof(char *))) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    
+    journal->paths = paths;
+    
+    if ((backed = (char *)realloc(journal->backed, journal->allocated)) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    
+    journal->backed = backed;
+  }
+  
+  if ((journal->paths[journal->npaths] = strdup(path)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  journal->backed[journal->npaths] = 0;
+  journal->npaths++;
+  
+  /* a staged file in a directory the journal doesn't know about would
+   * outlive a crash; the S line can wait for the next F */
+  if (note_dir(journal, path) != MPORT_OK || write_record(journal, 'S', path) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_journal_link_target(journal, cwd, target, buf, len)
+ *
+ * hardlink targets in a bundle are relative to the cwd they were packed in.
+ * If target hasn't been renamed into place yet, put its staged name in buf,
+ * otherwise target itself.
+ */
+int mport_journal_link_target(mportJournal *journal, const char *cwd, const char *target, char *buf, size_t len)
+{
+  char path[FILENAME_MAX];
+  int i;
+  
+  if (root_path(cwd, target, path, sizeof(path)) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  for (i = journal->renamed; i < journal->npaths; i++) {
+    if (strcmp(journal->paths[i], path) == 0)
+      return stage_name(target, buf, len);
+  }
+  
+  if (strlcpy(buf, target, len) >= len)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: path too long", target);
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_journal_commit(journal)
+ *
+ * rename every file staged since the last commit into place, keeping a link
+ * to any file that is renamed over.  The files must all be on disk, so drain
+ * the extract pool first.
+ */
+int mport_journal_commit(mportJournal *journal)
+{
+  char staged[FILENAME_MAX], backup[FILENAME_MAX];
+  int rootfd = journal->mport->rootfd;
+  int i;
+  
+  if (journal->renamed == journal->npaths)
+    return MPORT_OK;
+  
+  for (i = journal->renamed; i < journal->npaths; i++) {
+    if (backup_name(journal->paths[i], backup, sizeof(backup)) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    /* one left over from a crash would make linkat fail */
+    if (unlinkat(rootfd, backup, 0) != 0 && errno != ENOENT)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s%s: %s", journal->mport->root, backup, strerror(errno));
+    
+    if (linkat(rootfd, journal->paths[i], rootfd, backup, 0) != 0) {
+      if (errno == ENOENT)
+        continue;
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't link %s%s: %s", journal->mport->root, journal->paths[i], strerror(errno));
+    }
+    
+    journal->backed[i] = 1;
+    
+    if (write_record(journal, 'B', journal->paths[i]) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  if (fprintf(journal->fp, "F\n") < 0 || fflush(journal->fp) != 0 || fsync(fileno(journal->fp)) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", journal->filename, strerror(errno));
+  
+  for (i = journal->renamed; i < journal->npaths; i++) {
+    if (stage_name(journal->paths[i], staged, sizeof(staged)) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    if (renameat(rootfd, staged, rootfd, journal->paths[i]) != 0) 
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't rename %s%s: %s", journal->mport->root, staged, strerror(errno));
+    
+    /* if we fail part way, rolling back undoes this one too */
+    journal->renamed = i + 1;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_journal_finish(journal)
+ *
+ * the install went through and the database has it; forget the journal and
+ * the files it replaced.  If the database change is part of a transaction 
+ * that hasn't committed yet, that can't be known until it's over, so the
+ * journal is kept, and remembered for mport_journal_settle().
+ */
+int mport_journal_finish(mportJournal *journal)
+{
+  const char *pkgname;
+  int i;
+  
+  if (!sqlite3_get_autocommit(journal->mport->db)) {
+    pkgname = strrchr(journal->filename, '/') + 1;
+    
+    /* if we can't remember it, mport_recover() still finds it */
+    (void)remember_finished(journal->mport, pkgname);
+    
+    free_journal(journal);
+    return MPORT_OK;
+  }
+  
+  /* the backups go first; one the journal doesn't list would be leaked */
+  for (i = 0; i < journal->npaths; i++) {
+    if (journal->backed[i])
+      drop_backup(journal->mport, journal->paths[i]);
+  }
+  
+  if (fclose(journal->fp) != 0) {
+    journal->fp = NULL;
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", journal->filename, strerror(errno));
+    free_journal(journal);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  journal->fp = NULL;
+  
+  if (unlink(journal->filename) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", journal->filename, strerror(errno));
+    free_journal(journal);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  free_journal(journal);
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_journal_rollback(journal)
+ *
+ * remove every file this install has put down, staged or renamed, put back
+ * the files it replaced, and remove the journal itself.  Doesn't touch the
+ * error state, since we're usually here because of an error.
+ */
+void mport_journal_rollback(mportJournal *journal)
+{
+  int i;
+  
+  if (journal == NULL)
+    return;
+  
+  for (i = 0; i < journal->npaths; i++) 
+    (void)undo_file(journal->mport, journal->paths[i], i < journal->renamed);
+  
+  for (i = 0; i < journal->npaths; i++) {
+    if (journal->backed[i])
+      restore_file(journal->mport, journal->paths[i]);
+  }
+  
+  if (journal->fp != NULL)
+    (void)fclose(journal->fp);
+  journal->fp = NULL;
+  
+  (void)unlink(journal->filename);
+  
+  free_journal(journal);
+}
+
+
+/*
+ * mport_journal_settle(mport)
+ *
+ * once the transaction that installs finished in is over, drop their
+ * journals and backups if it committed, or roll their files back if it
+ * didn't.  Does nothing while a transaction is still open.
+ */
+int mport_journal_settle(mportInstance *mport)
+{
+  struct _FinishedJournals *fin = mport->finished_journals;
+  int i, only_clean;
+  
+  if (fin == NULL || !sqlite3_get_autocommit(mport->db))
+    return MPORT_OK;
+  
+  /* clean first, as in mport_recover() */
+  for (only_clean = 1; only_clean >= 0; only_clean--) {
+    for (i = 0; i < fin->n; i++) {
+      if (recover_pkg(mport, fin->pkgs[i], only_clean) != MPORT_OK)
+        RETURN_CURRENT_ERROR;
+    }
+  }
+  
+  mport_journal_set_free(fin);
+  mport->finished_journals = NULL;
+  
+  return MPORT_OK;
+}
+
+
+void mport_journal_set_free(struct _FinishedJournals *fin)
+{
+  int i;
+  
+  if (fin == NULL)
+    return;
+  
+  for (i = 0; i < fin->n; i++)
+    free(fin->pkgs[i]);
+  
+  free(fin->pkgs);
+  free(fin);
+}
+
+
+/*
+ * mport_recover(mport)
+ *
+ * finish or roll back any installs that were interrupted.  Each takes time 
+ * proportional to the number of files it had put down.
+ */
+MPORT_PUBLIC_API int mport_recover(mportInstance *mport)
+{
+  char dir[FILENAME_MAX];
+  struct dirent *de;
+  DIR *dirp;
+  int only_clean;
+  
+  /* a journal left by an install in this transaction isn't ours to judge yet */
+  if (!sqlite3_get_autocommit(mport->db))
+    return MPORT_OK;
+  
+  (void)snprintf(dir, sizeof(dir), "%s%s", mport->root, MPORT_JOURNAL_DIR);
+  
+  if ((dirp = opendir(dir)) == NULL) {
+    if (errno == ENOENT)
+      return MPORT_OK;
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", dir, strerror(errno));
+  }
+  
+  /* the scan takes in any journals waiting on mport_journal_settle() */
+  mport_journal_set_free(mport->finished_journals);
+  mport->finished_journals = NULL;
+  
+  /* the clean ones go first, so a rollback sweeping a directory they share
+   * can't take a staged file they have yet to rename */
+  for (only_clean = 1; only_clean >= 0; only_clean--) {
+    rewinddir(dirp);
+    
+    while ((de = readdir(dirp)) != NULL) {
+      if (de->d_name[0] == '.')
+        continue;
+      
+      if (recover_pkg(mport, de->d_name, only_clean) != MPORT_OK) {
+        (void)closedir(dirp);
+        RETURN_CURRENT_ERROR;
+      }
+    }
+  }
+  
+  (void)closedir(dirp);
+  
+  return MPORT_OK;
+}
+
+
+/* finish or roll back pkgname's install; if only_clean, leave it alone
+ * unless it's to be finished */
+static int recover_pkg(mportInstance *mport, const char *pkgname, int only_clean)
+{
+  char journal[FILENAME_MAX], line[FILENAME_MAX + 3], staged[FILENAME_MAX];
+  sqlite3_stmt *stmt;
+  const char *status;
+  char *path;
+  int clean = 0, dirs_seen = 0;
+  long pos, flushed = 0;
+  FILE *fp;
+  
+  if (mport_db_prepare(mport->db, &stmt, "SELECT status FROM packages WHERE pkg=%Q", pkgname) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  switch (sqlite3_step(stmt)) {
+    case SQLITE_ROW:
+      status = (const char *)sqlite3_column_text(stmt, 0);
+      clean  = (status != NULL && strcmp(status, "clean") == 0);
+      break;
+    case SQLITE_DONE:
+      break;
+    default:
+      SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+      sqlite3_finalize(stmt);
+      RETURN_CURRENT_ERROR;
+  }
+  
+  sqlite3_finalize(stmt);
+  
+  if (only_clean && !clean)
+    return MPORT_OK;
+  
+  (void)snprintf(journal, sizeof(journal), "%s%s/%s", mport->root, MPORT_JOURNAL_DIR, pkgname);
+  
+  if ((fp = fopen(journal, "r")) == NULL) {
+    /* finished on the clean pass */
+    if (errno == ENOENT)
+      return MPORT_OK;
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", journal, strerror(errno));
+  }
+  
+  /* everything before the last F was renamed, or was about to be */
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == 'F')
+      flushed = ftell(fp);
+  }
+  
+  rewind(fp);
+  
+  while (pos = ftell(fp), fgets(line, sizeof(line), fp) != NULL) {
+    /* a torn last line is skipped; the D sweep catches its file */
+    if ((line[0] != 'S' && line[0] != 'B' && line[0] != 'D') || line[1] != ' ' || (path = strchr(line, '\n')) == NULL)
+      continue;
+    
+    *path = '\0';
+    path  = line + 2;
+    
+    /* a batch's B lines come after its S lines, so the files they're
+     * restored over have already been undone */
+    if (line[0] == 'D') {
+      if (!clean)
+        dirs_seen = 1;
+    } else if (line[0] == 'B') {
+      if (clean)
+        drop_backup(mport, path);
+      else
+        restore_file(mport, path);
+    } else if (clean) {
+      if (stage_name(path, staged, sizeof(staged)) != MPORT_OK)
+        break;
+      if (renameat(mport->rootfd, staged, mport->rootfd, path) != 0 && errno != ENOENT)
+        break;
+    } else {
+      (void)undo_file(mport, path, pos < flushed);
+    }
+  }
+  
+  if (ferror(fp) || !feof(fp)) {
+    (void)fclose(fp);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't recover %s from %s: %s", pkgname, journal, strerror(errno));
+  }
+  
+  /* the staged names every other line has missed */
+  if (dirs_seen) {
+    rewind(fp);
+    
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (line[0] != 'D' || line[1] != ' ' || (path = strchr(line, '\n')) == NULL)
+        continue;
+      *path = '\0';
+      sweep_dir(mport, line + 2);
+    }
+  }
+  
+  (void)fclose(fp);
+  
+  if (!clean) {
+    if (mport_db_do(mport->db, "DELETE FROM assets WHERE pkg=%Q", pkgname) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    if (mport_db_do(mport->db, "DELETE FROM depends WHERE pkg=%Q", pkgname) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    if (mport_db_do(mport->db, "DELETE FROM categories WHERE pkg=%Q", pkgname) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    if (mport_db_do(mport->db, "DELETE FROM packages WHERE pkg=%Q", pkgname) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  if (unlink(journal) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", journal, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static int remember_finished(mportInstance *mport, const char *pkgname)
+{
+  struct _FinishedJournals *fin = mport->finished_journals;
+  char **pkgs;
+  
+  if (fin == NULL) {
+    if ((fin = (struct _FinishedJournals *)calloc(1, sizeof(struct _FinishedJournals))) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    mport->finished_journals = fin;
+  }
+  
+  if (fin->n == fin->allocated) {
+    fin->allocated = fin->allocated == 0 ? 8 : fin->allocated * 2;
+    
+    if ((pkgs = (char **)realloc(fin->pkgs, fin->allocated * sizeof(char *))) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    
+    fin->pkgs = pkgs;
+  }
+  
+  if ((fin->pkgs[fin->n] = strdup(pkgname)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  fin->n++;
+  
+  return MPORT_OK;
+}
+
+
+/* remove the staged copy of path, and if it may have been renamed, path itself */
+static int undo_file(mportInstance *mport, const char *path, int renamed)
+{
+  char staged[FILENAME_MAX];
+  
+  if (stage_name(path, staged, sizeof(staged)) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (unlinkat(mport->rootfd, staged, 0) == 0 || errno != ENOENT)
+    return MPORT_OK;
+  
+  if (renamed)
+    (void)unlinkat(mport->rootfd, path, 0);
+  
+  return MPORT_OK;
+}
+
+
+/* put the file path was renamed over back */
+static void restore_file(mportInstance *mport, const char *path)
+{
+  char backup[FILENAME_MAX];
+  
+  if (backup_name(path, backup, sizeof(backup)) == MPORT_OK)
+    (void)renameat(mport->rootfd, backup, mport->rootfd, path);
+}
+
+
+static void drop_backup(mportInstance *mport, const char *path)
+{
+  char backup[FILENAME_MAX];
+  
+  if (backup_name(path, backup, sizeof(backup)) == MPORT_OK)
+    (void)unlinkat(mport->rootfd, backup, 0);
+}
+
+
+/* a line in the journal; the caller decides when it has to hit the disk */
+static int write_record(mportJournal *journal, char type, const char *path)
+{
+  if (fprintf(journal->fp, "%c %s\n", type, path) < 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", journal->filename, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+/* the first file staged in path's directory gets it a D line, synced before
+ * the file is extracted */
+static int note_dir(mportJournal *journal, const char *path)
+{
+  const char *slash;
+  char dir[FILENAME_MAX];
+  char **dirs;
+  int i;
+  
+  if ((slash = strrchr(path, '/')) == NULL)
+    (void)strlcpy(dir, ".", sizeof(dir));
+  else
+    (void)snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+  
+  /* a bundle lists a directory's files together, so look from the end */
+  for (i = journal->ndirs - 1; i >= 0; i--) {
+    if (strcmp(journal->dirs[i], dir) == 0)
+      return MPORT_OK;
+  }
+  
+  if (journal->ndirs == journal->dirs_allocated) {
+    journal->dirs_allocated = journal->dirs_allocated == 0 ? 16 : journal->dirs_allocated * 2;
+    
+    if ((dirs = (char **)realloc(journal->dirs, journal->dirs_allocated * sizeof(char *))) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    
+    journal->dirs = dirs;
+  }
+  
+  if ((journal->dirs[journal->ndirs] = strdup(dir)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  journal->ndirs++;
+  
+  if (write_record(journal, 'D', dir) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (fflush(journal->fp) != 0 || fsync(fileno(journal->fp)) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", journal->filename, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+/* unlink every staged name left in dir.  Only for rolling back: a staged
+ * name there can only be from an install that never finished. */
+static void sweep_dir(mportInstance *mport, const char *dir)
+{
+  struct dirent *de;
+  DIR *dirp;
+  int fd;
+  
+  if ((fd = openat(mport->rootfd, dir, O_RDONLY|O_DIRECTORY)) == -1)
+    return;
+  
+  if ((dirp = fdopendir(fd)) == NULL) {
+    (void)close(fd);
+    return;
+  }
+  
+  while ((de = readdir(dirp)) != NULL) {
+    if (strncmp(de->d_name, STAGE_PREFIX, sizeof(STAGE_PREFIX) - 1) == 0)
+      (void)unlinkat(fd, de->d_name, 0);
+  }
+  
+  (void)closedir(dirp);
+}
+
+
+/* dir/name becomes dir/.~mport.name */
+static int stage_name(const char *path, char *buf, size_t len)
+{
+  return prefix_name(path, STAGE_PREFIX, buf, len);
+}
+
+
+/* dir/name becomes dir/.~mport-old.name */
+static int backup_name(const char *path, char *buf, size_t len)
+{
+  return prefix_name(path, BACKUP_PREFIX, buf, len);
+}
+
+
+static int prefix_name(const char *path, const char *prefix, char *buf, size_t len)
+{
+  const char *base;
+  int n;
+  
+  if ((base = strrchr(path, '/')) == NULL)
+    base = path;
+  else 
+    base++;
+  
+  n = snprintf(buf, len, "%.*s%s%s", (int)(base - path), path, prefix, base);
+  
+  if (n < 0 || (size_t)n >= len)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: path too long", path);
+  
+  return MPORT_OK;
+}
+
+
+/* cwd/file, relative to the instance root */
+static int root_path(const char *cwd, const char *file, char *buf, size_t len)
+{
+  int n;
+  
+  while (*cwd == '/')
+    cwd++;
+  
+  if (*cwd == '\0')
+    n = snprintf(buf, len, "%s", file);
+  else
+    n = snprintf(buf, len, "%s/%s", cwd, file);
+  
+  if (n < 0 || (size_t)n >= len)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s/%s: path too long", cwd, file);
+  
+  return MPORT_OK;
+}
+
+
+static void free_journal(mportJournal *journal)
+{
+  int i;
+  
+  if (journal->fp != NULL)
+    (void)fclose(journal->fp);
+  
+  for (i = 0; i < journal->npaths; i++)
+    free(journal->paths[i]);
+  
+  for (i = 0; i < journal->ndirs; i++)
+    free(journal->dirs[i]);
+  
+  free(journal->paths);
+  free(journal->backed);
+  free(journal->dirs);
+  free(journal->filename);
+  free(journal);
+}
@@ -47,7 +47,7 @@ struct table_entry {
 
 #define TABLE_SIZE 128
 
-static int build_stub_db(sqlite3 **, const char *, const char *, const char **, struct table_entry **); 
+static int build_stub_db(sqlite3 **, const char *, const char *, const char **, struct table_entry **, mportCompression, int); 
 static int archive_metafiles(mportBundleWrite *, sqlite3 *, struct table_entry **);
 static int archive_package_files(mportBundleWrite *, sqlite3 *, struct table_entry **);
 static int extract_stub_db(const char *, const char *);
@@ -60,14 +60,16 @@ static uint32_t SuperFastHash(const char *);
 #include <err.h>
 
 /*
- * mport_merge_primative(filenames, outfile)
+ * mport_merge_primative(filenames, outfile, compression, level, flags)
  *
  * Takes a list of bundle filenames and an output filename.  This function will create
  * a new bundle file containing all the packages un the different input bundle files,
  * named `outfile`.  Care is taken to not have duplicates, to ensure that the exterior
  * depends are correct, and that the packages are in an optimal order for installation.
+ * The new bundle is compressed with `compression` at `level` (0 for the default),
+ * and is segmented if flags has MPORT_BUNDLE_SEGMENTED.
  */ 
-MPORT_PUBLIC_API int mport_merge_primative(const char **filenames, const char *outfile)
+MPORT_PUBLIC_API int mport_merge_primative(const char **filenames, const char *outfile, mportCompression compression, int level, int flags)
 {
   sqlite3 *db;
   mportBundleWrite *bundle;
@@ -88,7 +90,7 @@ MPORT_PUBLIC_API int mport_merge_primative(const char **filenames, const char *o
   DIAG("Building stub")
 
   /* this function merges the stub databases into one db. */      
-  if (build_stub_db(&db, tmpdir, dbfile, filenames, table) != MPORT_OK)
+  if (build_stub_db(&db, tmpdir, dbfile, filenames, table, compression, flags) != MPORT_OK)
     RETURN_CURRENT_ERROR;
   
   DIAG("Stub complete: %s", dbfile)
@@ -96,7 +98,7 @@ MPORT_PUBLIC_API int mport_merge_primative(const char **filenames, const char *o
   /* set up the bundle, and add our new stub database to it. */
   if ((bundle = mport_bundle_write_new()) == NULL)
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't alloca bundle struct.");
-  if (mport_bundle_write_init(bundle, outfile) != MPORT_OK)
+  if (mport_bundle_write_init(bundle, outfile, compression, level, flags) != MPORT_OK)
     RETURN_CURRENT_ERROR;
    
   DIAG("Adding %s", dbfile)
@@ -131,7 +133,7 @@ MPORT_PUBLIC_API int mport_merge_primative(const char **filenames, const char *o
  * When this function is done, db points to a readonly sqlite object representing
  * the merged db.
  */
-static int build_stub_db(sqlite3 **db,  const char *tmpdir,  const char *dbfile,  const char **filenames, struct table_entry **table) 
+static int build_stub_db(sqlite3 **db,  const char *tmpdir,  const char *dbfile,  const char **filenames, struct table_entry **table, mportCompression compression, int flags) 
 {
   char *tmpdbfile, *name;
   const char *file     = NULL;
@@ -144,7 +146,7 @@ static int build_stub_db(sqlite3 **db,  const char *tmpdir,  const char *dbfile,
   if (sqlite3_open(dbfile, db) != SQLITE_OK)
     RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(*db));
   
-  if (mport_generate_stub_schema(*db) != MPORT_OK)
+  if (mport_generate_stub_schema(*db, compression, flags) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
   for (file = *filenames; file != NULL; file = *(++filenames)) {
@@ -317,7 +319,7 @@ static int archive_metafiles(mportBundleWrite *bundle, sqlite3 *db, struct table
         goto DONE;
       } 
       
-      if (*(archive_entry_pathname(entry)) != '+')
+      if (entry == NULL || *(archive_entry_pathname(entry)) != '+')
         break;
       
       DIAG("Adding %s", archive_entry_pathname(entry))
@@ -382,7 +384,36 @@ static int archive_package_files(mportBundleWrite *bundle, sqlite3 *db, struct t
       RETURN_CURRENT_ERROR;
     }
     
-    if (mport_bundle_read_skip_metafiles(inbundle) != MPORT_OK) {
+    /* a segment in the right codec can go in as is */
+    if (inbundle->toc != NULL && (bundle->flags & MPORT_BUNDLE_SEGMENTED)) {
+      mportCompression codec;
+      
+      if (mport_bundle_read_segment_compression(inbundle, pkgname, &codec) != MPORT_OK) {
+        mport_bundle_read_finish(NULL, inbundle);
+        sqlite3_finalize(stmt);
+        RETURN_CURRENT_ERROR;
+      }
+      
+      if (codec == bundle->compression) {
+        DIAG("Copying segment: %s", pkgname);
+        
+        if (mport_bundle_write_copy_segment(bundle, inbundle, pkgname) != MPORT_OK) {
+          mport_bundle_read_finish(NULL, inbundle);
+          sqlite3_finalize(stmt);
+          RETURN_CURRENT_ERROR;
+        }
+        
+        mport_bundle_read_finish(NULL, inbundle);
+        continue;
+      }
+    }
+    
+    if (inbundle->toc != NULL) 
+      ret = mport_bundle_read_seek_pkg(inbundle, pkgname);
+    else 
+      ret = mport_bundle_read_skip_metafiles(inbundle);
+      
+    if (ret != MPORT_OK || mport_bundle_write_start_segment(bundle, pkgname) != MPORT_OK) {
       mport_bundle_read_finish(NULL, inbundle);
       sqlite3_finalize(stmt);
       RETURN_CURRENT_ERROR;
@@ -457,7 +488,7 @@ static int extract_stub_db(const char *filename, const char *destfile)
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate read archive struct");
 
   archive_read_support_format_tar(a);
-  archive_read_support_compression_bzip2(a);
+  mport_bundle_read_support_compression(a);
     
   if (archive_read_open_filename(a, filename, 10240) != ARCHIVE_OK) {
     SET_ERRORX(MPORT_ERR_FATAL, "Could not open %s: %s", filename, archive_error_string(a));
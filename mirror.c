@@ -0,0 +1,324 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Mirror health.
+ *
+ * Every fetch from a mirror is timed: how long it took to get a connection,
+ * and how fast the data came.  The samples are folded into the mirror_health
+ * table of master.db as exponentially weighted averages, so older
+ * measurements decay away, and mport_index_get_mirror_list() hands mirrors
+ * back fastest first.  A mirror that failed within the last 
+ * MPORT_MIRROR_COOLDOWN seconds is left out, unless every mirror did.
+ *
+ * Fetches happen on the prefetch and segment threads, which mustn't touch the
+ * database; samples are queued in memory and written by
+ * mport_mirror_flush() on the main thread.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fetch.h>
+#include "mport.h"
+#include "mport_private.h"
+
+struct mirror_sample {
+  char *mirror;
+  int ok;
+  double connect;    /* seconds */
+  double rate;       /* bytes/second; 0 if the transfer was too small to say */
+  struct mirror_sample *next;
+};
+
+struct _MirrorStats {
+  pthread_mutex_t lock;
+  struct mirror_sample *head;
+  double latency[MPORT_HEDGE_HISTORY];  /* recent connect times, for hedging */
+  int nlatency;
+  int nextlatency;
+};
+
+static int cmp_double(const void *, const void *);
+
+/* mport_mirror_stats_new(mport)
+ *
+ * Set up the sample queue.  Called from mport_instance_init().
+ */
+int mport_mirror_stats_new(mportInstance *mport)
+{
+  struct _MirrorStats *stats;
+  
+  if ((stats = (struct _MirrorStats *)calloc(1, sizeof(struct _MirrorStats))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if (pthread_mutex_init(&stats->lock, NULL) != 0) {
+    free(stats);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize mirror stats lock.");
+  }
+  
+  mport->mirror_stats = stats;
+  
+  return MPORT_OK;
+}
+
+
+/* mport_mirror_sample(mport, mirror, ok, connect, bytes, secs)
+ *
+ * Queue a sample for mirror: whether the fetch worked, the seconds it took to
+ * connect, and the bytes moved in secs seconds after that.  Safe to call
+ * from any thread.
+ */
+void mport_mirror_sample(mportInstance *mport, const char *mirror, int ok, double connect, off_t bytes, double secs)
+{
+  struct _MirrorStats *stats = mport->mirror_stats;
+  struct mirror_sample *sample;
+  
+  if (stats == NULL)
+    return;
+  
+  if ((sample = (struct mirror_sample *)calloc(1, sizeof(struct mirror_sample))) == NULL)
+    return;
+  
+  if ((sample->mirror = strdup(mirror)) == NULL) {
+    free(sample);
+    return;
+  }
+  
+  sample->ok      = ok;
+  sample->connect = connect;
+  
+  /* a few KB says more about latency than bandwidth */
+  if (ok && bytes >= MPORT_MIRROR_MIN_SAMPLE && secs > 0)
+    sample->rate = (double)bytes / secs;
+  
+  pthread_mutex_lock(&stats->lock);
+  sample->next = stats->head;
+  stats->head  = sample;
+  
+  if (ok) {
+    stats->latency[stats->nextlatency] = connect;
+    stats->nextlatency = (stats->nextlatency + 1) % MPORT_HEDGE_HISTORY;
+    if (stats->nlatency < MPORT_HEDGE_HISTORY)
+      stats->nlatency++;
+  }
+  
+  pthread_mutex_unlock(&stats->lock);
+}
+
+
+/* mport_mirror_hedge_deadline(mport)
+ *
+ * How long a fetch may go without a byte before it's worth asking another
+ * mirror: the mport->fetch_hedge_percentile'th percentile of recent connect
+ * times, within sane bounds.  Safe to call from any thread.
+ */
+double mport_mirror_hedge_deadline(mportInstance *mport)
+{
+  struct _MirrorStats *stats = mport->mirror_stats;
+  double sorted[MPORT_HEDGE_HISTORY];
+  double deadline;
+  int n, i;
+  
+  if (stats == NULL)
+    return MPORT_HEDGE_DEFAULT_DEADLINE;
+  
+  pthread_mutex_lock(&stats->lock);
+  n = stats->nlatency;
+  memcpy(sorted, stats->latency, n * sizeof(double));
+  pthread_mutex_unlock(&stats->lock);
+  
+  /* too few to say what's slow */
+  if (n < MPORT_HEDGE_MIN_HISTORY)
+    return MPORT_HEDGE_DEFAULT_DEADLINE;
+  
+  qsort(sorted, n, sizeof(double), cmp_double);
+  
+  i = (n * mport->fetch_hedge_percentile + 99) / 100 - 1;
+  if (i < 0)
+    i = 0;
+  if (i >= n)
+    i = n - 1;
+  
+  deadline = sorted[i];
+  
+  if (deadline < MPORT_HEDGE_MIN_DEADLINE)
+    return MPORT_HEDGE_MIN_DEADLINE;
+  if (deadline > MPORT_HEDGE_MAX_DEADLINE)
+    return MPORT_HEDGE_MAX_DEADLINE;
+  
+  return deadline;
+}
+
+
+/* mport_mirror_flush(mport)
+ *
+ * Fold the queued samples into mirror_health.  Main thread only.
+ */
+int mport_mirror_flush(mportInstance *mport)
+{
+  struct _MirrorStats *stats = mport->mirror_stats;
+  struct mirror_sample *sample, *next;
+  int ret = MPORT_OK;
+  
+  if (stats == NULL)
+    return MPORT_OK;
+  
+  pthread_mutex_lock(&stats->lock);
+  sample = stats->head;
+  stats->head = NULL;
+  pthread_mutex_unlock(&stats->lock);
+  
+  for (; sample != NULL; sample = next) {
+    next = sample->next;
+    
+    if (ret == MPORT_OK)
+      ret = mport_db_do(mport->db, "INSERT OR IGNORE INTO mirror_health (mirror) VALUES (%Q)", sample->mirror);
+    
+    if (ret == MPORT_OK && !sample->ok) {
+      ret = mport_db_do(mport->db, 
+        "UPDATE mirror_health SET failures=failures+1, last_failure=%ld, updated=%ld WHERE mirror=%Q",
+        (long)time(NULL), (long)time(NULL), sample->mirror);
+    } else if (ret == MPORT_OK) {
+      ret = mport_db_do(mport->db, 
+        "UPDATE mirror_health SET failures=0, updated=%ld, "
+        "connect_time=CASE WHEN connect_time IS NULL THEN %f ELSE connect_time * (1 - %f) + %f * %f END, "
+        "throughput=CASE WHEN %f = 0 THEN throughput WHEN throughput IS NULL THEN %f ELSE throughput * (1 - %f) + %f * %f END "
+        "WHERE mirror=%Q",
+        (long)time(NULL),
+        sample->connect, MPORT_MIRROR_DECAY, sample->connect, MPORT_MIRROR_DECAY,
+        sample->rate, sample->rate, MPORT_MIRROR_DECAY, sample->rate, MPORT_MIRROR_DECAY,
+        sample->mirror);
+    }
+    
+    free(sample->mirror);
+    free(sample);
+  }
+  
+  return ret;
+}
+
+
+/* mport_mirror_stats_free(stats)
+ *
+ * Throw away any unflushed samples, and the queue.
+ */
+void mport_mirror_stats_free(struct _MirrorStats *stats)
+{
+  struct mirror_sample *sample, *next;
+  
+  if (stats == NULL)
+    return;
+  
+  for (sample = stats->head; sample != NULL; sample = next) {
+    next = sample->next;
+    free(sample->mirror);
+    free(sample);
+  }
+  
+  pthread_mutex_destroy(&stats->lock);
+  free(stats);
+}
+
+
+/* mport_mirror_probe(mport)
+ *
+ * Measure every mirror for the current country, cooling down or not, by
+ * connecting to it and reading the start of its index.  Mirrors we have
+ * never fetched from sort last until they are measured; a front end can 
+ * call this after loading the index to give them a fair chance.
+ */
+MPORT_PUBLIC_API int mport_mirror_probe(mportInstance *mport)
+{
+  char **mirrors;
+  char url[MPORT_URL_MAX];
+  char buffer[BUFSIZ];
+  struct url_stat stat;
+  struct timespec start;
+  FILE *remote;
+  double connect;
+  off_t got;
+  size_t size;
+  int i;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_mirror_probe()");
+  
+  if (mport_index_get_all_mirrors(mport, &mirrors) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  for (i = 0; mirrors[i] != NULL; i++) {
+    (void)snprintf(url, sizeof(url), "%s/%s", mirrors[i], MPORT_INDEX_URL_PATH);
+    
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if ((remote = fetchXGetURL(url, &stat, "p")) == NULL) {
+      mport_mirror_sample(mport, mirrors[i], 0, 0, 0, 0);
+      continue;
+    }
+    
+    connect = mport_mirror_elapsed(&start);
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    for (got = 0; got < MPORT_MIRROR_PROBE_BYTES; got += size) {
+      if ((size = fread(buffer, 1, sizeof(buffer), remote)) == 0)
+        break;
+    }
+    
+    mport_mirror_sample(mport, mirrors[i], !ferror(remote), connect, got, mport_mirror_elapsed(&start));
+    fclose(remote);
+  }
+  
+  mport_free_vec(mirrors);
+  
+  return mport_mirror_flush(mport);
+}
+
+
+/* mport_mirror_elapsed(start)
+ *
+ * Seconds since start, a CLOCK_MONOTONIC time.
+ */
+double mport_mirror_elapsed(const struct timespec *start)
+{
+  struct timespec now;
+  
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  
+  return x < y ? -1 : x > y;
+}
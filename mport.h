@@ -31,6 +31,8 @@
 
 
 #include <sys/cdefs.h>
+#include <sys/types.h>
+#include <time.h>
 #include <archive.h>
 #include <sqlite3.h>
 #include <sys/queue.h>
@@ -44,11 +46,25 @@ typedef int (*mport_confirm_cb)(const char *, const char *, const char *, int);
 
 /* Mport Instance (an installed copy of the mport system) */
 #define MPORT_INST_HAVE_INDEX 1
+#define MPORT_INST_STREAM_INSTALL 2   /* install bundles as they download */
 
 typedef struct {
   int flags;
   sqlite3 *db;
   char *root;
+  int rootfd;
+  struct _MtreeCache *mtree_cache; /* private to mtree.c */
+  struct _TriggerSet *triggers;    /* private to trigger.c */
+  struct _FinishedJournals *finished_journals; /* private to journal.c */
+  struct _MirrorStats *mirror_stats; /* private to mirror.c */
+  struct _StmtCache *stmt_cache;   /* private to db.c */
+  int fetch_jobs;                  /* bundles downloaded at once */
+  off_t fetch_max_staged;          /* bytes downloaded ahead of the installer */
+  int fetch_hedge_percentile;      /* 0 turns off hedged fetches, which set fetchTimeout */
+  int bundle_threads;              /* bzip2 decoder threads per bundle; 0 is one per cpu */
+  char *cache_dir;                 /* shared download cache; NULL for none */
+  off_t cache_max_size;
+  time_t cache_max_age;
   mport_msg_cb msg_cb;
   mport_progress_init_cb progress_init_cb;
   mport_progress_step_cb progress_step_cb;
@@ -65,6 +81,14 @@ void mport_set_progress_init_cb(mportInstance *, mport_progress_init_cb);
 void mport_set_progress_step_cb(mportInstance *, mport_progress_step_cb);
 void mport_set_progress_free_cb(mportInstance *, mport_progress_free_cb);
 void mport_set_confirm_cb(mportInstance *, mport_confirm_cb);
+void mport_set_fetch_jobs(mportInstance *, int);
+void mport_set_fetch_max_staged(mportInstance *, off_t);
+void mport_set_fetch_hedge_percentile(mportInstance *, int);
+void mport_set_bundle_threads(mportInstance *, int);
+int mport_set_cache_dir(mportInstance *, const char *);
+void mport_set_cache_limits(mportInstance *, off_t, time_t);
+void mport_set_stream_install(mportInstance *, int);
+void mport_stmt_cache_stats(mportInstance *, unsigned long *, unsigned long *);
 
 void mport_default_msg_cb(const char *);
 int mport_default_confirm_cb(const char *, const char *, const char *, int);
@@ -78,7 +102,7 @@ enum _AssetListEntryType {
   ASSET_COMMENT, ASSET_IGNORE, ASSET_NAME, ASSET_EXEC, ASSET_UNEXEC,
   ASSET_SRC, ASSET_DISPLY, ASSET_PKGDEP, ASSET_CONFLICTS, ASSET_MTREE,
   ASSET_DIRRM, ASSET_DIRRMTRY, ASSET_IGNORE_INST, ASSET_OPTION, ASSET_ORIGIN,
-  ASSET_DEPORIGIN, ASSET_NOINST, ASSET_DISPLAY
+  ASSET_DEPORIGIN, ASSET_NOINST, ASSET_DISPLAY, ASSET_TRIGGER
 };
 
 typedef enum _AssetListEntryType mportAssetListEntryType;
@@ -134,6 +158,53 @@ int mport_index_load(mportInstance *);
 int mport_index_lookup_pkgname(mportInstance *, const char *, mportIndexEntry ***);
 void mport_index_entry_free_vec(mportIndexEntry **);
 void mport_index_entry_free(mportIndexEntry *);
+int mport_mirror_probe(mportInstance *);
+
+/* the download cache; see cache.c */
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  off_t bytes_saved;     /* served from the cache instead of the network */
+  off_t bytes_fetched;   /* fetched and then cached */
+  off_t size;            /* what's in the cache now */
+  int entries;
+} mportCacheStats;
+
+int mport_cache_stats(mportInstance *, mportCacheStats *);
+int mport_cache_clean(mportInstance *);
+
+/* install plans; see plan.c */
+enum _PlanAction {
+  MPORT_PLAN_INSTALL, MPORT_PLAN_UPGRADE
+};
+
+typedef enum _PlanAction mportPlanAction;
+
+typedef struct {
+  char *pkgname;
+  char *version;
+  char *bundlefile;
+  char *hash;           /* sha256 of the bundle, or NULL if the index has none */
+  char *meta_hash;      /* sha256 of its stub and metafiles, or NULL */
+  mportPlanAction action;
+} mportPlanEntry;
+
+int mport_plan_install(mportInstance *, const char *, mportPlanEntry ***);
+void mport_plan_free_vec(mportPlanEntry **);
+
+/* Bundle compression; bzip2 bundles can be read by every version of mport */
+enum _Compression {
+  MPORT_COMPRESS_BZIP2, MPORT_COMPRESS_XZ, MPORT_COMPRESS_ZSTD
+};
+
+typedef enum _Compression mportCompression;
+
+/* Bundle layout flags.  Segmented bundles compress each package on its own,
+ * so one package can be read without decompressing the others.  RAW_META 
+ * bundles are segmented, and leave the stub and metafiles uncompressed at the 
+ * head of the file so they can be read without starting a decoder. */
+#define MPORT_BUNDLE_SEGMENTED	1
+#define MPORT_BUNDLE_RAW_META	2
 
 /* Package creation */
 
@@ -146,6 +217,9 @@ typedef struct {
   char *pkginstall;
   char *pkgdeinstall;
   char *pkgmessage;
+  mportCompression compression;
+  int compression_level; /* 0 is the codec's default */
+  int bundle_flags;
 } mportCreateExtras;  
 
 mportCreateExtras * mport_createextras_new(void);
@@ -154,11 +228,17 @@ void mport_createextras_free(mportCreateExtras *);
 int mport_create_primative(mportAssetList *, mportPackageMeta *, mportCreateExtras *);
 
 /* Merge primative */
-int mport_merge_primative(const char **, const char *);
+int mport_merge_primative(const char **, const char *, mportCompression, int, int);
 
 /* Package installation */
 int mport_install(mportInstance *, const char *, const char *);
 int mport_install_primative(mportInstance *, const char *, const char *);
+int mport_recover(mportInstance *);
+
+/* Operations spanning many packages; see trigger.c */
+int mport_batch_begin(mportInstance *);
+int mport_batch_end(mportInstance *);
+int mport_trigger_register(mportInstance *, const char *);
 
 /* package updating */
 int mport_update_primative(mportInstance *, const char *);
@@ -40,8 +40,21 @@
 
 #define MPORT_PUBLIC_API 
 
-#define MPORT_BUNDLE_VERSION 1
-#define MPORT_BUNDLE_VERSION_STR "1"
+/* Version 2 bundles may be compressed with something other than bzip2,
+ * named by the bundle_compression field of stub.meta.  Version 3 bundles
+ * may be segmented. */
+#define MPORT_BUNDLE_VERSION 3
+#define MPORT_BUNDLE_VERSION_STR "3"
+
+/* A segmented bundle is a run of independently compressed tar streams, one for 
+ * the stub and metafiles and one per package, followed by a text table of 
+ * contents ("offset length name" lines) and a trailer of MPORT_TOC_MAGIC and
+ * the TOC's offset as a 64 bit big endian int. */
+#define MPORT_TOC_MAGIC		"MPORTTOC"
+#define MPORT_TOC_MAGIC_LEN	8
+#define MPORT_TOC_TRAILER_LEN	16
+#define MPORT_TOC_META		"+META"
+#define MPORT_TOC_MAX_SIZE	(16 * 1024 * 1024)
 
 /* callback syntaxtic sugar */
 void mport_call_msg_cb(mportInstance *, const char *, ...);
@@ -57,13 +70,16 @@ int mport_check_preconditions(mportInstance *, mportPackageMeta *, int);
 
 /* schema */
 int mport_generate_master_schema(sqlite3 *);
-int mport_generate_stub_schema(sqlite3 *);
+int mport_generate_stub_schema(sqlite3 *, mportCompression, int);
 
 /* Various database convience functions */
-int mport_attach_stub_db(sqlite3 *, const char *);
+int mport_attach_stub_db(sqlite3 *, void *, size_t);
 int mport_detach_stub_db(sqlite3 *);
 int mport_db_do(sqlite3 *, const char *, ...);
 int mport_db_prepare(sqlite3 *, sqlite3_stmt **, const char *, ...);
+int mport_db_prepare_cached(mportInstance *, sqlite3_stmt **, const char *, ...);
+void mport_db_release(mportInstance *, sqlite3_stmt *);
+void mport_stmt_cache_free(struct _StmtCache *);
 
 /* pkgmeta */
 int mport_pkgmeta_read_stub(mportInstance *, mportPackageMeta ***);
@@ -74,12 +90,18 @@ int mport_pkgmeta_logevent(mportInstance *, mportPackageMeta *, const char *);
 /* Utils */
 int mport_copy_file(const char *, const char *);
 int mport_rmtree(const char *);
+#define MPORT_RMTREE_THREADS		4
+#define MPORT_RMTREE_MIN_SUBDIRS	4	/* fewer subdirectories aren't worth the threads */
+#define MPORT_COPY_BUFSIZE		(64 * 1024)
 int mport_mkdir(const char *);
 int mport_rmdir(const char *, int);
-int mport_chdir(mportInstance *, const char *);
+int mport_open_rootdir(mportInstance *, const char *, int *);
 int mport_file_exists(const char *);
+int mport_spawn(mportInstance *, const char *const *, const char *const *);
 int mport_xsystem(mportInstance *mport, const char *, ...);
 int mport_run_asset_exec(mportInstance *mport, const char *, const char *, const char *);
+int mport_run_asset_trigger(mportInstance *, const char *, const char *, const char *);
+int mport_shell_in_dir(mportInstance *, const char *, const char *);
 void mport_free_vec(void *);
 
 
@@ -89,36 +111,122 @@ typedef struct {
   struct archive *archive;
   char *filename;
   struct links_table *links;
+  int fd;
+  mportCompression compression;
+  int level;
+  int flags;
+  char *segname;  /* segment being written, for segmented bundles */
+  off_t segstart;
+  struct bundle_toc_entry *toc;
 } mportBundleWrite;
 
+/* a segment of a segmented bundle */
+typedef struct {
+  char *name;  /* a package name, or MPORT_TOC_META */
+  off_t offset;
+  off_t length;
+} mportBundleSegment;
+
+
+/* a +file from a bundle, held in memory.  data is always nul terminated. */
+typedef struct _BundleMetafile {
+  char *name;
+  char *data;
+  size_t len;
+  struct _BundleMetafile *next;
+} mportBundleMetafile;
 
 typedef struct {
   struct archive *archive;
   char *filename;
-  char *tmpdir;
+  void *stub;  /* +CONTENTS.db image, until it is attached */
+  size_t stublen;
+  mportBundleMetafile *metafiles;
   struct archive_entry *firstreal;
+  int fd;
+  mportBundleSegment *toc;  /* NULL unless the bundle is segmented */
+  int nsegments;
+  int segment;      /* the segment archive is reading */
+  int seg_entries;  /* headers read from the current segment */
   short stub_attached;
+  int threads; /* bzip2 decoder threads, set before init. 0 is one per cpu */
+  struct stream_reader *stream;  /* NULL unless it's read off the network */
 } mportBundleRead;
 
 
 mportBundleWrite* mport_bundle_write_new(void);
-int mport_bundle_write_init(mportBundleWrite *, const char *);
+int mport_bundle_write_init(mportBundleWrite *, const char *, mportCompression, int, int);
+const char * mport_compression_name(mportCompression);
+int mport_bundle_write_start_segment(mportBundleWrite *, const char *);
+int mport_bundle_write_copy_segment(mportBundleWrite *, mportBundleRead *, const char *);
 int mport_bundle_write_finish(mportBundleWrite *);
 int mport_bundle_write_add_file(mportBundleWrite *, const char *, const char *);
 int mport_bundle_write_add_entry(mportBundleWrite *, mportBundleRead *, struct archive_entry *);
 
 
 mportBundleRead* mport_bundle_read_new(void);
+void mport_bundle_read_support_compression(struct archive *);
 int mport_bundle_read_init(mportBundleRead *, const char *);
+int mport_bundle_read_init_stream(mportBundleRead *, const char *, FILE *, off_t, const char *, const char *);
+int mport_bundle_read_verify_stream(mportBundleRead *);
 int mport_bundle_read_finish(mportInstance *, mportBundleRead *);
 int mport_bundle_read_prep_for_install(mportInstance *, mportBundleRead *);
-int mport_bundle_read_extract_metafiles(mportBundleRead *, char **);
+int mport_bundle_read_load_metafiles(mportBundleRead *);
+const char * mport_bundle_read_get_metafile(mportBundleRead *, mportPackageMeta *, const char *, size_t *);
 int mport_bundle_read_skip_metafiles(mportBundleRead *);
+int mport_bundle_read_seek_pkg(mportBundleRead *, const char *);
+int mport_bundle_read_segment_compression(mportBundleRead *, const char *, mportCompression *);
 int mport_bundle_read_next_entry(mportBundleRead *, struct archive_entry **);
 int mport_bundle_read_extract_next_file(mportBundleRead *, struct archive_entry *);
 int mport_bundle_read_install_pkg(mportInstance *, mportBundleRead *, mportPackageMeta *);
 int mport_bundle_read_update_pkg(mportInstance *, mportBundleRead *, mportPackageMeta *);
 
+/* parallel extraction of files; see extract_pool.c */
+#define MPORT_EXTRACT_FLAGS		(ARCHIVE_EXTRACT_OWNER|ARCHIVE_EXTRACT_PERM|ARCHIVE_EXTRACT_TIME|ARCHIVE_EXTRACT_ACL|ARCHIVE_EXTRACT_FFLAGS)
+#define MPORT_EXTRACT_THREADS		4
+#define MPORT_EXTRACT_MIN_FILES		32		/* smaller packages aren't worth the threads */
+#define MPORT_EXTRACT_MAX_BUFFER	(1024 * 1024)		/* bigger files are written in order */
+#define MPORT_EXTRACT_MAX_QUEUED	(32 * 1024 * 1024)
+typedef struct _ExtractPool mportExtractPool;
+int mport_extract_pool_new(mportExtractPool **, int);
+int mport_extract_pool_add(mportExtractPool *, mportBundleRead *, int, const char *, struct archive_entry *);
+int mport_extract_pool_barrier(mportExtractPool *);
+void mport_extract_pool_free(mportExtractPool *);
+int mport_extract_supported(struct archive_entry *);
+int mport_extract_at(int, const char *, struct archive_entry *, struct archive *, const char *, size_t);
+void mport_extract_set_owner(mportInstance *, struct archive_entry *);
+
+/* directory creation from mtree specs; see mtree.c */
+int mport_mtree_apply(mportInstance *, const char *, const char *);
+void mport_mtree_cache_free(struct _MtreeCache *);
+int mport_root_uid(mportInstance *, const char *, uid_t *);
+int mport_root_gid(mportInstance *, const char *, gid_t *);
+
+/* deferred @exec commands; see trigger.c */
+int mport_batch_finish(mportInstance *, int);
+int mport_trigger_matches(mportInstance *, const char *);
+int mport_trigger_queue(mportInstance *, const char *, const char *);
+int mport_trigger_mark(mportInstance *);
+void mport_trigger_drop(mportInstance *, int);
+void mport_trigger_set_free(struct _TriggerSet *);
+
+/* staged installs; see journal.c */
+typedef struct _InstallJournal mportJournal;
+int mport_journal_open(mportInstance *, const char *, mportJournal **);
+int mport_journal_stage(mportJournal *, const char *, const char *, char *, size_t);
+int mport_journal_link_target(mportJournal *, const char *, const char *, char *, size_t);
+int mport_journal_commit(mportJournal *);
+int mport_journal_finish(mportJournal *);
+void mport_journal_rollback(mportJournal *);
+int mport_journal_settle(mportInstance *);
+void mport_journal_set_free(struct _FinishedJournals *);
+
+/* parallel bzip2 decoding of bundles */
+#define MPORT_BZIP2_MT_MIN_SIZE		(1024 * 1024)
+#define MPORT_BZIP2_MT_MAX_THREADS	64
+int mport_bundle_read_bzip2_mt_probe(int, off_t, off_t);
+int mport_bundle_read_bzip2_mt_open(struct archive *, int, off_t, off_t, int);
+
 
 /* version compare functions */
 void mport_version_cmp_sqlite(sqlite3_context *, int, sqlite3_value **);
@@ -146,7 +254,10 @@ int mport_set_errx(int , const char *, ...);
 #define MPORT_MASTER_DB_FILE	"/var/db/mport/master.db"
 #define MPORT_INST_INFRA_DIR	"/var/db/mport/infrastructure"
 #define MPORT_INDEX_FILE	"/var/db/mport/index.db"
+#define MPORT_INDEX_MANIFEST	"/var/db/mport/index.gen"
 #define MPORT_FETCH_STAGING_DIR "/var/db/mport/downloads"
+#define MPORT_JOURNAL_DIR	"/var/db/mport/journal"
+#define MPORT_CACHE_DIR		"/var/db/mport/cache"	/* on the host, not in the root */
 
 
 #if defined(__i386__)
@@ -168,25 +279,88 @@ int mport_set_errx(int , const char *, ...);
 #endif
 
 
+/* what the mirrors say the current index is; see index_update.c */
+typedef struct {
+  int generation;
+  char digest[65];
+  off_t size;		/* of index.db.bz2; 0 if the manifest doesn't say */
+} mportIndexManifest;
+
 /* fetch stuff */
 #define MPORT_URL_PATH			MPORT_ARCH "/" MPORT_OSVERSION
 #define MPORT_INDEX_URL_PATH		MPORT_URL_PATH "/index.db.bz2"
 #define MPORT_BOOTSTRAP_INDEX_URL 	"http://index.mport.midnightbsd.org/" MPORT_URL_PATH "/index.db.bz2"
 
-int mport_fetch_index(mportInstance *);
+int mport_fetch_index(mportInstance *, const mportIndexManifest *);
 int mport_fetch_bootstrap_index(mportInstance *);
+int mport_fetch_file(mportInstance *, const char *, const char *);
+int mport_fetch_if_modified(mportInstance *, const char *, const char *, int *);
 int mport_fetch_bundle(mportInstance *, const char *);
+#define MPORT_FETCH_QUIET		0x01	/* no progress callbacks; for fetches off the main thread */
+int mport_fetch_bundle_mirrors(mportInstance *, char **, const char *, int);
+int mport_fetch_bundle_stream(mportInstance *, const char *, FILE **, off_t *);
+const char * mport_fetch_errstr(void);
+
+/* one bundle from several mirrors at once; see segfetch.c */
+#define MPORT_SEGFETCH_MIRRORS		4
+#define MPORT_SEGFETCH_MIN_SIZE		((off_t)8 * 1024 * 1024)	/* smaller bundles come over one connection */
+#define MPORT_SEGFETCH_MIN_SPLIT	((off_t)1024 * 1024)		/* the least a thief takes from a busy segment */
+#define MPORT_SEGFETCH_BUFSIZE		(64 * 1024)
+#define MPORT_SEGFETCH_SETTLE		250			/* ms on a segment before its owner's rate means much */
+int mport_fetch_segmented(mportInstance *, char **, const char *, const char *, int);
+
+/* downloading bundles ahead of the installer; see prefetch.c */
+#define MPORT_PREFETCH_JOBS		4
+#define MPORT_PREFETCH_MAX_STAGED	((off_t)512 * 1024 * 1024)
+typedef struct _Prefetch mportPrefetch;
+int mport_prefetch_new(mportInstance *, mportPlanEntry **, mportPrefetch **);
+int mport_prefetch_wait(mportPrefetch *, int);
+void mport_prefetch_free(mportPrefetch *);
 
 /* a few index things */
 int mport_index_get_mirror_list(mportInstance *, char ***);
+int mport_index_get_all_mirrors(mportInstance *, char ***);
+int mport_index_has_hashes(mportInstance *);
+int mport_index_has_meta_hashes(mportInstance *);
+
+/* keeping the index current; see index_update.c */
+int mport_index_manifest(mportInstance *, mportIndexManifest *);
+int mport_index_update(mportInstance *, mportIndexManifest *, int *);
+int mport_index_verify(const char *, const mportIndexManifest *);
+
+/* mirror health; see mirror.c */
+#define MPORT_MIRROR_DECAY		0.3	/* weight of a new sample */
+#define MPORT_MIRROR_COOLDOWN		600	/* seconds a failed mirror sits out */
+#define MPORT_MIRROR_MIN_SAMPLE		((off_t)64 * 1024)	/* smaller transfers don't count for throughput */
+#define MPORT_MIRROR_PROBE_BYTES	((off_t)256 * 1024)
+struct timespec;
+int mport_mirror_stats_new(mportInstance *);
+void mport_mirror_sample(mportInstance *, const char *, int, double, off_t, double);
+int mport_mirror_flush(mportInstance *);
+void mport_mirror_stats_free(struct _MirrorStats *);
+double mport_mirror_elapsed(const struct timespec *);
+const char * mport_fetch_rate(char *, size_t, off_t, const struct timespec *);
+
+/* asking a second mirror when the first stalls; see fetch.c */
+#define MPORT_HEDGE_PERCENTILE		95
+#define MPORT_HEDGE_HISTORY		128	/* connect times the deadline is drawn from */
+#define MPORT_HEDGE_MIN_HISTORY		16
+#define MPORT_HEDGE_DEFAULT_DEADLINE	3.0	/* seconds, until we've seen enough fetches */
+#define MPORT_HEDGE_MIN_DEADLINE	0.5
+#define MPORT_HEDGE_MAX_DEADLINE	15.0
+#define MPORT_HEDGE_FETCH_TIMEOUT	60	/* seconds a losing attempt may sit in a read */
+double mport_mirror_hedge_deadline(mportInstance *);
+
+/* the shared download cache; see cache.c */
+#define MPORT_CACHE_MAX_SIZE		((off_t)4 * 1024 * 1024 * 1024)
+#define MPORT_CACHE_MAX_AGE		(3600 * 24 * 90)
+int mport_cache_fetch(mportInstance *, char **, const char *, const char *, int);
 
 #define MPORT_CHECK_FOR_INDEX(mport, func) if (!(mport->flags & MPORT_INST_HAVE_INDEX)) RETURN_ERRORX(MPORT_ERR_FATAL, "Attempt to use %s before loading index.", func);
 #define MPORT_MAX_INDEX_AGE 3600 * 24 * 7 /* two weeks */
 
 /* Binaries we use */
-#define MPORT_MTREE_BIN		"/usr/sbin/mtree"
 #define MPORT_SH_BIN		"/bin/sh"
-#define MPORT_CHROOT_BIN	"/usr/sbin/chroot"
 
 #define MPORT_URL_MAX		512
 
@@ -0,0 +1,542 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Directory creation from a package's mtree spec.
+ *
+ * This does what `mtree -U -d -e -p prefix` did for us: create the directories
+ * the spec lists, and give them the owner and mode it asks for.  We only
+ * understand the part of the format that describes directories; files and
+ * the checksum keywords are skipped.
+ *
+ * Directories are remembered for the life of the instance, so a run that
+ * installs many packages sharing the same hierarchy only sets up each
+ * directory once.  A remembered directory is still checked to be there,
+ * since a delete in the same instance may have removed it.  Owner names are looked up in the instance root's own
+ * passwd and group files, as they were when mtree ran chroot'ed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mport.h"
+#include "mport_private.h"
+
+#define CACHE_BUCKETS	1024
+#define MAX_DEPTH	64
+
+struct cache_dir {
+  char *path;
+  struct cache_dir *next;
+};
+
+struct cache_id {
+  char *name;
+  unsigned int id;
+  struct cache_id *next;
+};
+
+struct _MtreeCache {
+  struct cache_dir *dirs[CACHE_BUCKETS];
+  struct cache_id *users;
+  struct cache_id *groups;
+  int ids_loaded;
+};
+
+/* the keywords we care about, as set by /set and overridden per line */
+struct mtree_attrs {
+  int isdir;
+  int has_type, has_mode, has_uid, has_gid;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+};
+
+static int parse_keywords(mportInstance *, char *, struct mtree_attrs *, int);
+static int make_dir(mportInstance *, int, const char *, const char *, struct mtree_attrs *);
+static int cache_lookup(struct _MtreeCache *, const char *, int);
+static unsigned int hash(const char *);
+static int get_cache(mportInstance *, int);
+static int load_ids(mportInstance *, const char *, struct cache_id **);
+static int lookup_id(struct cache_id *, const char *, unsigned int *);
+static void unvis_name(char *);
+static char * next_token(char **);
+
+
+/*
+ * mport_mtree_apply(mport, spec, prefix)
+ *
+ * create the directories in spec (the text of an mtree file) under prefix, 
+ * which is absolute within mport's root.
+ */
+int mport_mtree_apply(mportInstance *mport, const char *spec, const char *prefix)
+{
+  struct mtree_attrs defaults, attrs;
+  char path[FILENAME_MAX];
+  size_t stack[MAX_DEPTH];
+  char *copy, *line, *next, *name, *p;
+  int depth = 0, dirfd = -1;
+  size_t len;
+  
+  if (get_cache(mport, 0) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if ((copy = strdup(spec)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if (mport_open_rootdir(mport, prefix, &dirfd) != MPORT_OK) {
+    free(copy);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  bzero(&defaults, sizeof(defaults));
+  path[0] = '\0';
+  
+  for (line = copy; line != NULL; line = next) {
+    if ((next = strchr(line, '\n')) != NULL)
+      *next++ = '\0';
+    
+    /* a trailing \ continues the line */
+    while (next != NULL && (len = strlen(line)) > 0 && line[len - 1] == '\\') {
+      line[len - 1] = ' ';
+      if ((p = strchr(next, '\n')) != NULL)
+        *p++ = '\0';
+      (void)memmove(line + len, next, strlen(next) + 1);
+      next = p;
+    }
+    
+    if ((p = strchr(line, '#')) != NULL)
+      *p = '\0';
+    
+    if ((name = next_token(&line)) == NULL)
+      continue;
+    
+    if (strcmp(name, "/set") == 0) {
+      if (parse_keywords(mport, line, &defaults, 0) != MPORT_OK)
+        goto ERROR;
+      continue;
+    }
+    
+    /* we never unset anything we'd use; /unset all is the only common case */
+    if (strcmp(name, "/unset") == 0) {
+      bzero(&defaults, sizeof(defaults));
+      continue;
+    }
+    
+    if (strcmp(name, "..") == 0) {
+      if (depth == 0) {
+        SET_ERRORX(MPORT_ERR_FATAL, "mtree spec for %s goes above its root", prefix);
+        goto ERROR;
+      }
+      path[stack[--depth]] = '\0';
+      continue;
+    }
+    
+    attrs = defaults;
+    
+    if (parse_keywords(mport, line, &attrs, 1) != MPORT_OK)
+      goto ERROR;
+    
+    if (!attrs.isdir)
+      continue;
+    
+    unvis_name(name);
+    
+    /* "." is the prefix itself, and names with a / in them are full paths that
+     * don't change where we are */
+    if (strchr(name, '/') != NULL) {
+      while (name[0] == '.' && name[1] == '/')
+        name += 2;
+      if (make_dir(mport, dirfd, prefix, name, &attrs) != MPORT_OK)
+        goto ERROR;
+      continue;
+    }
+    
+    if (depth == MAX_DEPTH) {
+      SET_ERRORX(MPORT_ERR_FATAL, "mtree spec for %s is nested too deep", prefix);
+      goto ERROR;
+    }
+    
+    len = strlen(path);
+    stack[depth++] = len;
+    
+    /* the top level "." leaves the path empty */
+    if (len == 0 && strcmp(name, ".") == 0) {
+      if (make_dir(mport, dirfd, prefix, ".", &attrs) != MPORT_OK)
+        goto ERROR;
+      continue;
+    }
+    
+    if (snprintf(path + len, sizeof(path) - len, "%s%s", len == 0 ? "" : "/", name) >= (int)(sizeof(path) - len)) {
+      SET_ERRORX(MPORT_ERR_FATAL, "%s/%s: path too long", path, name);
+      goto ERROR;
+    }
+    
+    if (make_dir(mport, dirfd, prefix, path, &attrs) != MPORT_OK)
+      goto ERROR;
+  }
+  
+  (void)close(dirfd);
+  free(copy);
+  return MPORT_OK;
+  
+  ERROR:
+    (void)close(dirfd);
+    free(copy);
+    RETURN_CURRENT_ERROR;
+}
+
+
+/*
+ * mport_mtree_cache_free(cache)
+ *
+ * free the instance's record of what we've set up.
+ */
+void mport_mtree_cache_free(struct _MtreeCache *cache)
+{
+  struct cache_dir *dir;
+  struct cache_id *id, *lists[2];
+  int i;
+  
+  if (cache == NULL)
+    return;
+  
+  for (i = 0; i < CACHE_BUCKETS; i++) {
+    while ((dir = cache->dirs[i]) != NULL) {
+      cache->dirs[i] = dir->next;
+      free(dir->path);
+      free(dir);
+    }
+  }
+  
+  lists[0] = cache->users;
+  lists[1] = cache->groups;
+  
+  for (i = 0; i < 2; i++) {
+    while ((id = lists[i]) != NULL) {
+      lists[i] = id->next;
+      free(id->name);
+      free(id);
+    }
+  }
+  
+  free(cache);
+}
+
+
+/* path is relative to dirfd, which is prefix */
+static int make_dir(mportInstance *mport, int dirfd, const char *prefix, const char *path, struct mtree_attrs *attrs)
+{
+  char key[FILENAME_MAX];
+  struct stat st;
+  
+  /* "." is the prefix itself */
+  if (strcmp(path, ".") == 0)
+    (void)snprintf(key, sizeof(key), "%s", prefix);
+  else
+    (void)snprintf(key, sizeof(key), "%s/%s", prefix, path);
+  
+  /* a delete or update in this instance may have removed it since; one
+   * stat is still cheaper than the mkdir, chown and chmod */
+  if (cache_lookup(mport->mtree_cache, key, 0) && fstatat(dirfd, path, &st, 0) == 0 && S_ISDIR(st.st_mode))
+    return MPORT_OK;
+  
+  if (mkdirat(dirfd, path, attrs->has_mode ? attrs->mode : 0755) != 0) {
+    if (errno != EEXIST || fstatat(dirfd, path, &st, 0) != 0 || !S_ISDIR(st.st_mode))
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't mkdir %s%s: %s", mport->root, key, strerror(errno));
+  }
+  
+  /* like mtree -U, existing directories are fixed up too */
+  if ((attrs->has_uid || attrs->has_gid) && geteuid() == 0) {
+    if (fchownat(dirfd, path, attrs->has_uid ? attrs->uid : (uid_t)-1, attrs->has_gid ? attrs->gid : (gid_t)-1, 0) != 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't chown %s%s: %s", mport->root, key, strerror(errno));
+  }
+  
+  /* mkdir's mode is cut by the umask, so it's always set */
+  if (attrs->has_mode && fchmodat(dirfd, path, attrs->mode, 0) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't chmod %s%s: %s", mport->root, key, strerror(errno));
+  
+  if (cache_lookup(mport->mtree_cache, key, 1) == -1)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  return MPORT_OK;
+}
+
+
+/* 
+ * parse the keyword=value pairs in line into attrs.  For entries (as opposed
+ * to /set) a missing type means a directory, since specs mostly don't say.
+ */
+static int parse_keywords(mportInstance *mport, char *line, struct mtree_attrs *attrs, int entry)
+{
+  char *tok, *val, *end;
+  
+  while ((tok = next_token(&line)) != NULL) {
+    if ((val = strchr(tok, '=')) == NULL) 
+      continue; /* nochange, optional, ignore and friends */
+    
+    *val++ = '\0';
+    
+    if (strcmp(tok, "type") == 0) {
+      attrs->isdir    = (strcmp(val, "dir") == 0);
+      attrs->has_type = 1;
+    } else if (strcmp(tok, "mode") == 0) {
+      attrs->mode = (mode_t)strtol(val, &end, 8);
+      if (*end != '\0' || end == val)
+        RETURN_ERRORX(MPORT_ERR_FATAL, "mtree: can't handle mode %s", val);
+      attrs->has_mode = 1;
+    } else if (strcmp(tok, "uid") == 0) {
+      attrs->uid = (uid_t)strtoul(val, NULL, 10);
+      attrs->has_uid = 1;
+    } else if (strcmp(tok, "gid") == 0) {
+      attrs->gid = (gid_t)strtoul(val, NULL, 10);
+      attrs->has_gid = 1;
+    } else if (strcmp(tok, "uname") == 0 || strcmp(tok, "gname") == 0) {
+      if (tok[0] == 'u') {
+        if (mport_root_uid(mport, val, &attrs->uid) != MPORT_OK)
+          RETURN_ERRORX(MPORT_ERR_FATAL, "mtree: unknown user %s", val);
+        attrs->has_uid = 1;
+      } else {
+        if (mport_root_gid(mport, val, &attrs->gid) != MPORT_OK)
+          RETURN_ERRORX(MPORT_ERR_FATAL, "mtree: unknown group %s", val);
+        attrs->has_gid = 1;
+      }
+    }
+  }
+  
+  /* no type anywhere; in a -d spec everything is a directory */
+  if (entry && !attrs->has_type)
+    attrs->isdir = 1;
+  
+  return MPORT_OK;
+}
+
+
+/* 
+ * returns 1 if path is in the cache, 0 if not.  With add, a missing path is 
+ * added; -1 if that fails.
+ */
+static int cache_lookup(struct _MtreeCache *cache, const char *path, int add)
+{
+  unsigned int h = hash(path) % CACHE_BUCKETS;
+  struct cache_dir *dir;
+  
+  for (dir = cache->dirs[h]; dir != NULL; dir = dir->next) {
+    if (strcmp(dir->path, path) == 0)
+      return 1;
+  }
+  
+  if (!add)
+    return 0;
+  
+  if ((dir = (struct cache_dir *)malloc(sizeof(struct cache_dir))) == NULL)
+    return -1;
+  
+  if ((dir->path = strdup(path)) == NULL) {
+    free(dir);
+    return -1;
+  }
+  
+  dir->next = cache->dirs[h];
+  cache->dirs[h] = dir;
+  
+  return 0;
+}
+
+
+/* djb2 */
+static unsigned int hash(const char *str)
+{
+  unsigned int h = 5381;
+  
+  while (*str != '\0')
+    h = h * 33 + (unsigned char)*str++;
+  
+  return h;
+}
+
+
+/*
+ * mport_root_uid(mport, name, &uid)
+ *
+ * look up a user in the instance root's passwd file, rather than the host's.
+ * Returns MPORT_ERR_FATAL if there's no such user; the error is only set if
+ * the file couldn't be read.
+ */
+int mport_root_uid(mportInstance *mport, const char *name, uid_t *uidp)
+{
+  unsigned int id;
+  
+  if (get_cache(mport, 1) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (lookup_id(mport->mtree_cache->users, name, &id) != MPORT_OK)
+    return MPORT_ERR_FATAL;
+  
+  *uidp = (uid_t)id;
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_root_gid(mport, name, &gid)
+ *
+ * mport_root_uid() for groups.
+ */
+int mport_root_gid(mportInstance *mport, const char *name, gid_t *gidp)
+{
+  unsigned int id;
+  
+  if (get_cache(mport, 1) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (lookup_id(mport->mtree_cache->groups, name, &id) != MPORT_OK)
+    return MPORT_ERR_FATAL;
+  
+  *gidp = (gid_t)id;
+  
+  return MPORT_OK;
+}
+
+
+/* the instance's cache, with the root's users and groups loaded if ids */
+static int get_cache(mportInstance *mport, int ids)
+{
+  struct _MtreeCache *cache;
+  
+  if (mport->mtree_cache == NULL) {
+    if ((mport->mtree_cache = (struct _MtreeCache *)calloc(1, sizeof(struct _MtreeCache))) == NULL)
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  cache = mport->mtree_cache;
+  
+  if (ids && !cache->ids_loaded) {
+    if (load_ids(mport, "/etc/passwd", &cache->users) != MPORT_OK || load_ids(mport, "/etc/group", &cache->groups) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    cache->ids_loaded = 1;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/* read name:x:id: lines from file, in the instance root, into list.  A root
+ * without the file just has no names in it. */
+static int load_ids(mportInstance *mport, const char *file, struct cache_id **list)
+{
+  char path[FILENAME_MAX], line[1024];
+  struct cache_id *id;
+  char *p, *name, *num;
+  FILE *fp;
+  
+  (void)snprintf(path, sizeof(path), "%s%s", mport->root, file);
+  
+  if ((fp = fopen(path, "r")) == NULL) {
+    if (errno == ENOENT)
+      return MPORT_OK;
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", path, strerror(errno));
+  }
+  
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    p = line;
+    
+    if (*p == '#' || (name = strsep(&p, ":")) == NULL || strsep(&p, ":") == NULL || (num = strsep(&p, ":")) == NULL || p == NULL)
+      continue;
+    
+    if ((id = (struct cache_id *)malloc(sizeof(struct cache_id))) == NULL || (id->name = strdup(name)) == NULL) {
+      free(id);
+      (void)fclose(fp);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    id->id   = (unsigned int)strtoul(num, NULL, 10);
+    id->next = *list;
+    *list    = id;
+  }
+  
+  (void)fclose(fp);
+  
+  return MPORT_OK;
+}
+
+
+static int lookup_id(struct cache_id *list, const char *name, unsigned int *idp)
+{
+  for (; list != NULL; list = list->next) {
+    if (strcmp(list->name, name) == 0) {
+      *idp = list->id;
+      return MPORT_OK;
+    }
+  }
+  
+  return MPORT_ERR_FATAL;
+}
+
+
+/* mtree names are vis(3) encoded; we only see \ooo and \s in practice */
+static void unvis_name(char *name)
+{
+  char *out = name;
+  
+  while (*name != '\0') {
+    if (name[0] == '\\' && name[1] >= '0' && name[1] <= '7' && name[2] >= '0' && name[2] <= '7' && name[3] >= '0' && name[3] <= '7') {
+      *out++ = (char)(((name[1] - '0') << 6) | ((name[2] - '0') << 3) | (name[3] - '0'));
+      name += 4;
+    } else if (name[0] == '\\' && name[1] == 's') {
+      *out++ = ' ';
+      name += 2;
+    } else if (name[0] == '\\' && name[1] != '\0') {
+      *out++ = name[1];
+      name += 2;
+    } else {
+      *out++ = *name++;
+    }
+  }
+  
+  *out = '\0';
+}
+
+
+/* whitespace separated tokens */
+static char * next_token(char **linep)
+{
+  char *tok;
+  
+  do {
+    if ((tok = strsep(linep, " \t\r")) == NULL)
+      return NULL;
+  } while (*tok == '\0');
+  
+  return tok;
+}
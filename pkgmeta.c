@@ -201,28 +201,29 @@ MPORT_PUBLIC_API int mport_pkgmeta_get_downdepends(mportInstance *mport, mportPa
   sqlite3_stmt *stmt;
   
   /* if the depends are set, there's nothing for us to do */
-  if (mport_db_prepare(mport->db, &stmt, "SELECT COUNT(*) FROM depends WHERE pkg=%Q", pkg->name) != MPORT_OK)
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT COUNT(*) FROM depends WHERE pkg=?", pkg->name) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
   if (sqlite3_step(stmt) != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
-    RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    mport_db_release(mport, stmt);
+    RETURN_CURRENT_ERROR;
   }
   
   count = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   
   if (count == 0) {
     *pkg_vec_p = NULL;
     return MPORT_OK;  
   }
 
-  if (mport_db_prepare(mport->db, &stmt, "SELECT packages.pkg, packages.version, packages.origin, packages.lang, packages.prefix, packages.comment FROM packages,depends WHERE packages.pkg=depends.depend_pkgname AND depends.pkg=%Q", pkg->name) != MPORT_OK) 
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT packages.pkg, packages.version, packages.origin, packages.lang, packages.prefix, packages.comment FROM packages,depends WHERE packages.pkg=depends.depend_pkgname AND depends.pkg=?", pkg->name) != MPORT_OK) 
     RETURN_CURRENT_ERROR;
 
   ret = populate_vec_from_stmt(pkg_vec_p, count, mport->db, stmt);
  
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return ret; 
 }  
 
@@ -239,28 +240,29 @@ MPORT_PUBLIC_API int mport_pkgmeta_get_updepends(mportInstance *mport, mportPack
   sqlite3_stmt *stmt;
   
   /* if the depends are set, there's nothing for us to do */
-  if (mport_db_prepare(mport->db, &stmt, "SELECT COUNT(*) FROM depends WHERE depend_pkgname=%Q", pkg->name) != MPORT_OK)
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT COUNT(*) FROM depends WHERE depend_pkgname=?", pkg->name) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
   if (sqlite3_step(stmt) != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
-    RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    mport_db_release(mport, stmt);
+    RETURN_CURRENT_ERROR;
   }
   
   count = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   
   if (count == 0) {
     *pkg_vec_p = NULL;
     return MPORT_OK;  
   }
 
-  if (mport_db_prepare(mport->db, &stmt, "SELECT packages.pkg, packages.version, packages.origin, packages.lang, packages.prefix, packages.comment FROM packages,depends WHERE packages.pkg=depends.pkg AND depends.depend_pkgname=%Q", pkg->name) != MPORT_OK) 
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT packages.pkg, packages.version, packages.origin, packages.lang, packages.prefix, packages.comment FROM packages,depends WHERE packages.pkg=depends.pkg AND depends.depend_pkgname=?", pkg->name) != MPORT_OK) 
     RETURN_CURRENT_ERROR;
 
   ret = populate_vec_from_stmt(pkg_vec_p, count, mport->db, stmt);
  
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return ret; 
 }  
 
@@ -277,7 +279,7 @@ int mport_pkgmeta_get_assetlist(mportInstance *mport, mportPackageMeta *pkg, mpo
 
   *alist_p = alist;
   
-  if (mport_db_prepare(mport->db, &stmt, "SELECT type, data FROM assets WHERE pkg=%Q", pkg->name) != MPORT_OK)
+  if (mport_db_prepare_cached(mport, &stmt, "SELECT type, data FROM assets WHERE pkg=?", pkg->name) != MPORT_OK)
     RETURN_CURRENT_ERROR;
     
   while (1) {
@@ -287,14 +289,15 @@ int mport_pkgmeta_get_assetlist(mportInstance *mport, mportPackageMeta *pkg, mpo
       break;
       
     if (ret != SQLITE_ROW) {
-      sqlite3_finalize(stmt);
-      RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+      SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+      mport_db_release(mport, stmt);
+      RETURN_CURRENT_ERROR;
     }
     
     e = (mportAssetListEntry *)malloc(sizeof(mportAssetListEntry));
     
     if (e == NULL) {
-      sqlite3_finalize(stmt);
+      mport_db_release(mport, stmt);
       RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
     }
     
@@ -302,14 +305,14 @@ int mport_pkgmeta_get_assetlist(mportInstance *mport, mportPackageMeta *pkg, mpo
     e->data = strdup(sqlite3_column_text(stmt, 1));
     
     if (e->data == NULL) {
-      sqlite3_finalize(stmt);
+      mport_db_release(mport, stmt);
       RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
     }
     
     STAILQ_INSERT_TAIL(alist, e, next);
   }
   
-  sqlite3_finalize(stmt);
+  mport_db_release(mport, stmt);
   return MPORT_OK;
 }
 
@@ -0,0 +1,487 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* The install planner.
+ *
+ * Given a package to install, work out everything that has to be installed or
+ * upgraded for it, in an order where each package's depends come first, before
+ * fetching or touching anything.  The index's packages and their depends are
+ * loaded into an in-memory graph once, and walked depth first; version
+ * requirements are checked against what's installed, and against what the
+ * index would give us.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mport.h"
+#include "mport_private.h"
+
+enum { UNSEEN, VISITING, PLANNED };
+
+struct edge {
+  char *name;
+  char *require;      /* like ">=2.0", or NULL */
+  int target;         /* index into the nodes, or -1 if it isn't in the index */
+};
+
+struct node {
+  char *name;
+  char *version;
+  char *bundlefile;
+  char *hash;         /* or NULL, for indexes from before bundle hashes */
+  char *meta_hash;    /* likewise */
+  char *installed;    /* installed version, or NULL */
+  struct edge *edges;
+  int nedges;
+  int state;
+  mportPlanAction action;
+};
+
+struct graph {
+  struct node *nodes;
+  int nnodes;
+  mportPlanEntry **plan;
+  int nplan;
+};
+
+static int load_graph(mportInstance *, struct graph *);
+static int load_depends(mportInstance *, struct graph *);
+static int load_installed(mportInstance *, struct graph *);
+static int visit(mportInstance *, struct graph *, int, mportPlanAction);
+static int check_edge(mportInstance *, struct graph *, struct node *, struct edge *);
+static int add_to_plan(struct graph *, struct node *);
+static int find_node(struct graph *, const char *);
+static int node_cmp(const void *, const void *);
+static void free_graph(struct graph *);
+
+
+/*
+ * mport_plan_install(mport, pkgname, &plan)
+ *
+ * make a plan for installing pkgname (which may be a glob or an alias, as 
+ * long as it matches exactly one package).  plan is a NULL terminated vector,
+ * in the order things should be done; pkgname is last.  Free it with 
+ * mport_plan_free_vec().
+ */
+MPORT_PUBLIC_API int mport_plan_install(mportInstance *mport, const char *pkgname, mportPlanEntry ***planp)
+{
+  struct graph graph;
+  mportIndexEntry **e;
+  int root;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_plan_install()");
+  
+  if (mport_index_lookup_pkgname(mport, pkgname, &e) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (e[0] == NULL || e[1] != NULL) {
+    mport_index_entry_free_vec(e);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Could not resolve '%s' to a single package.", pkgname);
+  }
+  
+  bzero(&graph, sizeof(graph));
+  
+  if (load_graph(mport, &graph) != MPORT_OK) {
+    mport_index_entry_free_vec(e);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  root = find_node(&graph, e[0]->pkgname);
+  mport_index_entry_free_vec(e);
+  
+  if (root == -1) {
+    SET_ERRORX(MPORT_ERR_FATAL, "%s vanished from the index.", pkgname);
+    goto ERROR;
+  }
+  
+  if (graph.nodes[root].installed != NULL) {
+    SET_ERRORX(MPORT_ERR_FATAL, "%s is already installed.", graph.nodes[root].name);
+    goto ERROR;
+  }
+  
+  if (visit(mport, &graph, root, MPORT_PLAN_INSTALL) != MPORT_OK)
+    goto ERROR;
+  
+  if (add_to_plan(&graph, NULL) != MPORT_OK)
+    goto ERROR;
+  
+  *planp = graph.plan;
+  graph.plan = NULL;
+  free_graph(&graph);
+  
+  return MPORT_OK;
+  
+  ERROR:
+    free_graph(&graph);
+    RETURN_CURRENT_ERROR;
+}
+
+
+/* free a plan */
+MPORT_PUBLIC_API void mport_plan_free_vec(mportPlanEntry **plan)
+{
+  int i;
+  
+  if (plan == NULL)
+    return;
+  
+  for (i = 0; plan[i] != NULL; i++) {
+    free(plan[i]->pkgname);
+    free(plan[i]->version);
+    free(plan[i]->bundlefile);
+    free(plan[i]->hash);
+    free(plan[i]->meta_hash);
+    free(plan[i]);
+  }
+  
+  free(plan);
+}
+
+
+/* plan node, and before it everything it needs */
+static int visit(mportInstance *mport, struct graph *graph, int n, mportPlanAction action)
+{
+  struct node *node = &graph->nodes[n];
+  int i;
+  
+  if (node->state == PLANNED)
+    return MPORT_OK;
+  
+  if (node->state == VISITING)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s depends on itself, by way of its depends.", node->name);
+  
+  node->state  = VISITING;
+  node->action = action;
+  
+  for (i = 0; i < node->nedges; i++) {
+    if (check_edge(mport, graph, node, &node->edges[i]) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  
+  node->state = PLANNED;
+  
+  return add_to_plan(graph, node);
+}
+
+
+/* make sure the depend behind edge will be there, in a version node can use */
+static int check_edge(mportInstance *mport, struct graph *graph, struct node *node, struct edge *edge)
+{
+  struct node *dep;
+  int check;
+  
+  if (edge->target == -1) {
+    sqlite3_stmt *stmt;
+    char *version = NULL;
+    
+    /* not something we can get, but it might be installed (from a local bundle, say) */
+    if (mport_db_prepare(mport->db, &stmt, "SELECT version FROM packages WHERE pkg=%Q AND status='clean'", edge->name) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      version = strdup((const char *)sqlite3_column_text(stmt, 0));
+    
+    sqlite3_finalize(stmt);
+    
+    if (version == NULL)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "%s depends on %s, which isn't in the index.", node->name, edge->name);
+    
+    check = (edge->require == NULL) ? 0 : mport_version_require_check(version, edge->require);
+    free(version);
+    
+    if (check != 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "%s needs %s %s, and the index can't provide it.", node->name, edge->name, edge->require);
+    
+    return MPORT_OK;
+  }
+  
+  dep = &graph->nodes[edge->target];
+  
+  /* whatever we're putting in place has to do */
+  if (dep->state != UNSEEN || dep->installed == NULL) {
+    check = (edge->require == NULL) ? 0 : mport_version_require_check(dep->version, edge->require);
+    
+    if (check > 0)
+      RETURN_CURRENT_ERROR;
+    if (check < 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "%s needs %s %s, but the index has %s.", node->name, dep->name, edge->require, dep->version);
+    
+    return visit(mport, graph, edge->target, dep->installed == NULL ? MPORT_PLAN_INSTALL : MPORT_PLAN_UPGRADE);
+  }
+  
+  /* installed, and not being touched yet; upgrade it only if we have to */
+  if (edge->require == NULL)
+    return MPORT_OK;
+  
+  if ((check = mport_version_require_check(dep->installed, edge->require)) > 0)
+    RETURN_CURRENT_ERROR;
+  
+  if (check == 0)
+    return MPORT_OK;
+  
+  if (mport_version_require_check(dep->version, edge->require) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s needs %s %s, but the index has %s.", node->name, dep->name, edge->require, dep->version);
+  
+  return visit(mport, graph, edge->target, MPORT_PLAN_UPGRADE);
+}
+
+
+/* append node to the plan; a NULL node terminates it */
+static int add_to_plan(struct graph *graph, struct node *node)
+{
+  mportPlanEntry **plan, *e;
+  
+  if ((plan = (mportPlanEntry **)realloc(graph->plan, (graph->nplan + 2) * sizeof(mportPlanEntry *))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  graph->plan = plan;
+  graph->plan[graph->nplan] = NULL;
+  
+  if (node == NULL)
+    return MPORT_OK;
+  
+  if ((e = (mportPlanEntry *)calloc(1, sizeof(mportPlanEntry))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  graph->plan[graph->nplan++] = e;
+  graph->plan[graph->nplan]   = NULL;
+  
+  e->action     = node->action;
+  e->pkgname    = strdup(node->name);
+  e->version    = strdup(node->version);
+  e->bundlefile = strdup(node->bundlefile);
+  e->hash       = node->hash == NULL ? NULL : strdup(node->hash);
+  e->meta_hash  = node->meta_hash == NULL ? NULL : strdup(node->meta_hash);
+  
+  if (e->pkgname == NULL || e->version == NULL || e->bundlefile == NULL || (node->hash != NULL && e->hash == NULL) ||
+      (node->meta_hash != NULL && e->meta_hash == NULL))
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  return MPORT_OK;
+}
+
+
+static int load_graph(mportInstance *mport, struct graph *graph)
+{
+  sqlite3_stmt *stmt;
+  struct node *node;
+  int ret, allocated = 0;
+  
+  if (mport_db_prepare(mport->db, &stmt, "SELECT pkg, version, bundlefile, %s, %s FROM index.packages", 
+      mport_index_has_hashes(mport) ? "hash" : "NULL", mport_index_has_meta_hashes(mport) ? "meta_hash" : "NULL") != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (graph->nnodes == allocated) {
+      allocated = allocated == 0 ? 1024 : allocated * 2;
+      if ((node = (struct node *)realloc(graph->nodes, allocated * sizeof(struct node))) == NULL) {
+        sqlite3_finalize(stmt);
+        RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+      }
+      graph->nodes = node;
+    }
+    
+    node = &graph->nodes[graph->nnodes];
+    bzero(node, sizeof(struct node));
+    
+    node->name       = strdup((const char *)sqlite3_column_text(stmt, 0));
+    node->version    = strdup((const char *)sqlite3_column_text(stmt, 1));
+    node->bundlefile = strdup((const char *)sqlite3_column_text(stmt, 2));
+    if (sqlite3_column_type(stmt, 3) != SQLITE_NULL)
+      node->hash     = strdup((const char *)sqlite3_column_text(stmt, 3));
+    if (sqlite3_column_type(stmt, 4) != SQLITE_NULL)
+      node->meta_hash = strdup((const char *)sqlite3_column_text(stmt, 4));
+    graph->nnodes++;
+    
+    if (node->name == NULL || node->version == NULL || node->bundlefile == NULL || 
+        (node->hash == NULL && sqlite3_column_type(stmt, 3) != SQLITE_NULL) ||
+        (node->meta_hash == NULL && sqlite3_column_type(stmt, 4) != SQLITE_NULL)) {
+      sqlite3_finalize(stmt);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+  }
+  
+  if (ret != SQLITE_DONE) {
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    sqlite3_finalize(stmt);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  sqlite3_finalize(stmt);
+  
+  /* sorted by name, so lookups can bsearch; strcmp, not sqlite's collation */
+  qsort(graph->nodes, graph->nnodes, sizeof(struct node), node_cmp);
+  
+  if (load_depends(mport, graph) != MPORT_OK || load_installed(mport, graph) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return MPORT_OK;
+}
+
+
+static int load_depends(mportInstance *mport, struct graph *graph)
+{
+  sqlite3_stmt *stmt;
+  struct node *node;
+  struct edge *edge;
+  const char *require;
+  int ret, n;
+  
+  /* indexes from before the depends table have nothing to tell us; each 
+   * bundle's own depends are still checked when it's installed */
+  if (mport_db_prepare(mport->db, &stmt, "SELECT COUNT(*) FROM index.sqlite_master WHERE type='table' AND name='depends'") != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  ret = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+  
+  if (ret == 0)
+    return MPORT_OK;
+  
+  if (mport_db_prepare(mport->db, &stmt, "SELECT pkg, depend_pkgname, depend_pkgversion FROM index.depends") != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if ((n = find_node(graph, (const char *)sqlite3_column_text(stmt, 0))) == -1)
+      continue;
+    
+    node = &graph->nodes[n];
+    
+    if ((edge = (struct edge *)realloc(node->edges, (node->nedges + 1) * sizeof(struct edge))) == NULL) {
+      sqlite3_finalize(stmt);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    node->edges = edge;
+    edge = &node->edges[node->nedges++];
+    
+    require       = (const char *)sqlite3_column_text(stmt, 2);
+    edge->name    = strdup((const char *)sqlite3_column_text(stmt, 1));
+    edge->require = (require == NULL || *require == '\0') ? NULL : strdup(require);
+    edge->target  = edge->name == NULL ? -1 : find_node(graph, edge->name);
+    
+    if (edge->name == NULL || (require != NULL && *require != '\0' && edge->require == NULL)) {
+      sqlite3_finalize(stmt);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+  }
+  
+  if (ret != SQLITE_DONE) {
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    sqlite3_finalize(stmt);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  sqlite3_finalize(stmt);
+  
+  return MPORT_OK;
+}
+
+
+static int load_installed(mportInstance *mport, struct graph *graph)
+{
+  sqlite3_stmt *stmt;
+  int ret, n;
+  
+  if (mport_db_prepare(mport->db, &stmt, "SELECT pkg, version FROM packages WHERE status='clean'") != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if ((n = find_node(graph, (const char *)sqlite3_column_text(stmt, 0))) == -1)
+      continue;
+    
+    if ((graph->nodes[n].installed = strdup((const char *)sqlite3_column_text(stmt, 1))) == NULL) {
+      sqlite3_finalize(stmt);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+  }
+  
+  if (ret != SQLITE_DONE) {
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+    sqlite3_finalize(stmt);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  sqlite3_finalize(stmt);
+  
+  return MPORT_OK;
+}
+
+
+static int find_node(struct graph *graph, const char *name)
+{
+  struct node key, *node;
+  
+  if (name == NULL)
+    return -1;
+  
+  key.name = (char *)name;
+  
+  if ((node = (struct node *)bsearch(&key, graph->nodes, graph->nnodes, sizeof(struct node), node_cmp)) == NULL)
+    return -1;
+  
+  return (int)(node - graph->nodes);
+}
+
+
+static int node_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct node *)a)->name, ((const struct node *)b)->name);
+}
+
+
+static void free_graph(struct graph *graph)
+{
+  struct node *node;
+  int i, j;
+  
+  for (i = 0; i < graph->nnodes; i++) {
+    node = &graph->nodes[i];
+    
+    for (j = 0; j < node->nedges; j++) {
+      free(node->edges[j].name);
+      free(node->edges[j].require);
+    }
+    
+    free(node->edges);
+    free(node->name);
+    free(node->version);
+    free(node->bundlefile);
+    free(node->hash);
+    free(node->meta_hash);
+    free(node->installed);
+  }
+  
+  free(graph->nodes);
+  
+  /* a plan that never got handed over */
+  if (graph->plan != NULL) {
+    graph->plan[graph->nplan] = NULL;
+    mport_plan_free_vec(graph->plan);
+  }
+}
@@ -193,6 +193,8 @@ static mportAssetListEntryType parse_command(const char *s)
     return ASSET_MTREE;
   if (STRING_EQ(s, "option"))
     return ASSET_OPTION;
+  if (STRING_EQ(s, "trigger"))
+    return ASSET_TRIGGER;
   
   return ASSET_INVALID;
 }
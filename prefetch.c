@@ -0,0 +1,313 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Downloading bundles ahead of the installer.
+ *
+ * Installing a plan one bundle at a time leaves the network idle while we
+ * extract, and the disk idle while we download.  A small pool of threads
+ * works down the plan, in plan order, fetching bundles into
+ * MPORT_FETCH_STAGING_DIR; the installer waits on each entry with
+ * mport_prefetch_wait() and installs it as soon as its download is complete.
+ *
+ * The workers never touch the database (the mirror list is read once, up
+ * front) or the UI callbacks.  Bundles fetched but not yet installed count
+ * against the instance's fetch_max_staged; once over it, the workers only
+ * fetch the entry the installer is waiting for.  The cap is checked before a
+ * download starts, since we don't know a bundle's size until then, so it can
+ * be overshot by as much as fetch_jobs bundles.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "mport.h"
+#include "mport_private.h"
+
+enum prefetch_state { PREFETCH_PENDING, PREFETCH_FETCHING, PREFETCH_READY, PREFETCH_FAILED };
+
+struct prefetch_job {
+  const char *bundlefile;  /* these belong to the plan */
+  const char *hash;
+  enum prefetch_state state;
+  off_t size;
+  char *error;
+};
+
+struct _Prefetch {
+  mportInstance *mport;
+  char **mirrors;
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;  /* room was made under the cap, or it's time to go */
+  pthread_cond_t done;  /* a download finished */
+  struct prefetch_job *jobs;
+  int njobs;
+  int next;             /* the entry the installer wants next */
+  off_t staged;         /* bytes fetched that the installer hasn't taken */
+  off_t max_staged;
+  int shutdown;
+};
+
+static void * fetcher_main(void *);
+static struct prefetch_job * next_job(mportPrefetch *);
+
+
+/*
+ * mport_prefetch_new(mport, plan, &pf)
+ *
+ * start downloading the bundles of plan, with mport->fetch_jobs threads.
+ * The plan must outlive the prefetcher.
+ */
+int mport_prefetch_new(mportInstance *mport, mportPlanEntry **plan, mportPrefetch **pfp)
+{
+  mportPrefetch *pf;
+  int i, nthreads;
+  
+  MPORT_CHECK_FOR_INDEX(mport, "mport_prefetch_new()");
+  
+  if ((pf = (mportPrefetch *)calloc(1, sizeof(mportPrefetch))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  pf->mport      = mport;
+  pf->max_staged = mport->fetch_max_staged;
+  
+  for (pf->njobs = 0; plan[pf->njobs] != NULL; pf->njobs++)
+    ;
+  
+  if ((pf->jobs = (struct prefetch_job *)calloc(pf->njobs + 1, sizeof(struct prefetch_job))) == NULL) {
+    free(pf);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  for (i = 0; i < pf->njobs; i++) {
+    pf->jobs[i].bundlefile = plan[i]->bundlefile;
+    pf->jobs[i].hash       = plan[i]->hash;
+    pf->jobs[i].state      = PREFETCH_PENDING;
+  }
+  
+  if (mport_index_get_mirror_list(mport, &pf->mirrors) != MPORT_OK) {
+    free(pf->jobs);
+    free(pf);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if (pthread_mutex_init(&pf->lock, NULL) != 0) {
+    mport_free_vec(pf->mirrors);
+    free(pf->jobs);
+    free(pf);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize prefetch lock.");
+  }
+  
+  (void)pthread_cond_init(&pf->work, NULL);
+  (void)pthread_cond_init(&pf->done, NULL);
+  
+  nthreads = mport->fetch_jobs < pf->njobs ? mport->fetch_jobs : pf->njobs;
+  
+  if (nthreads > 0 && (pf->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL) {
+    mport_prefetch_free(pf);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&pf->threads[i], NULL, fetcher_main, pf) != 0)
+      break;
+    pf->nthreads++;
+  }
+  
+  /* with no threads at all, mport_prefetch_wait() does the fetching */
+  *pfp = pf;
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_prefetch_wait(pf, i)
+ *
+ * wait for the bundle of plan entry i to be downloaded.  Entries must be 
+ * waited on in order; waiting on i hands it to the installer, which makes
+ * room under the cap for the workers to fetch further ahead.
+ */
+int mport_prefetch_wait(mportPrefetch *pf, int i)
+{
+  struct prefetch_job *job = &pf->jobs[i];
+  char *error;
+  int ret;
+  
+  pthread_mutex_lock(&pf->lock);
+  
+  pf->next = i;
+  pthread_cond_broadcast(&pf->work);
+  
+  if (pf->nthreads == 0 && job->state == PREFETCH_PENDING) {
+    job->state = PREFETCH_FETCHING;
+    pthread_mutex_unlock(&pf->lock);
+    ret = mport_cache_fetch(pf->mport, pf->mirrors, job->bundlefile, job->hash, 0);
+    pthread_mutex_lock(&pf->lock);
+    job->state = (ret == MPORT_OK) ? PREFETCH_READY : PREFETCH_FAILED;
+    if (ret != MPORT_OK && (job->error = strdup(mport_err_string())) == NULL)
+      job->error = strdup("Out of memory.");
+  }
+  
+  while (job->state == PREFETCH_PENDING || job->state == PREFETCH_FETCHING)
+    pthread_cond_wait(&pf->done, &pf->lock);
+  
+  if (job->state == PREFETCH_READY) {
+    pf->staged -= job->size;
+    job->size   = 0;
+  }
+  
+  pf->next = i + 1;
+  pthread_cond_broadcast(&pf->work);
+  
+  error = job->error;
+  job->error = NULL;
+  
+  pthread_mutex_unlock(&pf->lock);
+  
+  if (error != NULL) {
+    SET_ERROR(MPORT_ERR_FATAL, error);
+    free(error);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_prefetch_free(pf)
+ *
+ * stop the workers and free the prefetcher.  Downloads already under way are
+ * allowed to finish; bundles that were fetched are left in the staging dir.
+ */
+void mport_prefetch_free(mportPrefetch *pf)
+{
+  int i;
+  
+  if (pf == NULL)
+    return;
+  
+  pthread_mutex_lock(&pf->lock);
+  pf->shutdown = 1;
+  pthread_cond_broadcast(&pf->work);
+  pthread_mutex_unlock(&pf->lock);
+  
+  for (i = 0; i < pf->nthreads; i++)
+    (void)pthread_join(pf->threads[i], NULL);
+  
+  for (i = 0; i < pf->njobs; i++)
+    free(pf->jobs[i].error);
+  
+  pthread_cond_destroy(&pf->work);
+  pthread_cond_destroy(&pf->done);
+  pthread_mutex_destroy(&pf->lock);
+  mport_free_vec(pf->mirrors);
+  free(pf->threads);
+  free(pf->jobs);
+  free(pf);
+}
+
+
+static void * fetcher_main(void *arg)
+{
+  mportPrefetch *pf = (mportPrefetch *)arg;
+  struct prefetch_job *job;
+  struct stat st;
+  char *file;
+  char *error;
+  off_t size;
+  
+  pthread_mutex_lock(&pf->lock);
+  
+  while (1) {
+    while (!pf->shutdown && (job = next_job(pf)) == NULL)
+      pthread_cond_wait(&pf->work, &pf->lock);
+    
+    if (pf->shutdown)
+      break;
+    
+    job->state = PREFETCH_FETCHING;
+    error = NULL;
+    size  = 0;
+    
+    pthread_mutex_unlock(&pf->lock);
+    
+    if (mport_cache_fetch(pf->mport, pf->mirrors, job->bundlefile, job->hash, MPORT_FETCH_QUIET) != MPORT_OK) {
+      if ((error = strdup(mport_err_string())) == NULL)
+        error = strdup("Out of memory.");
+    } else {
+      (void)asprintf(&file, "%s/%s", MPORT_FETCH_STAGING_DIR, job->bundlefile);
+      if (file != NULL && stat(file, &st) == 0)
+        size = st.st_size;
+      free(file);
+    }
+    
+    pthread_mutex_lock(&pf->lock);
+    
+    if (error == NULL) {
+      job->state  = PREFETCH_READY;
+      job->size   = size;
+      pf->staged += size;
+    } else {
+      job->state = PREFETCH_FAILED;
+      job->error = error;
+    }
+    
+    pthread_cond_broadcast(&pf->done);
+  }
+  
+  pthread_mutex_unlock(&pf->lock);
+  
+  return NULL;
+}
+
+
+/* the first entry that still needs fetching, if the cap lets us fetch it.
+ * The entry the installer is waiting for is always fetched. Call with the
+ * lock held. */
+static struct prefetch_job * next_job(mportPrefetch *pf)
+{
+  int i;
+  
+  for (i = pf->next; i < pf->njobs; i++) {
+    if (pf->jobs[i].state != PREFETCH_PENDING)
+      continue;
+    
+    if (i == pf->next || pf->staged < pf->max_staged)
+      return &pf->jobs[i];
+    
+    return NULL;
+  }
+  
+  return NULL;
+}
@@ -0,0 +1,464 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Segmented downloads across several mirrors.
+ *
+ * A single connection to one of our mirrors gets a fraction of the link, so
+ * big bundles are fetched in pieces from several mirrors at once, one
+ * connection each.  The file is split evenly between the mirrors to start
+ * with; a mirror that runs out of work takes the back of whatever segment
+ * has the most left to go, as much of it as its own speed against the
+ * owner's says, so the two should finish together and the slow mirrors end
+ * up with less of the file.  A mirror that fails gives its segment back and
+ * drops out.
+ *
+ * libfetch can only ask for "everything from offset on", so a connection is
+ * simply closed once its segment is done.  The pieces are written with
+ * pwrite() into a preallocated <dest>.seg, which is renamed to dest when
+ * every byte is there.  Anything that goes wrong leaves the caller to fall
+ * back on a plain fetch.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fetch.h>
+#include "mport.h"
+#include "mport_private.h"
+
+struct segment {
+  off_t start;   /* the next byte to fetch; only the owner moves this */
+  off_t end;     /* one past the last byte; a thief may pull this in */
+  int busy;
+  off_t first;   /* where, and when, the owner started on it */
+  struct timespec began;
+  struct segment *next;
+};
+
+struct segfetch {
+  mportInstance *mport;
+  pthread_mutex_t lock;
+  pthread_cond_t done;   /* a segment finished or was given back */
+  const char *filename;
+  int fd;
+  off_t size;
+  off_t got;
+  struct segment *segs;
+  int running;
+};
+
+struct seg_worker {
+  struct segfetch *sf;
+  const char *mirror;
+  double rate;   /* bytes a second on its last segment */
+  pthread_t thread;
+};
+
+static int remote_size(char **, const char *, off_t *);
+static void * seg_worker_main(void *);
+static struct segment * take_segment(struct segfetch *, struct seg_worker *);
+static off_t owner_share(const struct segment *, double);
+static int fetch_segment(struct seg_worker *, struct segment *);
+static void free_segments(struct segment *);
+
+
+/* mport_fetch_segmented(mport, mirrors, filename, dest, flags)
+ *
+ * Fetch filename from several of mirrors at once into dest.  Returns
+ * MPORT_OK only if dest was written; anything else (one mirror, a small
+ * file, a failure) means the caller should fetch it the normal way.
+ */
+int mport_fetch_segmented(mportInstance *mport, char **mirrors, const char *filename, const char *dest, int flags)
+{
+  struct segfetch sf;
+  struct seg_worker workers[MPORT_SEGFETCH_MIRRORS];
+  struct segment *seg, **tail;
+  struct timespec ts, start;
+  char tmp[FILENAME_MAX];
+  char part[FILENAME_MAX];
+  char rate[32];
+  off_t share;
+  int i, n, ret;
+  int quiet = (flags & MPORT_FETCH_QUIET);
+  
+  for (n = 0; mirrors[n] != NULL && n < MPORT_SEGFETCH_MIRRORS; n++)
+    ;
+  
+  if (n < 2)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Not enough mirrors for a segmented fetch.");
+  
+  /* an interrupted plain fetch is better resumed */
+  (void)snprintf(part, sizeof(part), "%s.part", dest);
+  if (mport_file_exists(part))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s is partly fetched already.", filename);
+  
+  bzero(&sf, sizeof(sf));
+  sf.mport    = mport;
+  sf.filename = filename;
+  
+  if (remote_size(mirrors, filename, &sf.size) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (sf.size < MPORT_SEGFETCH_MIN_SIZE)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s is too small for a segmented fetch.", filename);
+  
+  (void)snprintf(tmp, sizeof(tmp), "%s.seg", dest);
+  
+  if ((sf.fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", tmp, strerror(errno));
+  
+  /* not every filesystem can preallocate; a sparse file will do */
+  if (posix_fallocate(sf.fd, 0, sf.size) != 0 && ftruncate(sf.fd, sf.size) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't size %s: %s", tmp, strerror(errno));
+    (void)close(sf.fd);
+    (void)unlink(tmp);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  share = sf.size / n;
+  tail  = &sf.segs;
+  
+  for (i = 0; i < n; i++) {
+    if ((seg = (struct segment *)calloc(1, sizeof(struct segment))) == NULL) {
+      free_segments(sf.segs);
+      (void)close(sf.fd);
+      (void)unlink(tmp);
+      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+    
+    seg->start = share * i;
+    seg->end   = (i == n - 1) ? sf.size : share * (i + 1);
+    *tail = seg;
+    tail  = &seg->next;
+  }
+  
+  (void)pthread_mutex_init(&sf.lock, NULL);
+  (void)pthread_cond_init(&sf.done, NULL);
+  
+  if (!quiet)
+    mport_call_progress_init_cb(mport, "Downloading %s from %d mirrors", filename, n);
+  
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&sf.lock);
+  
+  for (i = 0; i < n; i++) {
+    workers[i].sf     = &sf;
+    workers[i].mirror = mirrors[i];
+    workers[i].rate   = 0;
+    
+    if (pthread_create(&workers[i].thread, NULL, seg_worker_main, &workers[i]) != 0)
+      break;
+    sf.running++;
+  }
+  
+  n = i;
+  
+  while (sf.running > 0) {
+    if (quiet) {
+      pthread_cond_wait(&sf.done, &sf.lock);
+      continue;
+    }
+    
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+    (void)pthread_cond_timedwait(&sf.done, &sf.lock, &ts);
+    (mport->progress_step_cb)(sf.got, sf.size, mport_fetch_rate(rate, sizeof(rate), sf.got, &start));
+  }
+  
+  pthread_mutex_unlock(&sf.lock);
+  
+  for (i = 0; i < n; i++)
+    (void)pthread_join(workers[i].thread, NULL);
+  
+  if (!quiet)
+    (mport->progress_free_cb)();
+  
+  ret = MPORT_OK;
+  
+  for (seg = sf.segs; seg != NULL; seg = seg->next) {
+    if (seg->start < seg->end) {
+      ret = SET_ERRORX(MPORT_ERR_FATAL, "Every mirror failed fetching %s.", filename);
+      break;
+    }
+  }
+  
+  if (close(sf.fd) != 0 && ret == MPORT_OK)
+    ret = SET_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", tmp, strerror(errno));
+  
+  if (ret == MPORT_OK && rename(tmp, dest) != 0)
+    ret = SET_ERRORX(MPORT_ERR_FATAL, "Couldn't rename %s to %s: %s", tmp, dest, strerror(errno));
+  
+  if (ret != MPORT_OK)
+    (void)unlink(tmp);
+  
+  pthread_cond_destroy(&sf.done);
+  pthread_mutex_destroy(&sf.lock);
+  free_segments(sf.segs);
+  
+  return ret;
+}
+
+
+/* the size of filename, from the first mirror that will tell us */
+static int remote_size(char **mirrors, const char *filename, off_t *size)
+{
+  struct url_stat stat;
+  char url[MPORT_URL_MAX];
+  int i;
+  
+  for (i = 0; mirrors[i] != NULL && i < MPORT_SEGFETCH_MIRRORS; i++) {
+    (void)snprintf(url, sizeof(url), "%s/%s/%s", mirrors[i], MPORT_URL_PATH, filename);
+    
+    if (fetchStatURL(url, &stat, "") == 0 && stat.size > 0) {
+      *size = stat.size;
+      return MPORT_OK;
+    }
+  }
+  
+  RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't get the size of %s: %s", filename, mport_fetch_errstr());
+}
+
+
+static void * seg_worker_main(void *arg)
+{
+  struct seg_worker *w = (struct seg_worker *)arg;
+  struct segfetch *sf = w->sf;
+  struct segment *seg;
+  double elapsed;
+  int ret;
+  
+  pthread_mutex_lock(&sf->lock);
+  
+  while ((seg = take_segment(sf, w)) != NULL) {
+    seg->busy  = 1;
+    seg->first = seg->start;
+    (void)clock_gettime(CLOCK_MONOTONIC, &seg->began);
+    pthread_mutex_unlock(&sf->lock);
+    
+    ret = fetch_segment(w, seg);
+    
+    pthread_mutex_lock(&sf->lock);
+    seg->busy = 0;
+    
+    if ((elapsed = mport_mirror_elapsed(&seg->began)) > 0)
+      w->rate = (seg->start - seg->first) / elapsed;
+    
+    pthread_cond_broadcast(&sf->done);
+    
+    /* whatever is left of the segment goes back for someone else */
+    if (ret != MPORT_OK)
+      break;
+  }
+  
+  sf->running--;
+  pthread_cond_broadcast(&sf->done);
+  pthread_mutex_unlock(&sf->lock);
+  
+  return NULL;
+}
+
+
+/* the next segment for worker w: one nobody is on, or else the back of the
+ * busy segment with the most left.  Waits while other workers might still
+ * hand something back, or a segment gets worth splitting; NULL means
+ * there's nothing left to do.  Call with the lock held. */
+static struct segment * take_segment(struct segfetch *sf, struct seg_worker *w)
+{
+  struct segment *seg, *big, *steal;
+  struct timespec ts;
+  off_t keep = 0;
+  int busy;
+  
+  while (1) {
+    big  = NULL;
+    busy = 0;
+    
+    for (seg = sf->segs; seg != NULL; seg = seg->next) {
+      if (seg->start >= seg->end)
+        continue;
+      if (!seg->busy)
+        return seg;
+      
+      busy++;
+      if (big == NULL || seg->end - seg->start > big->end - big->start)
+        big = seg;
+    }
+    
+    if (big != NULL && (keep = owner_share(big, w->rate)) > 0) {
+      if ((steal = (struct segment *)calloc(1, sizeof(struct segment))) == NULL)
+        return NULL;
+      
+      steal->end   = big->end;
+      steal->start = big->start + keep;
+      big->end     = steal->start;
+      steal->next  = big->next;
+      big->next    = steal;
+      
+      return steal;
+    }
+    
+    if (busy == 0 || sf->running <= 1)
+      return NULL;
+    
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += MPORT_SEGFETCH_SETTLE * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    (void)pthread_cond_timedwait(&sf->done, &sf->lock, &ts);
+  }
+}
+
+
+/* how much of busy segment seg its owner keeps if a worker fetching at rate
+ * takes the rest: a share in proportion to the two rates, so both should be
+ * done together, or half if either rate isn't known yet.  0 if what's left
+ * isn't worth splitting.  Call with the lock held. */
+static off_t owner_share(const struct segment *seg, double rate)
+{
+  off_t left = seg->end - seg->start;
+  off_t keep = left / 2;
+  double elapsed = mport_mirror_elapsed(&seg->began);
+  double owner;
+  
+  /* a new connection's first burst says little about the mirror */
+  if (rate > 0 && elapsed * 1000 >= MPORT_SEGFETCH_SETTLE) {
+    owner = (seg->start - seg->first) / elapsed;
+    keep  = (off_t)(left * (owner / (owner + rate)));
+  }
+  
+  /* the owner may be reading a buffer past its start as we speak */
+  if (keep < MPORT_SEGFETCH_BUFSIZE)
+    keep = MPORT_SEGFETCH_BUFSIZE;
+  
+  if (left - keep < MPORT_SEGFETCH_MIN_SPLIT)
+    return 0;
+  
+  return keep;
+}
+
+
+/* fetch seg from this worker's mirror, until its end (which can move) */
+static int fetch_segment(struct seg_worker *w, struct segment *seg)
+{
+  struct segfetch *sf = w->sf;
+  struct url_stat stat;
+  struct url *u;
+  FILE *remote;
+  char url[MPORT_URL_MAX];
+  char buffer[MPORT_SEGFETCH_BUFSIZE];
+  size_t want, got;
+  off_t start, first;
+  struct timespec begin;
+  double connect;
+  
+  (void)snprintf(url, sizeof(url), "%s/%s/%s", w->mirror, MPORT_URL_PATH, sf->filename);
+  
+  if ((u = fetchParseURL(url)) == NULL)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+  
+  pthread_mutex_lock(&sf->lock);
+  first = start = u->offset = seg->start;
+  pthread_mutex_unlock(&sf->lock);
+  
+  (void)clock_gettime(CLOCK_MONOTONIC, &begin);
+  
+  if ((remote = fetchXGet(u, &stat, "p")) == NULL) {
+    fetchFreeURL(u);
+    mport_mirror_sample(sf->mport, w->mirror, 0, 0, 0, 0);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, mport_fetch_errstr());
+  }
+  
+  connect = mport_mirror_elapsed(&begin);
+  (void)clock_gettime(CLOCK_MONOTONIC, &begin);
+  
+  /* a mirror with a different file, or one that ignores ranges, is no use */
+  if (stat.size != sf->size || u->offset != start) {
+    fclose(remote);
+    fetchFreeURL(u);
+    mport_mirror_sample(sf->mport, w->mirror, 0, 0, 0, 0);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s doesn't match the other mirrors.", url);
+  }
+  
+  fetchFreeURL(u);
+  
+  while (1) {
+    pthread_mutex_lock(&sf->lock);
+    want = (size_t)MIN((off_t)sizeof(buffer), seg->end - seg->start);
+    pthread_mutex_unlock(&sf->lock);
+    
+    if (want == 0)
+      break;
+    
+    if ((got = fread(buffer, 1, want, remote)) == 0) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, ferror(remote) ? mport_fetch_errstr() : "short read");
+      mport_mirror_sample(sf->mport, w->mirror, 0, 0, 0, 0);
+      fclose(remote);
+      RETURN_CURRENT_ERROR;
+    }
+    
+    if (pwrite(sf->fd, buffer, got, start) != (ssize_t)got) {
+      fclose(remote);
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", sf->filename, strerror(errno));
+    }
+    
+    start += got;
+    
+    pthread_mutex_lock(&sf->lock);
+    seg->start = start;
+    sf->got   += got;
+    pthread_mutex_unlock(&sf->lock);
+  }
+  
+  fclose(remote);
+  
+  mport_mirror_sample(sf->mport, w->mirror, 1, connect, start - first, mport_mirror_elapsed(&begin));
+  
+  return MPORT_OK;
+}
+
+
+static void free_segments(struct segment *seg)
+{
+  struct segment *next;
+  
+  for (; seg != NULL; seg = next) {
+    next = seg->next;
+    free(seg);
+  }
+}
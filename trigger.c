@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2009 Chris Reinhardt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $MidnightBSD$
+ */
+
+/* Deferred @exec commands.
+ *
+ * Lots of packages run the same command after installing: ldconfig -m,
+ * fc-cache, update-desktop-database...  Running them once per package is a
+ * big part of installing many packages, and pointless.  Simple commands that
+ * match a registered pattern (see default_patterns, and 
+ * mport_trigger_register()), and everything flagged with @trigger in a plist,
+ * are queued on the instance
+ * instead, once per distinct command and directory, and run when the
+ * outermost operation ends.  Every other @exec runs in place, so ordering
+ * between those is unchanged.  A package whose install is rolled back takes
+ * the triggers it queued with it.
+ *
+ * An operation is anything between mport_batch_begin() and mport_batch_end();
+ * the install, update and delete entry points each make one, and callers can
+ * wrap several in their own.  Outside of any, triggers just run.
+ */
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mport.h"
+#include "mport_private.h"
+
+struct trigger {
+  char *cwd;
+  char *cmnd;
+  struct trigger *next;
+};
+
+struct _TriggerSet {
+  int depth;
+  char **patterns;
+  int npatterns;
+  struct trigger *head;
+  struct trigger *tail;
+  int queued;
+};
+
+/* matched against the whole command, less the program's directory */
+static const char *default_patterns[] = {
+  "ldconfig -m *",
+  "ldconfig -R",
+  "ldconfig -R *",
+  "fc-cache",
+  "fc-cache *",
+  "update-desktop-database",
+  "update-desktop-database *",
+  "update-mime-database *",
+  "gtk-update-icon-cache *",
+  "glib-compile-schemas *",
+  "gio-querymodules *",
+  NULL
+};
+
+/* anything with these in it is more than one command, or depends on state
+ * that may have changed by the end of the operation */
+#define SHELL_SPECIALS ";&|<>`$(){}\n\\"
+
+static int get_set(mportInstance *, struct _TriggerSet **);
+static int add_pattern(struct _TriggerSet *, const char *);
+static void free_trigger(struct trigger *);
+
+
+/*
+ * mport_trigger_register(mport, pattern)
+ *
+ * defer any @exec or @unexec command matching pattern (an fnmatch(3) pattern,
+ * matched against the whole command after substitutions, with any directory
+ * taken off the program name).  Only simple commands are deferred; one with 
+ * shell syntax in it always runs in place.
+ */
+MPORT_PUBLIC_API int mport_trigger_register(mportInstance *mport, const char *pattern)
+{
+  struct _TriggerSet *set;
+  
+  if (get_set(mport, &set) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return add_pattern(set, pattern);
+}
+
+
+/*
+ * mport_batch_begin(mport)
+ *
+ * start an operation; triggers are held until the matching mport_batch_end().
+ * These nest.
+ */
+MPORT_PUBLIC_API int mport_batch_begin(mportInstance *mport)
+{
+  struct _TriggerSet *set;
+  
+  if (get_set(mport, &set) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  set->depth++;
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_batch_end(mport)
+ *
+ * end an operation.  If it's the outermost one, run the queued triggers.
+ * A trigger that fails is reported through the msg callback; the others still
+ * run, and this still returns MPORT_OK, since the packages are installed.
+ */
+MPORT_PUBLIC_API int mport_batch_end(mportInstance *mport)
+{
+  return mport_batch_finish(mport, MPORT_OK);
+}
+
+
+/*
+ * mport_batch_finish(mport, ret)
+ *
+ * mport_batch_end() for our own entry points: ret is the operation's result,
+ * and is returned, along with its error, whatever the triggers do.
+ */
+int mport_batch_finish(mportInstance *mport, int ret)
+{
+  struct _TriggerSet *set = mport->triggers;
+  struct trigger *t;
+  char err[256];
+  int code;
+  
+  if (set == NULL || set->depth == 0 || --set->depth > 0)
+    return ret;
+  
+  code = mport_err_code();
+  (void)strlcpy(err, mport_err_string(), sizeof(err));
+  
+  /* installs that finished in a transaction the caller has since ended; if
+   * it's still open they wait for the next chance */
+  if (mport_journal_settle(mport) != MPORT_OK)
+    mport_call_msg_cb(mport, "Couldn't settle finished installs: %s", mport_err_string());
+  
+  while ((t = set->head) != NULL) {
+    set->head = t->next;
+    
+    if (mport_shell_in_dir(mport, t->cwd, t->cmnd) != MPORT_OK)
+      mport_call_msg_cb(mport, "Trigger '%s' failed: %s", t->cmnd, mport_err_string());
+    
+    free_trigger(t);
+  }
+  
+  set->tail   = NULL;
+  set->queued = 0;
+  
+  /* put back the operation's error, or clear any from the triggers */
+  if (ret != MPORT_OK)
+    (void)mport_set_err(code, err);
+  else
+    (void)mport_set_err(MPORT_OK, NULL);
+  
+  return ret;
+}
+
+
+/*
+ * mport_trigger_matches(mport, cmnd)
+ *
+ * returns non-zero if cmnd should be deferred.
+ */
+int mport_trigger_matches(mportInstance *mport, const char *cmnd)
+{
+  struct _TriggerSet *set;
+  const char *prog;
+  size_t len;
+  int i;
+  
+  if (strpbrk(cmnd, SHELL_SPECIALS) != NULL)
+    return 0;
+  
+  /* /sbin/ldconfig -m /usr/local/lib matches "ldconfig -m *" */
+  prog = cmnd + strspn(cmnd, " \t");
+  for (len = strcspn(prog, " \t"); len > 0 && prog[len - 1] != '/'; len--)
+    ;
+  prog += len;
+  
+  if (get_set(mport, &set) != MPORT_OK) {
+    /* we're out of memory; it'll just run now */
+    (void)mport_set_err(MPORT_OK, NULL);
+    return 0;
+  }
+  
+  for (i = 0; i < set->npatterns; i++) {
+    if (fnmatch(set->patterns[i], prog, 0) == 0)
+      return 1;
+  }
+  
+  return 0;
+}
+
+
+/*
+ * mport_trigger_queue(mport, cwd, cmnd)
+ *
+ * run cmnd in cwd at the end of the current operation, unless it's queued 
+ * already.  Outside of an operation it runs now.
+ */
+int mport_trigger_queue(mportInstance *mport, const char *cwd, const char *cmnd)
+{
+  struct _TriggerSet *set;
+  struct trigger *t;
+  
+  if (get_set(mport, &set) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (set->depth == 0)
+    return mport_shell_in_dir(mport, cwd, cmnd);
+  
+  for (t = set->head; t != NULL; t = t->next) {
+    if (strcmp(t->cmnd, cmnd) == 0 && strcmp(t->cwd, cwd) == 0)
+      return MPORT_OK;
+  }
+  
+  if ((t = (struct trigger *)calloc(1, sizeof(struct trigger))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  if ((t->cwd = strdup(cwd)) == NULL || (t->cmnd = strdup(cmnd)) == NULL) {
+    free_trigger(t);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  
+  /* run in the order they were first asked for */
+  if (set->tail == NULL)
+    set->head = t;
+  else
+    set->tail->next = t;
+  set->tail = t;
+  set->queued++;
+  
+  return MPORT_OK;
+}
+
+
+/*
+ * mport_trigger_mark(mport)
+ *
+ * returns a mark for mport_trigger_drop(), taken before a package starts
+ * installing.
+ */
+int mport_trigger_mark(mportInstance *mport)
+{
+  return mport->triggers == NULL ? 0 : mport->triggers->queued;
+}
+
+
+/*
+ * mport_trigger_drop(mport, mark)
+ *
+ * forget every trigger queued since mark was taken; the package that queued
+ * them didn't get installed.  One it asked for that was queued already stays,
+ * since a package before it still needs it.
+ */
+void mport_trigger_drop(mportInstance *mport, int mark)
+{
+  struct _TriggerSet *set = mport->triggers;
+  struct trigger *t, *keep = NULL;
+  int i;
+  
+  if (set == NULL || set->queued <= mark)
+    return;
+  
+  for (i = 0, t = set->head; i < mark; i++, t = t->next)
+    keep = t;
+  
+  if (keep == NULL)
+    set->head = NULL;
+  else
+    keep->next = NULL;
+  
+  set->tail   = keep;
+  set->queued = mark;
+  
+  while (t != NULL) {
+    keep = t->next;
+    free_trigger(t);
+    t = keep;
+  }
+}
+
+
+/*
+ * mport_trigger_set_free(set)
+ *
+ * free the instance's triggers.  Anything still queued is dropped.
+ */
+void mport_trigger_set_free(struct _TriggerSet *set)
+{
+  struct trigger *t;
+  int i;
+  
+  if (set == NULL)
+    return;
+  
+  while ((t = set->head) != NULL) {
+    set->head = t->next;
+    free_trigger(t);
+  }
+  
+  for (i = 0; i < set->npatterns; i++)
+    free(set->patterns[i]);
+  
+  free(set->patterns);
+  free(set);
+}
+
+
+static int get_set(mportInstance *mport, struct _TriggerSet **setp)
+{
+  struct _TriggerSet *set;
+  int i;
+  
+  if (mport->triggers != NULL) {
+    *setp = mport->triggers;
+    return MPORT_OK;
+  }
+  
+  if ((set = (struct _TriggerSet *)calloc(1, sizeof(struct _TriggerSet))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  for (i = 0; default_patterns[i] != NULL; i++) {
+    if (add_pattern(set, default_patterns[i]) != MPORT_OK) {
+      mport_trigger_set_free(set);
+      RETURN_CURRENT_ERROR;
+    }
+  }
+  
+  *setp = mport->triggers = set;
+  
+  return MPORT_OK;
+}
+
+
+static int add_pattern(struct _TriggerSet *set, const char *pattern)
+{
+  char **patterns;
+  
+  if ((patterns = (char **)realloc(set->patterns, (set->npatterns + 1) * sizeof(char *))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  set->patterns = patterns;
+  
+  if ((set->patterns[set->npatterns] = strdup(pattern)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  set->npatterns++;
+  
+  return MPORT_OK;
+}
+
+
+static void free_trigger(struct trigger *t)
+{
+  free(t->cwd);
+  free(t->cmnd);
+  free(t);
+}
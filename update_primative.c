@@ -32,10 +32,21 @@
 #include "mport_private.h"
 #include <string.h>
 #include <stdlib.h>
+static int update_bundle(mportInstance *, const char *);
 static int set_prefix_to_installed(mportInstance *, mportPackageMeta *);
 
 
 MPORT_PUBLIC_API int mport_update_primative(mportInstance *mport, const char *filename)
+{
+  /* triggers from the old packages' removal and the new ones' install run once */
+  if (mport_batch_begin(mport) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  return mport_batch_finish(mport, update_bundle(mport, filename));
+}
+
+
+static int update_bundle(mportInstance *mport, const char *filename)
 {
   mportBundleRead *bundle;
   mportPackageMeta **pkgs, *pkg;
@@ -44,6 +55,8 @@ MPORT_PUBLIC_API int mport_update_primative(mportInstance *mport, const char *fi
   if ((bundle = mport_bundle_read_new()) == NULL)
     RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
   
+  bundle->threads = mport->bundle_threads;
+  
   if (mport_bundle_read_init(bundle, filename) != MPORT_OK)
     RETURN_CURRENT_ERROR;
 
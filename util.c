@@ -28,16 +28,43 @@
 
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include "mport.h"
 #include "mport_private.h"
 
+struct rmtree_job {
+  int dirfd;
+  char **names;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+  char *error;
+};
+
+extern char **environ;
+
+static int shell_quote(const char *, char *, size_t);
+static void expand_asset_exec(const char *, const char *, const char *, char *, size_t);
+static int remove_tree_at(int, const char *, const char *);
+static void * rmtree_worker(void *);
+static int copy_data(int, int, const char *);
+
 
 /* these two aren't really utilities, but there's no better place to put them */
 MPORT_PUBLIC_API mportCreateExtras* mport_createextras_new()
@@ -79,48 +106,326 @@ MPORT_PUBLIC_API void mport_createextras_free(mportCreateExtras *extra)
 }
 
 
-/* a wrapper around chdir, to work with our error system */
-int mport_chdir(mportInstance *mport, const char *dir)
+/* mport_open_rootdir(mport, dir, &fd)
+ *
+ * open dir (an absolute path inside mport's root) as a directory fd, creating
+ * it if need be.  This is what we use instead of chdir, which is per process.
+ */
+int mport_open_rootdir(mportInstance *mport, const char *dir, int *fdp)
 {
-  if (mport != NULL) {
-    char *finaldir;
+  char path[FILENAME_MAX];
+  char *p;
   
-    asprintf(&finaldir, "%s%s", mport->root, dir);
+  while (*dir == '/')
+    dir++;
   
-    if (finaldir == NULL)
-      RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't building root'ed dir");
+  if (*dir == '\0')
+    dir = ".";
     
-    if (chdir(finaldir) != 0) {
-      free(finaldir);
-      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't chdir to %s: %s", finaldir, strerror(errno));
-    }
+  if ((*fdp = openat(mport->rootfd, dir, O_RDONLY|O_DIRECTORY)) != -1)
+    return MPORT_OK;
   
-    free(finaldir);
-  } else {
-    if (chdir(dir) != 0) 
-      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't chdir to %s: %s", dir, strerror(errno));
+  if (errno != ENOENT)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s%s: %s", mport->root, dir, strerror(errno));
+  
+  /* mkdir -p */
+  if (strlcpy(path, dir, sizeof(path)) >= sizeof(path))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: path too long", dir);
+  
+  for (p = path; p != NULL; ) {
+    if ((p = strchr(p + 1, '/')) != NULL)
+      *p = '\0';
+    
+    if (mkdirat(mport->rootfd, path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) != 0 && errno != EEXIST)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't mkdir %s/%s: %s", mport->root, path, strerror(errno));
+    
+    if (p != NULL)
+      *p = '/';
   }
   
+  if ((*fdp = openat(mport->rootfd, dir, O_RDONLY|O_DIRECTORY)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s/%s: %s", mport->root, dir, strerror(errno));
+  
   return MPORT_OK;
 }    
 
 
 /* deletes the entire directory tree at name.
  * think rm -r filename
+ *
+ * This is done in process, with unlinkat().  If the top of the tree has a few
+ * subdirectories, they're removed by a handful of threads at once.
  */
 int mport_rmtree(const char *filename) 
 {
-  return mport_xsystem(NULL, "/bin/rm -r %s", filename);
+  struct rmtree_job job;
+  pthread_t threads[MPORT_RMTREE_THREADS];
+  struct dirent *de;
+  struct stat st;
+  char **names;
+  DIR *dir;
+  int fd, i, nthreads = 0, allocated = 0;
+  
+  if (lstat(filename, &st) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", filename, strerror(errno));
+  
+  if (!S_ISDIR(st.st_mode)) {
+    if (unlink(filename) != 0)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", filename, strerror(errno));
+    return MPORT_OK;
+  }
+  
+  bzero(&job, sizeof(job));
+  
+  if ((fd = open(filename, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) == -1 || (dir = fdopendir(fd)) == NULL) {
+    if (fd != -1)
+      (void)close(fd);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", filename, strerror(errno));
+  }
+  
+  job.dirfd = dirfd(dir);
+  
+  /* files go now, subdirectories are collected to be split up */
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    
+    if (fstatat(job.dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Couldn't stat %s/%s: %s", filename, de->d_name, strerror(errno));
+      goto ERROR;
+    }
+    
+    if (!S_ISDIR(st.st_mode)) {
+      if (unlinkat(job.dirfd, de->d_name, 0) != 0) {
+        SET_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s/%s: %s", filename, de->d_name, strerror(errno));
+        goto ERROR;
+      }
+      continue;
+    }
+    
+    if (job.count == allocated) {
+      allocated = allocated == 0 ? 16 : allocated * 2;
+      if ((names = (char **)realloc(job.names, allocated * sizeof(char *))) == NULL) {
+        SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+        goto ERROR;
+      }
+      job.names = names;
+    }
+    
+    if ((job.names[job.count] = strdup(de->d_name)) == NULL) {
+      SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+      goto ERROR;
+    }
+    
+    job.count++;
+  }
+  
+  (void)pthread_mutex_init(&job.lock, NULL);
+  
+  /* fewer threads than asked for, or none, is fine; this thread works too */
+  if (job.count >= MPORT_RMTREE_MIN_SUBDIRS) {
+    for (i = 0; i < MPORT_RMTREE_THREADS && i < job.count - 1; i++) {
+      if (pthread_create(&threads[nthreads], NULL, rmtree_worker, &job) != 0)
+        break;
+      nthreads++;
+    }
+  }
+  
+  (void)rmtree_worker(&job);
+  
+  for (i = 0; i < nthreads; i++)
+    (void)pthread_join(threads[i], NULL);
+  
+  pthread_mutex_destroy(&job.lock);
+  
+  if (job.error != NULL) {
+    SET_ERROR(MPORT_ERR_FATAL, job.error);
+    goto ERROR;
+  }
+  
+  for (i = 0; i < job.count; i++)
+    free(job.names[i]);
+  free(job.names);
+  (void)closedir(dir);
+  
+  if (rmdir(filename) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", filename, strerror(errno));
+  
+  return MPORT_OK;
+  
+  ERROR:
+    for (i = 0; i < job.count; i++)
+      free(job.names[i]);
+    free(job.names);
+    free(job.error);
+    (void)closedir(dir);
+    RETURN_CURRENT_ERROR;
+}  
+
+
+static void * rmtree_worker(void *arg)
+{
+  struct rmtree_job *job = (struct rmtree_job *)arg;
+  const char *name;
+  
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    
+    /* after a failure, leave the rest alone */
+    if (job->error != NULL || job->next == job->count) {
+      pthread_mutex_unlock(&job->lock);
+      return NULL;
+    }
+    
+    name = job->names[job->next++];
+    pthread_mutex_unlock(&job->lock);
+    
+    if (remove_tree_at(job->dirfd, name, name) != MPORT_OK) {
+      pthread_mutex_lock(&job->lock);
+      if (job->error == NULL)
+        job->error = strdup(mport_err_string());
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+}
+
+
+/* remove the directory name, relative to dirfd, and everything under it */
+static int remove_tree_at(int dirfd, const char *name, const char *path)
+{
+  char sub[FILENAME_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+  int fd, isdir;
+  
+  if ((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) == -1 || (dir = fdopendir(fd)) == NULL) {
+    if (fd != -1)
+      (void)close(fd);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", path, strerror(errno));
+  }
+  
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    
+    /* d_type saves a stat, when the filesystem fills it in */
+    if (de->d_type != DT_UNKNOWN) {
+      isdir = (de->d_type == DT_DIR);
+    } else if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      isdir = S_ISDIR(st.st_mode);
+    } else {
+      (void)closedir(dir);
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't stat %s/%s: %s", path, de->d_name, strerror(errno));
+    }
+    
+    (void)snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+    
+    if (isdir) {
+      if (remove_tree_at(fd, de->d_name, sub) != MPORT_OK) {
+        (void)closedir(dir);
+        RETURN_CURRENT_ERROR;
+      }
+    } else if (unlinkat(fd, de->d_name, 0) != 0) {
+      (void)closedir(dir);
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", sub, strerror(errno));
+    }
+  }
+  
+  (void)closedir(dir);
+  
+  if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't remove %s: %s", path, strerror(errno));
+  
+  return MPORT_OK;
 }  
 
 
 /*
  * Copy fromname to toname 
  *
+ * Like cp, toname is truncated if it exists, and created with fromname's mode
+ * if it doesn't.  Where the system can, the data is copied in the kernel, or
+ * not at all on filesystems that can share the blocks.
  */
 int mport_copy_file(const char *fromname, const char *toname)
 {
-  return mport_xsystem(NULL, "/bin/cp %s %s", fromname, toname);
+  struct stat st;
+  int in, out;
+  
+  if ((in = open(fromname, O_RDONLY)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", fromname, strerror(errno));
+  
+  if (fstat(in, &st) != 0) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't stat %s: %s", fromname, strerror(errno));
+    (void)close(in);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if ((out = open(toname, O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & ALLPERMS)) == -1) {
+    SET_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", toname, strerror(errno));
+    (void)close(in);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  if (copy_data(in, out, toname) != MPORT_OK) {
+    (void)close(in);
+    (void)close(out);
+    RETURN_CURRENT_ERROR;
+  }
+  
+  (void)close(in);
+  
+  if (close(out) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", toname, strerror(errno));
+  
+  return MPORT_OK;
+}
+
+
+static int copy_data(int in, int out, const char *toname)
+{
+  char buf[MPORT_COPY_BUFSIZE];
+  ssize_t r, w, off;
+  
+#ifdef FICLONE
+  /* a reflink shares the blocks; nothing is copied at all */
+  if (ioctl(out, FICLONE, in) == 0)
+    return MPORT_OK;
+#endif
+
+#ifdef SYS_copy_file_range
+  /* in the kernel; falls back below if the filesystems can't do it */
+  while ((r = copy_file_range(in, NULL, out, NULL, SSIZE_MAX, 0)) > 0)
+    ;
+  
+  if (r == 0)
+    return MPORT_OK;
+  
+  if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", toname, strerror(errno));
+#endif
+  
+  /* copy_file_range moves the offsets as it goes, so carry on from there */
+  while ((r = read(in, buf, sizeof(buf))) != 0) {
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't copy to %s: %s", toname, strerror(errno));
+    }
+    
+    for (off = 0; off < r; off += w) {
+      if ((w = write(out, buf + off, r - off)) == -1) {
+        if (errno == EINTR) {
+          w = 0;
+          continue;
+        }
+        RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", toname, strerror(errno));
+      }
+    }
+  }
+  
+  return MPORT_OK;
 }
 
 
@@ -172,16 +477,96 @@ int mport_file_exists(const char *file)
 }
 
 
+/* mport_spawn(mportInstance *mport, argv, env)
+ *
+ * Run argv[0] (an absolute path) with the arguments in argv and wait for it.
+ * env is a NULL terminated list of extra "NAME=value" strings, which override
+ * the same names in our environment; it may be NULL.
+ *
+ * If mport is non-NULL and has a root set, the program runs chroot'ed into
+ * mport->root; that's done in a vfork()ed child, since posix_spawn() can't.
+ * Either way there's no shell or chroot(8) in between.
+ *
+ * Returns MPORT_OK if the program exited 0, and sets an error saying how it
+ * went wrong otherwise.
+ */
+int mport_spawn(mportInstance *mport, const char *const *argv, const char *const *env)
+{
+  const char *const *e;
+  char **envp, **p;
+  size_t len, n = 1;
+  pid_t pid;
+  int status, err;
+  
+  for (p = environ; *p != NULL; p++)
+    n++;
+  for (e = env; e != NULL && *e != NULL; e++)
+    n++;
+  
+  if ((envp = (char **)calloc(n, sizeof(char *))) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  
+  n = 0;
+  for (e = env; e != NULL && *e != NULL; e++)
+    envp[n++] = (char *)*e;
+  
+  for (p = environ; *p != NULL; p++) {
+    for (e = env; e != NULL && *e != NULL; e++) {
+      len = strcspn(*e, "=");
+      if (strncmp(*p, *e, len) == 0 && (*p)[len] == '=')
+        break;
+    }
+    
+    if (e == NULL || *e == NULL)
+      envp[n++] = *p;
+  }
+  
+  if (mport != NULL && *(mport->root) != '\0') {
+    /* the child only makes system calls until it execs or exits */
+    if ((pid = vfork()) == 0) {
+      if (chroot(mport->root) != 0 || chdir("/") != 0)
+        _exit(126);
+      (void)execve(argv[0], (char *const *)argv, envp);
+      _exit(127);
+    }
+    
+    err = (pid == -1) ? errno : 0;
+  } else {
+    err = posix_spawn(&pid, argv[0], NULL, NULL, (char *const *)argv, envp);
+  }
+  
+  free(envp);
+  
+  if (err != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't run %s: %s", argv[0], strerror(err));
+  
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't wait for %s: %s", argv[0], strerror(errno));
+  }
+  
+  if (WIFSIGNALED(status))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s killed by signal %i", argv[0], WTERMSIG(status));
+  
+  if (WEXITSTATUS(status) != 0)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s returned non-zero: %i", argv[0], WEXITSTATUS(status));
+  
+  return MPORT_OK;
+}
+
+
 /* mport_xsystem(mportInstance *mport, char *fmt, ...)
  * 
  * Our own version on system that takes a format string and a list 
  * of values.  The fmt works exactly like the stdio output formats.
  * 
  * If mport is non-NULL and has a root set, your command will run 
- * chroot'ed into mport->root.
+ * chroot'ed into mport->root.  This is mport_spawn() of sh -c; use that
+ * directly if you don't need a shell.
  */
 int mport_xsystem(mportInstance *mport, const char *fmt, ...) 
 {
+  const char *argv[4];
   va_list args;
   char *cmnd;
   int ret;
@@ -189,22 +574,17 @@ int mport_xsystem(mportInstance *mport, const char *fmt, ...)
   va_start(args, fmt);
   
   if (vasprintf(&cmnd, fmt, args) == -1) {
-    /* XXX How will the caller know this is no mem, and not a failed exec? */
     va_end(args);
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate xsystem cmnd string.");
   }
   va_end(args);
   
-  if (mport != NULL && *(mport->root) != '\0') {
-    char *chroot_cmd;
-    if (asprintf(&chroot_cmd, "%s %s %s", MPORT_CHROOT_BIN, mport->root, cmnd) == -1)
-      RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate xsystem chroot string.");
+  argv[0] = MPORT_SH_BIN;
+  argv[1] = "-c";
+  argv[2] = cmnd;
+  argv[3] = NULL;
   
-    free(cmnd);
-    cmnd = chroot_cmd;
-  }
-    
-  ret = system(cmnd);
+  ret = mport_spawn(mport, argv, NULL);
   
   free(cmnd);
   
@@ -275,14 +655,50 @@ void mport_parselist(char *opt, char ***list)
  * %D	The current working directory (cwd)
  * %B	Return the directory part ("dirname") of %D/%F
  * %f	Return the filename part of ("basename") %D/%F
+ *
+ * The command runs in cwd, by way of a cd in the shell; we don't chdir the
+ * process, since other threads may be installing elsewhere.
  */
 int mport_run_asset_exec(mportInstance *mport, const char *fmt, const char *cwd, const char *last_file) 
+{
+  char cmnd[FILENAME_MAX * 2];
+  
+  expand_asset_exec(fmt, cwd, last_file, cmnd, sizeof(cmnd));
+  
+  /* cmnd now hold the expaded command; things like ldconfig are put off
+   * until the end of the operation, everything else runs now */
+  if (mport_trigger_matches(mport, cmnd))
+    return mport_trigger_queue(mport, cwd, cmnd);
+  
+  return mport_shell_in_dir(mport, cwd, cmnd);
+}
+
+
+/*
+ * mport_run_asset_trigger(fmt, cwd, last_file)
+ *
+ * handles a @trigger directive: like @exec, but always deferred to the end of
+ * the operation, and only run once however many packages ask for it.
+ */
+int mport_run_asset_trigger(mportInstance *mport, const char *fmt, const char *cwd, const char *last_file) 
+{
+  char cmnd[FILENAME_MAX * 2];
+  
+  expand_asset_exec(fmt, cwd, last_file, cmnd, sizeof(cmnd));
+  
+  return mport_trigger_queue(mport, cwd, cmnd);
+}
+
+
+/* do the @exec substitutions on fmt into cmnd, which is max bytes */
+static void expand_asset_exec(const char *fmt, const char *cwd, const char *last_file, char *cmnd, size_t max)
 {
   size_t l;
-  size_t max = FILENAME_MAX * 2;
-  char cmnd[max];
   char *pos = cmnd;
   char *name;
+  
+  /* leave room for the nul */
+  max--;
 
   while (*fmt && max > 0) {
     if (*fmt == '%') {
@@ -330,9 +746,62 @@ int mport_run_asset_exec(mportInstance *mport, const char *fmt, const char *cwd,
   }
   
   *pos = '\0';
+}
+
+
+/* 
+ * mport_shell_in_dir(mport, cwd, cmnd)
+ *
+ * run cmnd with sh, in cwd (absolute within the instance's root).
+ */
+int mport_shell_in_dir(mportInstance *mport, const char *cwd, const char *cmnd)
+{
+  char script[FILENAME_MAX * 3], qcwd[FILENAME_MAX * 4];
+  const char *argv[4];
+  
+  if (shell_quote(cwd, qcwd, sizeof(qcwd)) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  
+  if (snprintf(script, sizeof(script), "cd %s && %s", qcwd, cmnd) >= (int)sizeof(script))
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Command too long: %s", cmnd);
+  
+  argv[0] = MPORT_SH_BIN;
+  argv[1] = "-c";
+  argv[2] = script;
+  argv[3] = NULL;
+  
+  return mport_spawn(mport, argv, NULL);
+}
+
 
-  /* cmnd now hold the expaded command, now execute it*/
-  return mport_xsystem(mport, cmnd);
+/* wrap str in single quotes for /bin/sh */
+static int shell_quote(const char *str, char *out, size_t len)
+{
+  size_t i = 0;
+  
+  for (out[i++] = '\''; *str != '\0'; str++) {
+    /* ' becomes '\'' */
+    if (*str == '\'') {
+      if (i + 4 >= len)
+        break;
+      out[i++] = '\'';
+      out[i++] = '\\';
+      out[i++] = '\'';
+      out[i++] = '\'';
+    } else {
+      if (i + 1 >= len)
+        break;
+      out[i++] = *str;
+    }
+  }
+  
+  if (*str != '\0' || i + 2 > len)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Command too long: %s", str);
+  
+  out[i++] = '\'';
+  out[i]   = '\0';
+  
+  return MPORT_OK;
 }          
 
 